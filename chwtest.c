@@ -29,6 +29,7 @@
  *
  */
 #include "Python.h"
+#include "structmember.h"
 #include <sys/mman.h>
 #include <sys/io.h>
 #include <sys/types.h>
@@ -36,386 +37,6145 @@
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <linux/types.h>
 #include "khwtest.h"
 
 #define MEMORY_MAP 2
 #define ACCESS_MODE MEMORY_MAP
 
-/* File handle to physical memory */
+/*
+ * Files are opened on first use rather than at import, so that a script
+ * only pays for what it uses: /dev/mem on the first access that maps it,
+ * khwtest on the first DMA or System RAM access and I/O privileges on the
+ * first port access.  startup_stats() reports what each step took.
+ */
 static int mem_fd = -1;
 static int khwtest_fd = -1;
+/* iopl() only applies to the calling thread and the threads it creates
+ * afterwards, so threads that already exist enable I/O for themselves. */
+static __thread int io_allowed = 0;
+static int emulated = 0;	/* HWTEST_MEM backend, see below */
+
+static struct {
+	uint64_t init_ns;
+	uint64_t backend_ns;
+	uint64_t iomem_ns;
+	uint64_t mem_open_ns;
+	uint64_t khwtest_open_ns;
+	uint64_t iopl_ns;
+} startup;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Normally physical memory is /dev/mem and khwtest.  HWTEST_MEM points both
+ * at an ordinary file instead, or at an anonymous memory file of the given
+ * size with "memfd:SIZE", so that the library can be exercised and
+ * benchmarked without root or hardware.  HWTEST_KHWTEST overrides the file
+ * used in place of khwtest and HWTEST_RAM_HIGH the address below which it
+ * is used, unless HWTEST_IOMEM names an iomem file to route by.  Port I/O is
+ * not available with these backends.
+ */
+static const char *mem_path = "/dev/mem";
+static const char *khwtest_path = "/dev/khwtest";
 static unsigned long ram_high = 0x20000000;
 
-static unsigned long base_address = 0;
-static unsigned long base_offset = 0;
-void *mmaped_ptr = NULL;
+/*
+ * Physical address map, read from /proc/iomem at load time.  Each access is
+ * routed by the range it falls in: System RAM goes through khwtest (or a
+ * mapped DMA buffer), everything else, device memory, firmware reserved
+ * areas and addresses not listed at all, is mapped from /dev/mem.  The
+ * table covers the whole address space without gaps and is never changed
+ * after load, so lookups need no lock.  Each range counts the accesses
+ * routed through it.
+ */
+#define RANGE_RAM		0
+#define RANGE_RESERVED		1
+#define RANGE_MMIO		2
+
+struct phys_range {
+	unsigned long start;
+	unsigned long end;	/* exclusive, ULONG_MAX for the last range */
+	int kind;
+	char name[64];
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long bytes;
+};
+
+static struct phys_range *ranges = NULL;
+static int nr_ranges = 0;
+static const char *iomem_path = "/proc/iomem";
+static __thread struct phys_range *last_range = NULL;
+
+static struct phys_range *find_range(unsigned long address)
+{
+	struct phys_range *r = last_range;
+	int lo = 0;
+	int hi = nr_ranges - 1;
+
+	if (r && address >= r->start && address < r->end)
+		return r;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (ranges[mid].start <= address)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	last_range = &ranges[lo];
+	return last_range;
+}
+
+static inline int is_ram(unsigned long address)
+{
+	return find_range(address)->kind == RANGE_RAM;
+}
+
+/* Returns how much of [address, address + nbytes) lies in address's range. */
+static inline unsigned long
+range_chunk(const struct phys_range *r, unsigned long address, unsigned long nbytes)
+{
+	return (r->end - address < nbytes) ? r->end - address : nbytes;
+}
+
+/* Whether any part of [address, address + nbytes) is System RAM. */
+static int range_has_ram(unsigned long address, unsigned long nbytes)
+{
+	while (nbytes) {
+		struct phys_range *r = find_range(address);
+		unsigned long chunk = range_chunk(r, address, nbytes);
+
+		if (r->kind == RANGE_RAM)
+			return 1;
+		if (!chunk)
+			break;
+		address += chunk;
+		nbytes -= chunk;
+	}
+	return 0;
+}
+
+static inline void
+range_count(struct phys_range *r, int write, unsigned long nbytes)
+{
+	__atomic_fetch_add(write ? &r->writes : &r->reads, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&r->bytes, nbytes, __ATOMIC_RELAXED);
+}
+
+static int range_kind(const char *name)
+{
+	if (!strcmp(name, "System RAM"))
+		return RANGE_RAM;
+	if (strcasestr(name, "reserved") || strstr(name, "ACPI") ||
+	    strstr(name, "ROM") || !strcmp(name, "RAM buffer"))
+		return RANGE_RESERVED;
+	return RANGE_MMIO;
+}
+
+static int add_range(unsigned long start, unsigned long end, int kind,
+		     const char *name, int *alloc)
+{
+	struct phys_range *r;
+
+	if (nr_ranges == *alloc) {
+		int n = *alloc ? 2 * *alloc : 64;
+		r = realloc(ranges, n * sizeof(*r));
+		if (!r)
+			return -1;
+		ranges = r;
+		*alloc = n;
+	}
+	r = &ranges[nr_ranges++];
+	memset(r, 0, sizeof(*r));
+	r->start = start;
+	r->end = end;
+	r->kind = kind;
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	return 0;
+}
+
+/*
+ * Builds the table from the top level entries of an iomem file, filling
+ * the gaps between them with unlisted ranges.  Without a usable file (it
+ * reads as all zeros without CAP_SYS_ADMIN) everything below ram_high is
+ * taken to be RAM.
+ */
+static int load_ranges(const char *path)
+{
+	FILE *f = path ? fopen(path, "r") : NULL;
+	unsigned long next = 0;
+	int wrapped = 0;
+	int alloc = 0;
+	char line[256];
+
+	free(ranges);
+	ranges = NULL;
+	nr_ranges = 0;
+
+	while (f && fgets(line, sizeof(line), f)) {
+		unsigned long start, last;
+		char name[64];
+
+		/* Nested entries are indented and only refine a top level
+		 * one. */
+		if (line[0] == ' ' ||
+		    sscanf(line, "%lx-%lx : %63[^\n]", &start, &last, name) != 3)
+			continue;
+		if (last < start || last < next || !last)
+			continue;
+		if (start < next)
+			start = next;
+		if (start > next && add_range(next, start, RANGE_MMIO, "unlisted", &alloc))
+			goto fail;
+		if (add_range(start, last + 1, range_kind(name), name, &alloc))
+			goto fail;
+		next = last + 1;
+		/* The entry ends at the top of the address space. */
+		if (!next) {
+			wrapped = 1;
+			break;
+		}
+	}
+	if (f)
+		fclose(f);
+	f = NULL;
+
+	if (!nr_ranges) {
+		if (ram_high &&
+		    add_range(0, ram_high, RANGE_RAM, "System RAM", &alloc))
+			goto fail;
+		next = ram_high;
+	}
+	if (wrapped)
+		ranges[nr_ranges - 1].end = ULONG_MAX;
+	else if (add_range(next, ULONG_MAX, RANGE_MMIO, "unlisted", &alloc))
+		goto fail;
+	return 0;
+fail:
+	if (f)
+		fclose(f);
+	return -1;
+}
+
+/*
+ * Cache of windows into /dev/mem.  Instead of keeping a single page mapped
+ * and remapping on every page switch, several large windows stay mapped at
+ * once.  They are kept sorted by physical address and never overlap, so a
+ * lookup is a check of the last window hit followed by a binary search.
+ * When either the window count or the total mapped bytes would exceed the
+ * configured limits, the least recently used window is unmapped.
+ *
+ * Windows with an owner are pinned: the mapping belongs to another object
+ * (such as a Mapping) and is only indexed here so that the single access
+ * functions can use it.  Pinned windows are never evicted or unmapped by the
+ * cache and do not count against the limit.
+ *
+ * Lookups take no lock.  Every change builds a new copy of the table and
+ * publishes it with an atomic store.  A thread marks the time between
+ * looking up a window and finishing its access by making its sequence
+ * count odd, and a writer waits until no thread that could still be using
+ * the old table is inside such a section before it unmaps anything or frees
+ * the old table.  Writers serialize on map_lock.
+ *
+ * Neither map_lock nor the wait for readers may be entered with the GIL
+ * held, since a reader may be waiting for the GIL.  For the same reason a
+ * reader never blocks, and never takes the GIL, while inside a section.
+ */
+#define MAX_CACHED_WINDOWS 64
+
+struct map_window {
+	unsigned long phys;
+	unsigned long size;
+	void *virt;
+	unsigned long last_use;
+	void *owner;
+	int cacheable;
+};
+
+struct window_table {
+	unsigned long gen;
+	int count;
+	struct map_window *windows[];
+};
+
+/* Per-thread state, reachable from the thread_states list for writers. */
+struct thread_state {
+	struct thread_state *next;
+	unsigned long seq;
+	struct map_window *last;
+	unsigned long last_gen;
+	unsigned long hits;
+	unsigned long misses;
+	void *scratch;
+	struct trace_ring *trace;
+};
+
+static struct window_table empty_table = { 0, 0 };
+static struct window_table *window_table = &empty_table;
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int nr_cached_windows = 0;
+static unsigned long map_window_size = 0x100000;
+static unsigned long map_limit = 0x10000000;
+static unsigned long mapped_bytes = 0;
+static unsigned long pinned_bytes = 0;
+static unsigned long map_clock = 0;
+static unsigned long map_evictions = 0;
+
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static struct thread_state *thread_states = NULL;
+static __thread struct thread_state *thread_self = NULL;
+static unsigned long retired_hits = 0;
+static unsigned long retired_misses = 0;
+
+/* A lookup that succeeded.  ptr is NULL when khwtest has to be used. */
+struct access {
+	volatile void *ptr;
+	int cacheable;
+	struct thread_state *ts;
+};
+
+static void open_khwtest(void)
+{
+	uint64_t start;
+
+	if (khwtest_fd != -1)
+		return;
+
+	start = now_ns();
+	khwtest_fd = open(khwtest_path, O_RDWR);
+	if (-1 == khwtest_fd) {
+		PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)khwtest_path);
+		return;
+	}
+	startup.khwtest_open_ns = now_ns() - start;
+}
+
+/* The file that accesses to address go through, for error messages. */
+static const char *backend_path(unsigned long address)
+{
+	return is_ram(address) ? khwtest_path : mem_path;
+}
+
+static void trace_retire(struct thread_state *ts);
+
+static void thread_state_destroy(void *arg)
+{
+	struct thread_state *ts = arg;
+	struct thread_state **p;
+
+	pthread_mutex_lock(&threads_lock);
+	for (p = &thread_states; *p; p = &(*p)->next) {
+		if (*p == ts) {
+			*p = ts->next;
+			break;
+		}
+	}
+	retired_hits += ts->hits;
+	retired_misses += ts->misses;
+	trace_retire(ts);
+	pthread_mutex_unlock(&threads_lock);
+	free(ts->scratch);
+	free(ts);
+}
+
+static struct thread_state *thread_state(void)
+{
+	struct thread_state *ts = thread_self;
+
+	if (ts)
+		return ts;
+	ts = calloc(1, sizeof(*ts));
+	if (!ts)
+		return NULL;
+	pthread_mutex_lock(&threads_lock);
+	ts->next = thread_states;
+	thread_states = ts;
+	pthread_mutex_unlock(&threads_lock);
+	pthread_setspecific(thread_key, ts);
+	thread_self = ts;
+	return ts;
+}
+
+static inline void read_section_enter(struct thread_state *ts)
+{
+	__atomic_store_n(&ts->seq, ts->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void read_section_exit(struct thread_state *ts)
+{
+	__atomic_store_n(&ts->seq, ts->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Waits until every thread has left any section it was in. */
+static void synchronize_readers(void)
+{
+	struct thread_state *ts;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&threads_lock);
+	for (ts = thread_states; ts; ts = ts->next) {
+		unsigned long seq = __atomic_load_n(&ts->seq, __ATOMIC_ACQUIRE);
+		if (!(seq & 1))
+			continue;
+		while (__atomic_load_n(&ts->seq, __ATOMIC_ACQUIRE) == seq)
+			sched_yield();
+	}
+	pthread_mutex_unlock(&threads_lock);
+}
+
+/* Returns the index of the first window that ends above address. */
+static int find_window_index(const struct window_table *t, unsigned long address)
+{
+	int lo = 0;
+	int hi = t->count;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		const struct map_window *w = t->windows[mid];
+		if (w->phys + w->size <= address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static inline int
+window_contains(const struct map_window *w, unsigned long address,
+		unsigned long len)
+{
+	return address >= w->phys && address + len <= w->phys + w->size;
+}
+
+/*
+ * Changes to the table are made on a private copy.  Windows removed from
+ * it are collected and only unmapped once the copy has been published and
+ * no reader can see them anymore.
+ */
+struct table_update {
+	struct window_table *table;
+	struct map_window **removed;
+	int nr_removed;
+};
+
+static int table_update_begin(struct table_update *u, int extra)
+{
+	const struct window_table *t = window_table;
+
+	u->table = malloc(sizeof(*t) + (t->count + extra) * sizeof(t->windows[0]));
+	u->removed = malloc((t->count + 1) * sizeof(u->removed[0]));
+	if (!u->table || !u->removed) {
+		free(u->table);
+		free(u->removed);
+		return -ENOMEM;
+	}
+	u->table->gen = t->gen + 1;
+	u->table->count = t->count;
+	memcpy(u->table->windows, t->windows, t->count * sizeof(t->windows[0]));
+	u->nr_removed = 0;
+	return 0;
+}
+
+static void table_remove(struct table_update *u, int index)
+{
+	struct window_table *t = u->table;
+	struct map_window *w = t->windows[index];
+
+	if (w->owner) {
+		pinned_bytes -= w->size;
+	} else {
+		mapped_bytes -= w->size;
+		--nr_cached_windows;
+	}
+	memmove(&t->windows[index], &t->windows[index + 1],
+		(t->count - index - 1) * sizeof(t->windows[0]));
+	--t->count;
+	u->removed[u->nr_removed++] = w;
+}
+
+static void table_insert(struct table_update *u, struct map_window *w)
+{
+	struct window_table *t = u->table;
+	int index = find_window_index(t, w->phys);
+
+	memmove(&t->windows[index + 1], &t->windows[index],
+		(t->count - index) * sizeof(t->windows[0]));
+	t->windows[index] = w;
+	++t->count;
+	if (w->owner) {
+		pinned_bytes += w->size;
+	} else {
+		mapped_bytes += w->size;
+		++nr_cached_windows;
+	}
+}
+
+static int evict_lru_window(struct table_update *u)
+{
+	struct window_table *t = u->table;
+	int i;
+	int victim = -1;
+
+	for (i = 0; i < t->count; ++i) {
+		if (t->windows[i]->owner)
+			continue;
+		if (victim < 0 ||
+		    t->windows[i]->last_use < t->windows[victim]->last_use)
+			victim = i;
+	}
+	if (victim < 0)
+		return -1;
+	table_remove(u, victim);
+	++map_evictions;
+	return 0;
+}
+
+static void table_update_commit(struct table_update *u)
+{
+	struct window_table *old = window_table;
+	int i;
+
+	__atomic_store_n(&window_table, u->table, __ATOMIC_RELEASE);
+	synchronize_readers();
+	if (old != &empty_table)
+		free(old);
+	for (i = 0; i < u->nr_removed; ++i) {
+		struct map_window *w = u->removed[i];
+		if (!w->owner)
+			munmap(w->virt, w->size);
+		free(w);
+	}
+	free(u->removed);
+}
+
+/* Opens /dev/mem on first use.  Called with map_lock held, so without the
+ * GIL.  Returns 0 or a negative errno. */
+static int open_mem(void)
+{
+	uint64_t start;
+
+	if (mem_fd != -1)
+		return 0;
+	start = now_ns();
+	mem_fd = open(mem_path, O_RDWR);
+	if (-1 == mem_fd)
+		return -errno;
+	startup.mem_open_ns = now_ns() - start;
+	return 0;
+}
+
+/*
+ * Maps [phys, phys + size) as a new window in the table being built.  phys
+ * and size must be page aligned and the range must not overlap any window.
+ */
+static int add_window(struct table_update *u, unsigned long phys, unsigned long size)
+{
+	struct map_window *w;
+	void *virt;
+	int res;
+
+	res = open_mem();
+	if (res)
+		return res;
+	while (nr_cached_windows >= MAX_CACHED_WINDOWS ||
+	       (mapped_bytes && mapped_bytes + size > map_limit)) {
+		if (evict_lru_window(u))
+			return -ENOMEM;
+	}
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+	virt = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    mem_fd, phys);
+	if (MAP_FAILED == virt) {
+		res = -errno;
+		free(w);
+		return res;
+	}
+	w->phys = phys;
+	w->size = size;
+	w->virt = virt;
+	w->last_use = ++map_clock;
+	w->owner = NULL;
+	w->cacheable = 0;
+	table_insert(u, w);
+	return 0;
+}
+
+/*
+ * Creates a window that covers [address, address + len).  The window is
+ * map_window_size aligned, trimmed so that it does not overlap its
+ * neighbours.  If the large mapping is refused (for example because part of
+ * it is not allowed by the kernel) only the pages needed are mapped.
+ */
+static int create_window(unsigned long address, unsigned long len)
+{
+	const unsigned long PAGE_SIZE = getpagesize();
+	unsigned long first_page = address & ~(PAGE_SIZE-1);
+	unsigned long last_page = (address + len + PAGE_SIZE - 1) & ~(PAGE_SIZE-1);
+	unsigned long start = address & ~(map_window_size-1);
+	unsigned long end = start + map_window_size;
+	struct table_update u;
+	struct window_table *t;
+	int index;
+	int res;
+
+	pthread_mutex_lock(&map_lock);
+	t = window_table;
+	index = find_window_index(t, address);
+	if (index < t->count && window_contains(t->windows[index], address, len)) {
+		/* Another thread mapped it while we waited for the lock. */
+		pthread_mutex_unlock(&map_lock);
+		return 0;
+	}
+
+	res = table_update_begin(&u, 1);
+	if (res) {
+		pthread_mutex_unlock(&map_lock);
+		return res;
+	}
+	t = u.table;
+	while (index < t->count && t->windows[index]->phys < last_page) {
+		/* The access straddles the end of an existing window. */
+		if (t->windows[index]->owner) {
+			res = -EINVAL;
+			goto out;
+		}
+		table_remove(&u, index);
+	}
+	if (index > 0 && t->windows[index-1]->phys + t->windows[index-1]->size > start)
+		start = t->windows[index-1]->phys + t->windows[index-1]->size;
+	if (index < t->count && t->windows[index]->phys < end)
+		end = t->windows[index]->phys;
+	if (start > first_page)
+		start = first_page;
+	if (end < last_page)
+		end = last_page;
+
+	if (end - start > map_limit) {
+		start = first_page;
+		end = last_page;
+	}
+
+	res = add_window(&u, start, end - start);
+	if (res && (start != first_page || end != last_page))
+		res = add_window(&u, first_page, last_page - first_page);
+out:
+	/* Even on failure windows may have been removed or evicted. */
+	table_update_commit(&u);
+	pthread_mutex_unlock(&map_lock);
+	return res;
+}
+
+/*
+ * Indexes a mapping owned by another object.  Cached windows overlapping it
+ * are dropped.  Fails if the range overlaps another pinned window, in which
+ * case the mapping is simply not indexed.
+ */
+static int
+pin_window(unsigned long phys, unsigned long size, void *virt, void *owner,
+	   int cacheable)
+{
+	struct table_update u;
+	struct map_window *w;
+	struct window_table *t;
+	int index;
+	int i;
+	int res;
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+	w->phys = phys;
+	w->size = size;
+	w->virt = virt;
+	w->last_use = 0;
+	w->owner = owner;
+	w->cacheable = cacheable;
+
+	pthread_mutex_lock(&map_lock);
+	t = window_table;
+	index = find_window_index(t, phys);
+	for (i = index; i < t->count && t->windows[i]->phys < phys + size; ++i) {
+		if (t->windows[i]->owner) {
+			pthread_mutex_unlock(&map_lock);
+			free(w);
+			return -EEXIST;
+		}
+	}
+	res = table_update_begin(&u, 1);
+	if (res) {
+		pthread_mutex_unlock(&map_lock);
+		free(w);
+		return res;
+	}
+	while (index < u.table->count && u.table->windows[index]->phys < phys + size)
+		table_remove(&u, index);
+	table_insert(&u, w);
+	table_update_commit(&u);
+	pthread_mutex_unlock(&map_lock);
+	return 0;
+}
+
+/* Removes a pinned window.  Returns once no thread can be accessing it. */
+static void unpin_window(void *owner)
+{
+	struct table_update u;
+	int i;
+
+	pthread_mutex_lock(&map_lock);
+	for (i = 0; i < window_table->count; ++i) {
+		if (window_table->windows[i]->owner == owner)
+			break;
+	}
+	if (i < window_table->count && !table_update_begin(&u, 0)) {
+		table_remove(&u, i);
+		table_update_commit(&u);
+	}
+	pthread_mutex_unlock(&map_lock);
+}
+
+/* Unmaps cached windows until at most limit bytes are mapped. */
+static void shrink_windows(unsigned long limit)
+{
+	struct table_update u;
+
+	pthread_mutex_lock(&map_lock);
+	if (mapped_bytes > limit && !table_update_begin(&u, 0)) {
+		while (mapped_bytes > limit && !evict_lru_window(&u))
+			;
+		table_update_commit(&u);
+	}
+	pthread_mutex_unlock(&map_lock);
+}
+
+/* Replaces any cached windows inside a region with one window for it. */
+static int map_region(unsigned long start, unsigned long end)
+{
+	struct table_update u;
+	struct window_table *t;
+	int index;
+	int res;
+
+	pthread_mutex_lock(&map_lock);
+	res = table_update_begin(&u, 1);
+	if (res) {
+		pthread_mutex_unlock(&map_lock);
+		return res;
+	}
+	t = u.table;
+	index = find_window_index(t, start);
+	while (index < t->count && t->windows[index]->phys < end) {
+		if (t->windows[index]->owner) {
+			res = -EEXIST;
+			goto out;
+		}
+		table_remove(&u, index);
+	}
+	res = add_window(&u, start, end - start);
+out:
+	table_update_commit(&u);
+	pthread_mutex_unlock(&map_lock);
+	return res;
+}
+
+/*
+ * Looks up a window for [address, address + len), mapping a new one if
+ * needed.  On success the caller is inside a read section if a->ptr is set
+ * and must call map_exit once it is done with the pointer.  In System RAM
+ * only pinned windows (such as mapped DMA buffers) are used, and a->ptr is
+ * NULL when the address is not inside one so that the caller goes through
+ * khwtest instead.
+ *
+ * gil_held tells whether the caller holds the GIL, which is dropped while
+ * a new window is mapped.  Returns 0 or a negative errno.
+ */
+static int
+map_enter(struct access *a, unsigned long address, unsigned long len, int gil_held)
+{
+	struct thread_state *ts = thread_state();
+	const struct window_table *t;
+	struct map_window *w;
+	int missed = 0;
+	int index;
+	int res;
+
+	if (!ts)
+		return -ENOMEM;
+	a->ts = ts;
+
+	for (;;) {
+		read_section_enter(ts);
+		t = __atomic_load_n(&window_table, __ATOMIC_ACQUIRE);
+		w = ts->last;
+		if (!w || ts->last_gen != t->gen || !window_contains(w, address, len)) {
+			index = find_window_index(t, address);
+			w = (index < t->count) ? t->windows[index] : NULL;
+			if (w && !window_contains(w, address, len))
+				w = NULL;
+		}
+		if (w) {
+			unsigned long clock = __atomic_load_n(&map_clock, __ATOMIC_RELAXED);
+			if (!missed)
+				++ts->hits;
+			if (w->last_use != clock)
+				__atomic_store_n(&w->last_use, clock, __ATOMIC_RELAXED);
+			ts->last = w;
+			ts->last_gen = t->gen;
+			a->ptr = w->virt + (address - w->phys);
+			a->cacheable = w->cacheable;
+			return 0;
+		}
+		read_section_exit(ts);
+
+		if (is_ram(address)) {
+			a->ptr = NULL;
+			return 0;
+		}
+
+		if (!missed) {
+			++ts->misses;
+			missed = 1;
+		}
+		if (gil_held) {
+			Py_BEGIN_ALLOW_THREADS
+			res = create_window(address, len);
+			Py_END_ALLOW_THREADS
+		} else {
+			res = create_window(address, len);
+		}
+		if (res)
+			return res;
+	}
+}
+
+static inline void map_exit(struct access *a)
+{
+	if (a->ptr)
+		read_section_exit(a->ts);
+}
+
+/* Sets a Python error for a negative errno returned by the functions above. */
+static void set_errno_error(int res, const char *filename)
+{
+	errno = -res;
+	PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)filename);
+}
+
+static inline uint64_t read_width(const volatile void *ptr, int width)
+{
+	switch (width) {
+	case 1: return *(volatile uint8_t *)ptr;
+	case 2: return *(volatile uint16_t *)ptr;
+	case 4: return *(volatile uint32_t *)ptr;
+	default: return *(volatile uint64_t *)ptr;
+	}
+}
+
+static inline void write_width(volatile void *ptr, int width, uint64_t value)
+{
+	switch (width) {
+	case 1: *(volatile uint8_t *)ptr = value; break;
+	case 2: *(volatile uint16_t *)ptr = value; break;
+	case 4: *(volatile uint32_t *)ptr = value; break;
+	default: *(volatile uint64_t *)ptr = value; break;
+	}
+}
+
+/* pread / pwrite on khwtest that treat short transfers as errors. */
+static int khwtest_pread(void *buf, unsigned long nbytes, unsigned long address)
+{
+	while (nbytes) {
+		ssize_t res = pread(khwtest_fd, buf, nbytes, address);
+		if (res <= 0)
+			return res ? -errno : -EIO;
+		buf += res;
+		address += res;
+		nbytes -= res;
+	}
+	return 0;
+}
+
+static int khwtest_pwrite(const void *buf, unsigned long nbytes, unsigned long address)
+{
+	while (nbytes) {
+		ssize_t res = pwrite(khwtest_fd, buf, nbytes, address);
+		if (res <= 0)
+			return res ? -errno : -EIO;
+		buf += res;
+		address += res;
+		nbytes -= res;
+	}
+	return 0;
+}
+
+/*
+ * Access tracing.  While tracing is on every access is logged into a ring
+ * owned by the accessing thread, so logging takes no lock and touches no
+ * shared cache line.  When the ring is full the oldest entries are
+ * overwritten.  trace_dump drains the rings of all threads into a file that
+ * hwtrace.py decodes.  When tracing is off the only cost is the test of
+ * trace_enabled.
+ *
+ * Timestamps are raw cycle counts where the CPU has a usable counter and
+ * CLOCK_MONOTONIC_RAW nanoseconds elsewhere.  The file header carries a pair
+ * of (counter, nanoseconds) samples from trace_start and trace_dump to
+ * convert them.
+ */
+#define TRACE_READ		0x0
+#define TRACE_WRITE		0x1
+#define TRACE_PORT		0x2	/* I/O space instead of memory */
+#define TRACE_BLOCK		0x4	/* value is the length of the block */
+#define TRACE_POLL		0x8	/* value is the last value polled */
+
+#define TRACE_MAGIC		"HWTRACE"
+#define TRACE_VERSION		1
+
+struct trace_entry {
+	uint64_t timestamp;
+	uint64_t address;
+	uint64_t value;
+	uint32_t tid;
+	uint8_t width;
+	uint8_t flags;
+	uint16_t reserved;
+};
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t start_counter;
+	uint64_t start_ns;
+	uint64_t end_counter;
+	uint64_t end_ns;
+	uint64_t count;
+	uint64_t dropped;
+};
+
+struct trace_ring {
+	struct trace_ring *next;	/* only on retired_traces */
+	unsigned long mask;
+	uint64_t head;			/* written by the owning thread */
+	uint64_t tail;			/* written under threads_lock */
+	uint32_t tid;
+	struct trace_entry entries[];
+};
+
+static int trace_enabled = 0;
+static unsigned long trace_entries = 65536;
+static uint64_t trace_start_counter;
+static uint64_t trace_start_ns;
+/* Rings of threads that have exited, kept until they are dumped. */
+static struct trace_ring *retired_traces = NULL;
+static uint64_t trace_dropped = 0;
+
+static inline uint64_t trace_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t trace_counter(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return trace_clock_ns();
+#endif
+}
+
+static void trace_retire(struct thread_state *ts)
+{
+	if (!ts->trace)
+		return;
+	ts->trace->next = retired_traces;
+	retired_traces = ts->trace;
+	ts->trace = NULL;
+}
+
+static struct trace_ring *trace_ring(struct thread_state *ts)
+{
+	struct trace_ring *ring;
+
+	ring = calloc(1, sizeof(*ring) + trace_entries * sizeof(ring->entries[0]));
+	if (!ring)
+		return NULL;
+	ring->mask = trace_entries - 1;
+	ring->tid = syscall(SYS_gettid);
+	/* Hand the old ring over to trace_dump if the size changed. */
+	pthread_mutex_lock(&threads_lock);
+	trace_retire(ts);
+	ts->trace = ring;
+	pthread_mutex_unlock(&threads_lock);
+	return ring;
+}
+
+static void
+trace_record(unsigned long address, int width, int flags, uint64_t value)
+{
+	struct thread_state *ts = thread_state();
+	struct trace_ring *ring;
+	struct trace_entry *e;
+	uint64_t head;
+
+	if (!ts)
+		return;
+	ring = ts->trace;
+	if (!ring || ring->mask + 1 != trace_entries) {
+		ring = trace_ring(ts);
+		if (!ring)
+			return;
+	}
+	head = ring->head;
+	e = &ring->entries[head & ring->mask];
+	e->timestamp = trace_counter();
+	e->address = address;
+	e->value = value;
+	e->tid = ring->tid;
+	e->width = width;
+	e->flags = flags;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static inline void
+trace_access(unsigned long address, int width, int flags, uint64_t value)
+{
+	if (__builtin_expect(trace_enabled, 0))
+		trace_record(address, width, flags, value);
+}
+
+/*
+ * Writes the entries logged in ring since the last dump.  Entries that the
+ * owner overwrote while they were being copied are counted as dropped.
+ * Called with threads_lock held.
+ */
+static int trace_drain(struct trace_ring *ring, FILE *f, uint64_t *count)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = ring->tail;
+	uint64_t size = ring->mask + 1;
+
+	if (head - tail > size) {
+		trace_dropped += head - tail - size;
+		tail = head - size;
+	}
+	while (tail < head) {
+		struct trace_entry e = ring->entries[tail & ring->mask];
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) - tail >= size) {
+			/* May have been overwritten while it was copied. */
+			++trace_dropped;
+		} else {
+			if (fwrite(&e, sizeof(e), 1, f) != 1)
+				return -1;
+			++*count;
+		}
+		++tail;
+	}
+	ring->tail = tail;
+	return 0;
+}
+
+/* Must be called without the GIL.  Returns the number of entries or -1. */
+static long trace_dump(const char *path)
+{
+	struct trace_header header;
+	struct thread_state *ts;
+	struct trace_ring *ring;
+	uint64_t count = 0;
+	FILE *f;
+	int res = 0;
+
+	f = fopen(path, "wb");
+	if (!f)
+		return -1;
+	/* The header is rewritten once the count is known. */
+	memset(&header, 0, sizeof(header));
+	if (fwrite(&header, sizeof(header), 1, f) != 1)
+		goto fail;
+
+	pthread_mutex_lock(&threads_lock);
+	for (ts = thread_states; ts && !res; ts = ts->next) {
+		if (ts->trace)
+			res = trace_drain(ts->trace, f, &count);
+	}
+	while (retired_traces && !res) {
+		ring = retired_traces;
+		res = trace_drain(ring, f, &count);
+		retired_traces = ring->next;
+		free(ring);
+	}
+	memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	header.version = TRACE_VERSION;
+	header.entry_size = sizeof(struct trace_entry);
+	header.start_counter = trace_start_counter;
+	header.start_ns = trace_start_ns;
+	header.end_counter = trace_counter();
+	header.end_ns = trace_clock_ns();
+	header.count = count;
+	header.dropped = trace_dropped;
+	trace_dropped = 0;
+	pthread_mutex_unlock(&threads_lock);
+	if (res)
+		goto fail;
+
+	if (fseek(f, 0, SEEK_SET) ||
+	    fwrite(&header, sizeof(header), 1, f) != 1)
+		goto fail;
+	if (fclose(f))
+		return -1;
+	return count;
+fail:
+	fclose(f);
+	return -1;
+}
+
+/*
+ * Single accesses that run without the GIL.  khwtest must already be open
+ * if the address may be in System RAM.  Return 0 or a negative errno.
+ */
+static int read_reg(unsigned long address, int width, uint64_t *value)
+{
+	struct access a;
+	int res;
+
+	range_count(find_range(address), 0, width);
+	res = map_enter(&a, address, width, 0);
+	if (res)
+		return res;
+	if (!a.ptr) {
+		*value = 0;
+		return khwtest_pread(value, width, address);
+	}
+	*value = read_width(a.ptr, width);
+	map_exit(&a);
+	return 0;
+}
+
+static int write_reg(unsigned long address, int width, uint64_t value)
+{
+	struct access a;
+	int res;
+
+	range_count(find_range(address), 1, width);
+	res = map_enter(&a, address, width, 0);
+	if (res)
+		return res;
+	if (!a.ptr)
+		return khwtest_pwrite(&value, width, address);
+	write_width(a.ptr, width, value);
+	map_exit(&a);
+	return 0;
+}
+
+/*
+ * Single accesses of width bytes.  Called with the GIL held, which is
+ * released around accesses that can stall: uncached device memory and
+ * system calls on khwtest.  Sets a Python error and returns -1 on failure.
+ */
+static int read_phys(unsigned long address, int width, uint64_t *value)
+{
+	struct access a;
+	int res;
+
+	range_count(find_range(address), 0, width);
+	res = map_enter(&a, address, width, 1);
+	if (res) {
+		set_errno_error(res, mem_path);
+		return -1;
+	}
+	if (a.ptr && a.cacheable) {
+		*value = read_width(a.ptr, width);
+		map_exit(&a);
+		trace_access(address, width, TRACE_READ, *value);
+		return 0;
+	}
+	if (!a.ptr) {
+		open_khwtest();
+		if (PyErr_Occurred() != NULL)
+			return -1;
+	}
+
+	*value = 0;
+	Py_BEGIN_ALLOW_THREADS
+	if (a.ptr) {
+		*value = read_width(a.ptr, width);
+		map_exit(&a);
+	} else {
+		res = khwtest_pread(value, width, address);
+	}
+	Py_END_ALLOW_THREADS
+	if (res) {
+		set_errno_error(res, khwtest_path);
+		return -1;
+	}
+	trace_access(address, width, TRACE_READ, *value);
+	return 0;
+}
+
+static int write_phys(unsigned long address, int width, uint64_t value)
+{
+	struct access a;
+	int res;
+
+	range_count(find_range(address), 1, width);
+	res = map_enter(&a, address, width, 1);
+	if (res) {
+		set_errno_error(res, mem_path);
+		return -1;
+	}
+	if (a.ptr && a.cacheable) {
+		write_width(a.ptr, width, value);
+		map_exit(&a);
+		trace_access(address, width, TRACE_WRITE, value);
+		return 0;
+	}
+	if (!a.ptr) {
+		open_khwtest();
+		if (PyErr_Occurred() != NULL)
+			return -1;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	if (a.ptr) {
+		write_width(a.ptr, width, value);
+		map_exit(&a);
+	} else {
+		res = khwtest_pwrite(&value, width, address);
+	}
+	Py_END_ALLOW_THREADS
+	if (res) {
+		set_errno_error(res, khwtest_path);
+		return -1;
+	}
+	trace_access(address, width, TRACE_WRITE, value);
+	return 0;
+}
+
+/*
+ * Argument handling for the single access functions, which are called far
+ * too often for PyArg_ParseTuple.  They take the arguments as an array:
+ * METH_FASTCALL passes one directly, and on Pythons without it the items
+ * of the argument tuple are one as well.
+ */
+#if PY_VERSION_HEX >= 0x03070000
+#define FASTCALL_FLAGS METH_FASTCALL
+#define DEFINE_FASTCALL(name) \
+	static PyObject *name(PyObject *self, PyObject *const *args, \
+			      Py_ssize_t nargs)
+#else
+#define FASTCALL_FLAGS METH_VARARGS
+#define DEFINE_FASTCALL(name) \
+	static PyObject *name##_array(PyObject *self, PyObject *const *args, \
+				      Py_ssize_t nargs); \
+	static PyObject *name(PyObject *self, PyObject *tuple) \
+	{ \
+		return name##_array(self, &PyTuple_GET_ITEM(tuple, 0), \
+				    PyTuple_GET_SIZE(tuple)); \
+	} \
+	static PyObject *name##_array(PyObject *self, PyObject *const *args, \
+				      Py_ssize_t nargs)
+#endif
+#define FASTCALL_METHOD(name) ((PyCFunction)(void (*)(void))(name))
+
+/*
+ * The port functions also take paused by keyword.  kw holds the names of
+ * the keyword arguments, whose values follow the positional ones in args,
+ * or on older Pythons the keyword dictionary.
+ */
+#if PY_VERSION_HEX >= 0x03070000
+#define FASTCALL_KW_FLAGS (METH_FASTCALL | METH_KEYWORDS)
+#define DEFINE_FASTCALL_KW(name) \
+	static PyObject *name(PyObject *self, PyObject *const *args, \
+			      Py_ssize_t nargs, PyObject *kw)
+#else
+#define FASTCALL_KW_FLAGS (METH_VARARGS | METH_KEYWORDS)
+#define DEFINE_FASTCALL_KW(name) \
+	static PyObject *name##_array(PyObject *self, PyObject *const *args, \
+				      Py_ssize_t nargs, PyObject *kw); \
+	static PyObject *name(PyObject *self, PyObject *tuple, PyObject *kw) \
+	{ \
+		return name##_array(self, &PyTuple_GET_ITEM(tuple, 0), \
+				    PyTuple_GET_SIZE(tuple), kw); \
+	} \
+	static PyObject *name##_array(PyObject *self, PyObject *const *args, \
+				      Py_ssize_t nargs, PyObject *kw)
+#endif
+
+static int
+check_nargs(const char *name, Py_ssize_t nargs, Py_ssize_t min, Py_ssize_t max)
+{
+	if (nargs >= min && nargs <= max)
+		return 0;
+	if (min == max)
+		PyErr_Format(PyExc_TypeError, "%s() takes exactly %zd arguments (%zd given)",
+			     name, min, nargs);
+	else
+		PyErr_Format(PyExc_TypeError, "%s() takes %zd to %zd arguments (%zd given)",
+			     name, min, max, nargs);
+	return -1;
+}
+
+/*
+ * Converts an integer argument of bits bits.  Negative values down to
+ * -2**(bits-1) are taken as two's complement, for scripts that still fold
+ * addresses and values with bit 31 set into signed longs.
+ */
+static int arg_bits(PyObject *obj, int bits, const char *what, uint64_t *value)
+{
+	const uint64_t max = (bits == 64) ? ~0ULL : (1ULL << bits) - 1;
+	int overflow;
+	long long v;
+
+#if PY_MAJOR_VERSION < 3
+	if (PyInt_Check(obj)) {
+		v = PyInt_AS_LONG(obj);
+		overflow = 0;
+	} else
+#endif
+	v = PyLong_AsLongLongAndOverflow(obj, &overflow);
+	if (!overflow) {
+		if (v == -1 && PyErr_Occurred() != NULL)
+			return -1;
+		if (v < 0 ? -(uint64_t)v <= (max >> 1) + 1 : (uint64_t)v <= max) {
+			*value = (uint64_t)v & max;
+			return 0;
+		}
+	} else if (overflow > 0 && bits == 64) {
+		*value = PyLong_AsUnsignedLongLong(obj);
+		if (PyErr_Occurred() == NULL)
+			return 0;
+		PyErr_Clear();
+	}
+	PyErr_Format(PyExc_OverflowError, "%s does not fit in %d bits.", what, bits);
+	return -1;
+}
+
+/*
+ * Looks up the optional paused argument, positional at pos or by keyword,
+ * which defaults to true.
+ */
+static int arg_paused(const char *name, PyObject *const *args, Py_ssize_t nargs,
+		      PyObject *kw, Py_ssize_t pos, int *paused)
+{
+	PyObject *obj = (nargs > pos) ? args[pos] : NULL;
+
+	if (kw != NULL) {
+#if PY_VERSION_HEX >= 0x03070000
+		Py_ssize_t i;
+
+		for (i = 0; i < PyTuple_GET_SIZE(kw); i++) {
+			if (obj != NULL || PyUnicode_CompareWithASCIIString(
+					PyTuple_GET_ITEM(kw, i), "paused"))
+				goto unexpected;
+			obj = args[nargs + i];
+		}
+#else
+		if (PyDict_Size(kw) > 0) {
+			if (obj != NULL || PyDict_Size(kw) != 1 ||
+			    (obj = PyDict_GetItemString(kw, "paused")) == NULL)
+				goto unexpected;
+		}
+#endif
+	}
+	*paused = (obj != NULL) ? PyObject_IsTrue(obj) : 1;
+	return (*paused < 0) ? -1 : 0;
+
+unexpected:
+	PyErr_Format(PyExc_TypeError, "%s() takes paused once and no other keyword arguments.",
+		     name);
+	return -1;
+}
+
+/* Python 2 scripts expect small results as ints rather than longs. */
+static PyObject *unsigned_to_object(uint64_t value)
+{
+#if PY_MAJOR_VERSION < 3
+	if (value <= LONG_MAX)
+		return PyInt_FromLong(value);
+#endif
+	return PyLong_FromUnsignedLongLong(value);
+}
+
+static int arg_address(PyObject *obj, unsigned long *address)
+{
+	uint64_t value;
+
+	if (arg_bits(obj, 8 * sizeof(*address), "address", &value))
+		return -1;
+	*address = value;
+	return 0;
+}
+
+/*
+ * Copies between a mapped window and a buffer using only accesses of the
+ * requested width, so that device registers see the same transactions as
+ * they would from the single access functions.
+ */
+static void
+copy_from_io(void *dst, const volatile void *src, unsigned long nbytes, int width)
+{
+	unsigned long i;
+
+	switch (width) {
+	case 1:
+		for (i = 0; i < nbytes; i += 1)
+			*(uint8_t *)(dst + i) = *(volatile uint8_t *)(src + i);
+		break;
+	case 2:
+		for (i = 0; i < nbytes; i += 2)
+			*(uint16_t *)(dst + i) = *(volatile uint16_t *)(src + i);
+		break;
+	case 4:
+		for (i = 0; i < nbytes; i += 4)
+			*(uint32_t *)(dst + i) = *(volatile uint32_t *)(src + i);
+		break;
+	case 8:
+		for (i = 0; i < nbytes; i += 8)
+			*(uint64_t *)(dst + i) = *(volatile uint64_t *)(src + i);
+		break;
+	}
+}
+
+static void
+copy_to_io(volatile void *dst, const void *src, unsigned long nbytes, int width)
+{
+	unsigned long i;
+
+	switch (width) {
+	case 1:
+		for (i = 0; i < nbytes; i += 1)
+			*(volatile uint8_t *)(dst + i) = *(uint8_t *)(src + i);
+		break;
+	case 2:
+		for (i = 0; i < nbytes; i += 2)
+			*(volatile uint16_t *)(dst + i) = *(uint16_t *)(src + i);
+		break;
+	case 4:
+		for (i = 0; i < nbytes; i += 4)
+			*(volatile uint32_t *)(dst + i) = *(uint32_t *)(src + i);
+		break;
+	case 8:
+		for (i = 0; i < nbytes; i += 8)
+			*(volatile uint64_t *)(dst + i) = *(uint64_t *)(src + i);
+		break;
+	}
+}
+
+static int
+check_block_args(unsigned long address, unsigned long nbytes, int width)
+{
+	if (width != 1 && width != 2 && width != 4 && width != 8) {
+		PyErr_SetString(PyExc_ValueError, "Width must be 1, 2, 4 or 8.");
+		return -1;
+	}
+	if ((address | nbytes) & (width - 1)) {
+		PyErr_SetString(PyExc_ValueError,
+			"Address and length must be multiples of the width.");
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns how much of a block starting at address to handle in one window. */
+static unsigned long
+block_chunk(unsigned long address, unsigned long nbytes)
+{
+	unsigned long chunk = map_window_size - (address & (map_window_size-1));
+	return (chunk < nbytes) ? chunk : nbytes;
+}
+
+/*
+ * Reads a block of physical memory, a range of the address map at a time.
+ * Blocks in System RAM are moved with a single read() on khwtest, which
+ * already walks the range a page at a time.  Must be called without the
+ * GIL; khwtest must already be open for blocks in System RAM.  Returns 0 or
+ * a negative errno.
+ */
+static int
+read_block(unsigned long address, void *buf, unsigned long nbytes, int width)
+{
+	struct access a;
+	int res;
+
+	while (nbytes) {
+		struct phys_range *r = find_range(address);
+		unsigned long chunk = range_chunk(r, address, nbytes);
+
+		if (r->kind != RANGE_RAM)
+			chunk = block_chunk(address, chunk);
+		range_count(r, 0, chunk);
+		res = map_enter(&a, address, chunk, 0);
+		if (res)
+			return res;
+		if (a.ptr) {
+			/* Device memory, or a mapped DMA buffer. */
+			copy_from_io(buf, a.ptr, chunk, width);
+			map_exit(&a);
+		} else {
+			res = khwtest_pread(buf, chunk, address);
+			if (res)
+				return res;
+		}
+		address += chunk;
+		buf += chunk;
+		nbytes -= chunk;
+	}
+	return 0;
+}
+
+static int
+write_block(unsigned long address, const void *buf, unsigned long nbytes, int width)
+{
+	struct access a;
+	int res;
+
+	while (nbytes) {
+		struct phys_range *r = find_range(address);
+		unsigned long chunk = range_chunk(r, address, nbytes);
+
+		if (r->kind != RANGE_RAM)
+			chunk = block_chunk(address, chunk);
+		range_count(r, 1, chunk);
+		res = map_enter(&a, address, chunk, 0);
+		if (res)
+			return res;
+		if (a.ptr) {
+			copy_to_io(a.ptr, buf, chunk, width);
+			map_exit(&a);
+		} else {
+			res = khwtest_pwrite(buf, chunk, address);
+			if (res)
+				return res;
+		}
+		address += chunk;
+		buf += chunk;
+		nbytes -= chunk;
+	}
+	return 0;
+}
+
+/*
+ * Memory test patterns.  A pattern is generated a chunk at a time into a
+ * per-thread scratch buffer and then written out, or compared against the
+ * memory, in one pass.  Cacheable memory (DMA buffers) is copied and
+ * compared as plain memory, device memory only sees accesses of the
+ * requested width.  Element k of a pattern is the width sized word at
+ * offset k * width from the start of the range.
+ */
+#define PATTERN_WALKING_ONES	0
+#define PATTERN_WALKING_ZEROS	1
+#define PATTERN_ADDRESS		2
+#define PATTERN_CHECKERBOARD	3
+#define PATTERN_LFSR		4
+#define PATTERN_USER		5
+
+#define PATTERN_CHUNK		0x10000
+
+struct pattern {
+	int type;
+	int width;
+	uint64_t state;
+	const unsigned char *data;
+	unsigned long data_len;
+};
+
+struct mismatch {
+	unsigned long address;
+	uint64_t expected;
+	uint64_t actual;
+};
+
+struct pattern_result {
+	struct mismatch *mismatches;
+	unsigned long max_mismatches;
+	unsigned long nr_mismatches;
+};
+
+/* Returns two PATTERN_CHUNK sized buffers for the calling thread. */
+static void *pattern_scratch(void)
+{
+	struct thread_state *ts = thread_state();
+
+	if (!ts)
+		return NULL;
+	if (!ts->scratch && posix_memalign(&ts->scratch, 64, 2 * PATTERN_CHUNK))
+		ts->scratch = NULL;
+	return ts->scratch;
+}
+
+static inline uint64_t width_mask(int width)
+{
+	return (width == 8) ? ~0ULL : (1ULL << (8 * width)) - 1;
+}
+
+/*
+ * Generates nbytes of the pattern for the range starting offset bytes into
+ * the test, at physical address.  Chunks must be generated in order since
+ * the LFSR state is carried from one to the next.
+ */
+static void
+pattern_generate(struct pattern *p, void *buf, unsigned long offset,
+		 unsigned long address, unsigned long nbytes)
+{
+	const int width = p->width;
+	const int bits = 8 * width;
+	const uint64_t mask = width_mask(width);
+	unsigned long k = offset / width;
+	unsigned long n = nbytes / width;
+	unsigned long i;
+	uint64_t x;
+
+	switch (p->type) {
+	case PATTERN_USER: {
+		unsigned long phase = offset % p->data_len;
+		for (i = 0; i < nbytes; ++i) {
+			((unsigned char *)buf)[i] = p->data[phase];
+			if (++phase == p->data_len)
+				phase = 0;
+		}
+		return;
+	}
+	case PATTERN_LFSR:
+		/* xorshift64, a full period linear feedback generator. */
+		x = p->state;
+		for (i = 0; i < n; ++i) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			memcpy(buf + i * width, &x, width);
+		}
+		p->state = x;
+		return;
+	}
+
+	switch (width) {
+#define GENERATE(word)							\
+	for (i = 0; i < n; ++i, ++k) {					\
+		switch (p->type) {					\
+		case PATTERN_WALKING_ONES:				\
+			x = 1ULL << (k % bits);				\
+			break;						\
+		case PATTERN_WALKING_ZEROS:				\
+			x = ~(1ULL << (k % bits));			\
+			break;						\
+		case PATTERN_ADDRESS:					\
+			x = address + i * width;			\
+			break;						\
+		default:						\
+			x = (k & 1) ? 0xaaaaaaaaaaaaaaaaULL :		\
+				      0x5555555555555555ULL;		\
+			break;						\
+		}							\
+		((word *)buf)[i] = x & mask;				\
+	}
+	case 1: GENERATE(uint8_t); break;
+	case 2: GENERATE(uint16_t); break;
+	case 4: GENERATE(uint32_t); break;
+	case 8: GENERATE(uint64_t); break;
+#undef GENERATE
+	}
+}
+
+/* Returns the offset of the first byte that differs, or nbytes. */
+static unsigned long
+first_difference(const void *a, const void *b, unsigned long nbytes)
+{
+	unsigned long i = 0;
+
+#ifdef __SSE2__
+	for (; i + 64 <= nbytes; i += 64) {
+		__m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128(a + i),
+					    _mm_loadu_si128(b + i));
+		__m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128(a + i + 16),
+					    _mm_loadu_si128(b + i + 16));
+		__m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128(a + i + 32),
+					    _mm_loadu_si128(b + i + 32));
+		__m128i e3 = _mm_cmpeq_epi8(_mm_loadu_si128(a + i + 48),
+					    _mm_loadu_si128(b + i + 48));
+		__m128i all = _mm_and_si128(_mm_and_si128(e0, e1),
+					    _mm_and_si128(e2, e3));
+		if (_mm_movemask_epi8(all) != 0xffff)
+			break;
+	}
+	for (; i + 16 <= nbytes; i += 16) {
+		int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(a + i),
+							  _mm_loadu_si128(b + i)));
+		if (eq != 0xffff)
+			return i + __builtin_ctz(~eq);
+	}
+#endif
+	for (; i < nbytes; ++i) {
+		if (((const unsigned char *)a)[i] != ((const unsigned char *)b)[i])
+			break;
+	}
+	return i;
+}
+
+/* Records every mismatching element between expected and actual. */
+static void
+pattern_compare(struct pattern_result *r, unsigned long address,
+		const void *expected, const void *actual, unsigned long nbytes,
+		int width)
+{
+	unsigned long offset = 0;
+
+	for (;;) {
+		offset += first_difference(expected + offset, actual + offset,
+					   nbytes - offset);
+		if (offset >= nbytes)
+			return;
+		offset &= ~(unsigned long)(width - 1);
+		if (r->nr_mismatches < r->max_mismatches) {
+			struct mismatch *m = &r->mismatches[r->nr_mismatches];
+			m->address = address + offset;
+			m->expected = 0;
+			m->actual = 0;
+			memcpy(&m->expected, expected + offset, width);
+			memcpy(&m->actual, actual + offset, width);
+		}
+		++r->nr_mismatches;
+		offset += width;
+	}
+}
+
+/*
+ * Fills, or with result set verifies, [address, address + nbytes) with a
+ * pattern.  Runs without the GIL; khwtest must already be open for ranges
+ * in System RAM.  Returns 0 or a negative errno.
+ */
+static int
+pattern_run(struct pattern *p, unsigned long address, unsigned long nbytes,
+	    struct pattern_result *r)
+{
+	void *expected = pattern_scratch();
+	void *actual = expected + PATTERN_CHUNK;
+	unsigned long offset = 0;
+	struct access a;
+	int res;
+
+	if (!expected)
+		return -ENOMEM;
+
+	while (offset < nbytes) {
+		struct phys_range *range = find_range(address);
+		unsigned long chunk = nbytes - offset;
+
+		if (chunk > PATTERN_CHUNK)
+			chunk = PATTERN_CHUNK;
+		chunk = range_chunk(range, address, chunk);
+		if (range->kind != RANGE_RAM)
+			chunk = block_chunk(address, chunk);
+		range_count(range, !r, chunk);
+		pattern_generate(p, expected, offset, address, chunk);
+
+		res = map_enter(&a, address, chunk, 0);
+		if (res)
+			return res;
+		if (a.ptr && a.cacheable) {
+			if (r)
+				pattern_compare(r, address, expected,
+						(const void *)a.ptr, chunk, p->width);
+			else
+				memcpy((void *)a.ptr, expected, chunk);
+		} else if (a.ptr) {
+			if (r) {
+				copy_from_io(actual, a.ptr, chunk, p->width);
+				pattern_compare(r, address, expected, actual,
+						chunk, p->width);
+			} else {
+				copy_to_io(a.ptr, expected, chunk, p->width);
+			}
+		} else if (r) {
+			res = khwtest_pread(actual, chunk, address);
+			if (res)
+				return res;
+			pattern_compare(r, address, expected, actual, chunk, p->width);
+		} else {
+			res = khwtest_pwrite(expected, chunk, address);
+			if (res)
+				return res;
+		}
+		map_exit(&a);
+
+		address += chunk;
+		offset += chunk;
+	}
+	return 0;
+}
+
+static PyObject *read_common(PyObject *const *args, Py_ssize_t nargs,
+			     const char *name, int width)
+{
+	unsigned long address;
+	uint64_t value;
+
+	if (check_nargs(name, nargs, 1, 1) || arg_address(args[0], &address))
+		return NULL;
+	if (read_phys(address, width, &value))
+		return NULL;
+	return unsigned_to_object(value);
+}
+
+static PyObject *write_common(PyObject *const *args, Py_ssize_t nargs,
+			      const char *name, int width)
+{
+	unsigned long address;
+	uint64_t value;
+
+	if (check_nargs(name, nargs, 2, 2) || arg_address(args[0], &address) ||
+	    arg_bits(args[1], 8 * width, "value", &value))
+		return NULL;
+	if (write_phys(address, width, value))
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+DEFINE_FASTCALL(chwtest_readb)
+{
+	return read_common(args, nargs, "readb", 1);
+}
+
+DEFINE_FASTCALL(chwtest_readw)
+{
+	return read_common(args, nargs, "readw", 2);
+}
+
+/*
+ * Long words are 32 bits wide whatever the size of a long, use readq /
+ * writeq for 64 bit registers.
+ */
+DEFINE_FASTCALL(chwtest_readlw)
+{
+	return read_common(args, nargs, "readlw", 4);
+}
+
+DEFINE_FASTCALL(chwtest_readq)
+{
+	return read_common(args, nargs, "readq", 8);
+}
+
+DEFINE_FASTCALL(chwtest_writeb)
+{
+	return write_common(args, nargs, "writeb", 1);
+}
+
+DEFINE_FASTCALL(chwtest_writew)
+{
+	return write_common(args, nargs, "writew", 2);
+}
+
+DEFINE_FASTCALL(chwtest_writelw)
+{
+	return write_common(args, nargs, "writelw", 4);
+}
+
+DEFINE_FASTCALL(chwtest_writeq)
+{
+	return write_common(args, nargs, "writeq", 8);
+}
+
+/*
+ * Waits until (*address & mask) == (value & mask).  Spins for spin_ns and then backs off
+ * by sleeping for exponentially longer periods, up to a millisecond.  A
+ * negative spin_ns spins for the whole timeout.
+ *
+ * Runs without the GIL, so it must not touch any Python state.  Returns 0
+ * when the value matched, 1 on timeout and a negative errno on failure.
+ */
+static int
+poll_until(unsigned long address, uint64_t mask, uint64_t value,
+	   uint64_t timeout_ns, int64_t spin_ns, int width,
+	   uint64_t *result, uint64_t *iterations, uint64_t *elapsed_ns)
+{
+	uint64_t start = now_ns();
+	uint64_t now = start;
+	uint64_t current = 0;
+	uint64_t count = 0;
+	uint64_t backoff_ns = 1000;
+	int res = 1;
+
+	for (;;) {
+		/* The window is looked up on every iteration, so a poll does
+		 * not hold off threads that change the mapping cache. */
+		int err = read_reg(address, width, &current);
+		if (err) {
+			res = err;
+			break;
+		}
+		++count;
+		now = now_ns();
+		if ((current & mask) == (value & mask)) {
+			res = 0;
+			break;
+		}
+		if (now - start >= timeout_ns)
+			break;
+		if (spin_ns >= 0 && now - start >= (uint64_t)spin_ns) {
+			struct timespec ts;
+			uint64_t remaining = timeout_ns - (now - start);
+			uint64_t sleep_ns = (backoff_ns < remaining) ? backoff_ns : remaining;
+
+			ts.tv_sec = sleep_ns / 1000000000ULL;
+			ts.tv_nsec = sleep_ns % 1000000000ULL;
+			nanosleep(&ts, NULL);
+			if (backoff_ns < 1000000)
+				backoff_ns *= 2;
+		}
+	}
+
+	*result = current;
+	*iterations = count;
+	*elapsed_ns = now - start;
+	return res;
+}
+
+/*
+ * Programs are register access sequences that are checked and compiled
+ * once and then run entirely in C without the GIL, so that replaying a
+ * sequence does not pay for a Python call per access.  The ops are those
+ * of execute_batch, with reads stored into numbered slots, plus counted
+ * loops and forward branches on a slot.
+ */
+#define PROG_OP_LOOP		16
+#define PROG_OP_BRANCH		17
+#define PROG_OP_END_LOOP	18	/* only in compiled programs */
+#define PROG_MAX_SLOTS		65536
+
+struct prog_insn {
+	uint8_t op;
+	uint8_t width;
+	uint32_t arg;		/* slot or loop counter */
+	uint32_t index;		/* op this was compiled from */
+	unsigned long address;	/* or jump target */
+	uint64_t value;
+	uint64_t mask;
+	uint64_t timeout_ns;	/* poll timeout or loop count */
+};
+
+typedef struct {
+	PyObject_HEAD
+	struct prog_insn *insns;
+	Py_ssize_t count;
+	unsigned int nr_slots;
+	unsigned int nr_loops;
+	int uses_khwtest;
+} ProgramObject;
+
+static void prog_delay(uint64_t ns)
+{
+	uint64_t start = now_ns();
+
+	if (ns >= 100000) {
+		struct timespec ts;
+
+		ts.tv_sec = ns / 1000000000ULL;
+		ts.tv_nsec = ns % 1000000000ULL;
+		nanosleep(&ts, NULL);
+		return;
+	}
+	while (now_ns() - start < ns)
+		;
+}
+
+/*
+ * Runs a compiled program.  Called without the GIL.  Returns 0, or a
+ * negative errno with the index of the failing op in *failed.
+ */
+static int
+prog_run(const ProgramObject *prog, uint64_t *slots, uint64_t *counters,
+	 Py_ssize_t *failed)
+{
+	const struct prog_insn *insns = prog->insns;
+	Py_ssize_t pc = 0;
+	uint64_t value;
+	int res = 0;
+
+	while (pc < prog->count) {
+		const struct prog_insn *i = &insns[pc];
+
+		switch (i->op) {
+		case KHWTEST_OP_READ:
+			res = read_reg(i->address, i->width, &value);
+			if (res)
+				break;
+			slots[i->arg] = value;
+			trace_access(i->address, i->width, TRACE_READ, value);
+			break;
+		case KHWTEST_OP_WRITE:
+			res = write_reg(i->address, i->width, i->value);
+			if (!res)
+				trace_access(i->address, i->width, TRACE_WRITE, i->value);
+			break;
+		case KHWTEST_OP_RMW:
+			res = read_reg(i->address, i->width, &value);
+			if (res)
+				break;
+			value = (value & ~i->mask) | (i->value & i->mask);
+			res = write_reg(i->address, i->width, value);
+			if (!res)
+				trace_access(i->address, i->width, TRACE_WRITE, value);
+			break;
+		case KHWTEST_OP_POLL: {
+			uint64_t iterations, elapsed_ns;
+
+			res = poll_until(i->address, i->mask, i->value,
+					 i->timeout_ns, -1, i->width, &value,
+					 &iterations, &elapsed_ns);
+			if (res > 0)
+				res = -ETIMEDOUT;
+			if (!res)
+				trace_access(i->address, i->width, TRACE_READ | TRACE_POLL, value);
+			break;
+		}
+		case KHWTEST_OP_DELAY:
+			prog_delay(i->value);
+			break;
+		case PROG_OP_LOOP:
+			counters[i->arg] = i->timeout_ns;
+			if (!i->timeout_ns) {
+				/* Past the matching end of the loop. */
+				pc = i->address;
+				continue;
+			}
+			break;
+		case PROG_OP_END_LOOP:
+			if (--counters[i->arg]) {
+				pc = i->address;
+				continue;
+			}
+			break;
+		case PROG_OP_BRANCH:
+			if ((slots[i->arg] & i->mask) == i->value) {
+				pc = i->address;
+				continue;
+			}
+			break;
+		}
+		if (res) {
+			*failed = i->index;
+			return res;
+		}
+		++pc;
+	}
+	return 0;
+}
+
+static int check_prog_access(unsigned long address, unsigned int width)
+{
+	if (width != 1 && width != 2 && width != 4 && width != 8) {
+		PyErr_SetString(PyExc_ValueError, "Width must be 1, 2, 4 or 8.");
+		return -1;
+	}
+	if (address & (width - 1)) {
+		PyErr_SetString(PyExc_ValueError,
+			"Address must be a multiple of the width.");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Compiles ops into self.  Loops become a LOOP / END_LOOP pair around their
+ * body, and branch targets are translated from op offsets to instruction
+ * indexes.  A branch may only skip forward within the loop body it is in,
+ * which keeps every program finite.
+ */
+static int
+program_init(ProgramObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"ops", NULL};
+	PyObject *seq;
+	PyObject *ops;
+	struct prog_insn *insns = NULL;
+	Py_ssize_t *first_insn = NULL;	/* op index -> instruction index */
+	Py_ssize_t *loop_end = NULL;	/* op index -> op index past the loop */
+	Py_ssize_t *parent = NULL;	/* op index -> enclosing loop op or -1 */
+	Py_ssize_t *stack = NULL;
+	Py_ssize_t depth = 0;
+	Py_ssize_t nr_ops;
+	Py_ssize_t count = 0;
+	Py_ssize_t j;
+	unsigned int nr_slots = 0;
+	unsigned int nr_loops = 0;
+	int uses_khwtest = 0;
+	int res = -1;
+
+	/* run() uses the instructions without the GIL. */
+	if (self->insns) {
+		PyErr_SetString(PyExc_RuntimeError, "Program is already compiled.");
+		return -1;
+	}
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &ops))
+		return -1;
+	seq = PySequence_Fast(ops, "Operations must be a sequence of tuples.");
+	if (!seq)
+		return -1;
+	nr_ops = PySequence_Fast_GET_SIZE(seq);
+
+	/* Every op compiles to one instruction, loops to two. */
+	insns = PyMem_Malloc((2 * nr_ops + 1) * sizeof(*insns));
+	first_insn = PyMem_Malloc((nr_ops + 1) * sizeof(*first_insn));
+	loop_end = PyMem_Malloc((nr_ops + 1) * sizeof(*loop_end));
+	parent = PyMem_Malloc((nr_ops + 1) * sizeof(*parent));
+	stack = PyMem_Malloc((nr_ops + 1) * sizeof(*stack));
+	if (!insns || !first_insn || !loop_end || !parent || !stack) {
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	for (j = 0; j < nr_ops; ++j) {
+		PyObject *item = PySequence_Fast_GET_ITEM(seq, j);
+		struct prog_insn *i = &insns[count];
+		unsigned int op;
+		unsigned int width = 4;
+		unsigned long long value = 0;
+		unsigned long long mask = 0;
+		unsigned long long timeout_ns = 0;
+		unsigned long long length = 0;
+
+		/* Close the loops whose bodies end here. */
+		while (depth && loop_end[stack[depth - 1]] == j) {
+			Py_ssize_t loop = stack[--depth];
+			struct prog_insn *end = &insns[count++];
+
+			memset(end, 0, sizeof(*end));
+			end->op = PROG_OP_END_LOOP;
+			end->index = loop;
+			end->arg = insns[first_insn[loop]].arg;
+			end->address = first_insn[loop] + 1;
+			insns[first_insn[loop]].address = count;
+			i = &insns[count];
+		}
+		parent[j] = depth ? stack[depth - 1] : -1;
+		first_insn[j] = count;
+		loop_end[j] = -1;
+		memset(i, 0, sizeof(*i));
+		i->index = j;
+
+		if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) < 1) {
+			PyErr_Format(PyExc_ValueError, "Operation %zd is not a tuple.", j);
+			goto out;
+		}
+		if (!PyArg_Parse(PyTuple_GET_ITEM(item, 0), "I", &op))
+			goto out;
+		i->op = op;
+
+		switch (op) {
+		case KHWTEST_OP_WRITE:
+			if (!PyArg_ParseTuple(item, "IkK|I;(OP_WRITE, address, value[, width])",
+					      &op, &i->address, &value, &width))
+				goto out;
+			i->value = value;
+			break;
+		case KHWTEST_OP_READ:
+			if (!PyArg_ParseTuple(item, "IkI|I;(OP_READ, address, slot[, width])",
+					      &op, &i->address, &i->arg, &width))
+				goto out;
+			if (i->arg >= PROG_MAX_SLOTS) {
+				PyErr_Format(PyExc_ValueError,
+					"Read at operation %zd uses slot %u, slots go up to %u.",
+					j, i->arg, PROG_MAX_SLOTS - 1);
+				goto out;
+			}
+			if (i->arg >= nr_slots)
+				nr_slots = i->arg + 1;
+			break;
+		case KHWTEST_OP_RMW:
+			if (!PyArg_ParseTuple(item, "IkKK|I;(OP_RMW, address, value, mask[, width])",
+					      &op, &i->address, &value, &mask, &width))
+				goto out;
+			i->value = value;
+			i->mask = mask;
+			break;
+		case KHWTEST_OP_POLL:
+			if (!PyArg_ParseTuple(item,
+					      "IkKKK|I;(OP_POLL, address, value, mask, timeout_ns[, width])",
+					      &op, &i->address, &value, &mask,
+					      &timeout_ns, &width))
+				goto out;
+			i->value = value;
+			i->mask = mask;
+			i->timeout_ns = timeout_ns;
+			break;
+		case KHWTEST_OP_DELAY:
+			if (!PyArg_ParseTuple(item, "IK;(OP_DELAY, nanoseconds)",
+					      &op, &value))
+				goto out;
+			i->value = value;
+			break;
+		case PROG_OP_LOOP:
+			if (!PyArg_ParseTuple(item, "IKK;(OP_LOOP, count, length)",
+					      &op, &timeout_ns, &length))
+				goto out;
+			if (length > (unsigned long long)(nr_ops - j - 1) ||
+			    (parent[j] >= 0 && j + 1 + (Py_ssize_t)length > loop_end[parent[j]])) {
+				PyErr_Format(PyExc_ValueError,
+					"Loop at operation %zd extends past its enclosing block.", j);
+				goto out;
+			}
+			i->arg = nr_loops++;
+			i->timeout_ns = timeout_ns;
+			loop_end[j] = j + 1 + length;
+			stack[depth++] = j;
+			++count;
+			/* An empty loop ends right away. */
+			continue;
+		case PROG_OP_BRANCH:
+			if (!PyArg_ParseTuple(item, "IIKKK;(OP_BRANCH, slot, mask, value, skip)",
+					      &op, &i->arg, &mask, &value, &length))
+				goto out;
+			i->value = value;
+			i->mask = mask;
+			/* The target is resolved once all ops are compiled. */
+			i->timeout_ns = length;
+			++count;
+			continue;
+		default:
+			PyErr_Format(PyExc_ValueError, "Unknown operation %u at %zd.", op, j);
+			goto out;
+		}
+		if (op != KHWTEST_OP_DELAY) {
+			if (check_prog_access(i->address, width))
+				goto out;
+			i->width = width;
+			if (is_ram(i->address))
+				uses_khwtest = 1;
+		}
+		++count;
+	}
+	while (depth) {
+		Py_ssize_t loop = stack[--depth];
+		struct prog_insn *end = &insns[count++];
+
+		memset(end, 0, sizeof(*end));
+		end->op = PROG_OP_END_LOOP;
+		end->index = loop;
+		end->arg = insns[first_insn[loop]].arg;
+		end->address = first_insn[loop] + 1;
+		insns[first_insn[loop]].address = count;
+	}
+	first_insn[nr_ops] = count;
+
+	/* Resolve branches and check that their slots are ever read. */
+	for (j = 0; j < nr_ops; ++j) {
+		struct prog_insn *i = &insns[first_insn[j]];
+		Py_ssize_t target;
+		Py_ssize_t limit;
+
+		if (i->op != PROG_OP_BRANCH)
+			continue;
+		if (i->arg >= nr_slots) {
+			PyErr_Format(PyExc_ValueError,
+				"Branch at operation %zd tests slot %u which is never read.",
+				j, i->arg);
+			goto out;
+		}
+		limit = (parent[j] >= 0) ? loop_end[parent[j]] : nr_ops;
+		if (i->timeout_ns > (uint64_t)(limit - j - 1)) {
+			PyErr_Format(PyExc_ValueError,
+				"Branch at operation %zd skips past its enclosing block.", j);
+			goto out;
+		}
+		target = j + 1 + i->timeout_ns;
+		if (target < limit && parent[target] != parent[j]) {
+			PyErr_Format(PyExc_ValueError,
+				"Branch at operation %zd jumps into a loop.", j);
+			goto out;
+		}
+		/* Skipping to the end of a loop body lands on its END_LOOP. */
+		i->address = (target == limit && parent[j] >= 0) ?
+			insns[first_insn[parent[j]]].address - 1 : (unsigned long)first_insn[target];
+		i->timeout_ns = 0;
+	}
+
+	self->insns = insns;
+	insns = NULL;
+	self->count = count;
+	self->nr_slots = nr_slots;
+	self->nr_loops = nr_loops;
+	self->uses_khwtest = uses_khwtest;
+	res = 0;
+out:
+	PyMem_Free(insns);
+	PyMem_Free(first_insn);
+	PyMem_Free(loop_end);
+	PyMem_Free(parent);
+	PyMem_Free(stack);
+	Py_DECREF(seq);
+	return res;
+}
+
+static void
+program_dealloc(ProgramObject *self)
+{
+	PyMem_Free(self->insns);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Returns the slots as an array.array of unsigned 64 bit integers. */
+static PyObject *slots_to_array(const uint64_t *slots, unsigned int nr_slots)
+{
+	PyObject *array_module;
+	PyObject *data;
+	PyObject *result;
+
+	array_module = PyImport_ImportModule("array");
+	if (!array_module)
+		return NULL;
+	data = PyBytes_FromStringAndSize((const char *)slots,
+					 nr_slots * sizeof(slots[0]));
+	if (!data) {
+		Py_DECREF(array_module);
+		return NULL;
+	}
+	result = PyObject_CallMethod(array_module, "array", "sO",
+				     (sizeof(unsigned long) == 8) ? "L" : "Q", data);
+	Py_DECREF(data);
+	Py_DECREF(array_module);
+	return result;
+}
+
+static PyObject *
+program_run(ProgramObject *self, PyObject *args)
+{
+	uint64_t *slots;
+	uint64_t *counters;
+	Py_ssize_t failed = 0;
+	PyObject *result = NULL;
+	int res;
+
+	if (!self->insns) {
+		PyErr_SetString(PyExc_ValueError, "Program is not compiled.");
+		return NULL;
+	}
+	if (self->uses_khwtest) {
+		open_khwtest();
+		if (PyErr_Occurred() != NULL)
+			return NULL;
+	}
+	slots = PyMem_Malloc(((size_t)self->nr_slots + 1) * sizeof(*slots));
+	counters = PyMem_Malloc((self->nr_loops + 1) * sizeof(*counters));
+	if (!slots || !counters) {
+		PyErr_NoMemory();
+		goto out;
+	}
+	memset(slots, 0, ((size_t)self->nr_slots + 1) * sizeof(*slots));
+
+	Py_BEGIN_ALLOW_THREADS
+	res = prog_run(self, slots, counters, &failed);
+	Py_END_ALLOW_THREADS
+	if (res) {
+		char msg[80];
+		PyObject *exc;
+
+		snprintf(msg, sizeof(msg), "Program failed at operation %zd: %s",
+			 failed, strerror(-res));
+		exc = Py_BuildValue("(is)", -res, msg);
+		if (exc) {
+			PyErr_SetObject(PyExc_IOError, exc);
+			Py_DECREF(exc);
+		}
+		goto out;
+	}
+	result = slots_to_array(slots, self->nr_slots);
+out:
+	PyMem_Free(slots);
+	PyMem_Free(counters);
+	return result;
+}
+
+static Py_ssize_t
+program_length(ProgramObject *self)
+{
+	return self->count;
+}
+
+static PySequenceMethods program_as_sequence = {
+	(lenfunc)program_length,
+};
+
+static PyMemberDef program_members[] = {
+	{"slots", T_UINT, offsetof(ProgramObject, nr_slots), READONLY,
+	 "Number of read slots returned by run()."},
+	{NULL},
+};
+
+static PyMethodDef program_methods[] = {
+	{"run", (PyCFunction)program_run, METH_NOARGS,
+	 "Run the program without the GIL and return the read slots as an array."},
+	{NULL},
+};
+
+static PyTypeObject ProgramType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "chwtest.Program",
+	.tp_basicsize = sizeof(ProgramObject),
+	.tp_dealloc = (destructor)program_dealloc,
+	.tp_as_sequence = &program_as_sequence,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_doc = "Program(ops)\n\n"
+		  "Register access sequence compiled once and run natively.  ops is a\n"
+		  "list of tuples:\n\n"
+		  "  (OP_WRITE, address, value[, width])\n"
+		  "  (OP_READ, address, slot[, width])\n"
+		  "  (OP_RMW, address, value, mask[, width])\n"
+		  "  (OP_POLL, address, value, mask, timeout_ns[, width])\n"
+		  "  (OP_DELAY, nanoseconds)\n"
+		  "  (OP_LOOP, count, length)  repeat the next length ops\n"
+		  "  (OP_BRANCH, slot, mask, value, skip)  skip the next skip ops\n"
+		  "                                        if slot & mask == value\n",
+	.tp_methods = program_methods,
+	.tp_members = program_members,
+	.tp_init = (initproc)program_init,
+	.tp_new = PyType_GenericNew,
+};
+
+static PyObject *
+chwtest_poll_until(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"address", "mask", "value", "timeout_ns",
+				 "width", "spin_ns", NULL};
+	unsigned long int address;
+	unsigned long long mask;
+	unsigned long long value;
+	unsigned long long timeout_ns;
+	long long spin_ns = -1;
+	int width = 4;
+	uint64_t result, iterations, elapsed_ns;
+	int res;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "kKKK|iL", kwlist,
+					 &address, &mask, &value, &timeout_ns,
+					 &width, &spin_ns))
+		return NULL;
+	if (check_block_args(address, width, width))
+		return NULL;
+
+	if (is_ram(address)) {
+		open_khwtest();
+		if (PyErr_Occurred() != NULL)
+			return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	res = poll_until(address, mask, value, timeout_ns, spin_ns, width,
+			 &result, &iterations, &elapsed_ns);
+	Py_END_ALLOW_THREADS
+	if (res < 0) {
+		set_errno_error(res, backend_path(address));
+		return NULL;
+	}
+	trace_access(address, width, TRACE_READ | TRACE_POLL, result);
+	return Py_BuildValue("KKK", (unsigned long long)result,
+			     (unsigned long long)iterations,
+			     (unsigned long long)elapsed_ns);
+}
+
+/*
+ * A Poller checks any number of register waits from one background thread,
+ * so that a single event loop can supervise many devices without a thread
+ * per device.  Waits that finish, by matching or timing out, are queued in
+ * the order they finished and announced on an eventfd that the event loop
+ * watches.  The thread runs without the GIL and sleeps while nothing is
+ * pending.
+ */
+struct poller_wait {
+	struct poller_wait *next;
+	unsigned long id;
+	unsigned long address;
+	uint64_t mask;
+	uint64_t value;
+	uint64_t deadline_ns;
+	uint64_t result;
+	int width;
+	int status;		/* 0 matched, 1 timed out or a negative errno */
+	int cancelled;		/* cancelled while its sweep was running */
+};
+
+#define POLLER_PENDING	2	/* status of a wait that has not finished */
+
+typedef struct {
+	PyObject_HEAD
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t thread;
+	int started;
+	int stopping;
+	int efd;
+	unsigned long next_id;
+	unsigned long interval_ns;
+	unsigned long nr_pending;
+	struct poller_wait *pending;
+	struct poller_wait *sweeping;	/* taken by the running sweep */
+	struct poller_wait *done;
+	struct poller_wait **done_tail;
+} PollerObject;
+
+/*
+ * Checks every pending wait once.  Called with the lock held, which is
+ * dropped around the register reads, so that add(), cancel() and
+ * completed() never wait for slow device reads with the GIL held.  Waits
+ * added meanwhile go to a new pending list.  Returns the number of waits
+ * that finished.
+ */
+static int poller_sweep(PollerObject *self)
+{
+	struct poller_wait *batch = self->pending;
+	struct poller_wait *w, *next;
+	int finished = 0;
+
+	self->pending = NULL;
+	self->sweeping = batch;
+	pthread_mutex_unlock(&self->lock);
+	for (w = batch; w; w = w->next) {
+		int res = read_reg(w->address, w->width, &w->result);
+
+		if (res)
+			w->status = res;
+		else if ((w->result & w->mask) == (w->value & w->mask))
+			w->status = 0;
+		else if (now_ns() >= w->deadline_ns)
+			w->status = 1;
+		else
+			w->status = POLLER_PENDING;
+	}
+	pthread_mutex_lock(&self->lock);
+	self->sweeping = NULL;
+
+	for (w = batch; w; w = next) {
+		next = w->next;
+		w->next = NULL;
+		if (w->cancelled) {
+			free(w);
+		} else if (w->status == POLLER_PENDING) {
+			w->next = self->pending;
+			self->pending = w;
+		} else {
+			*self->done_tail = w;
+			self->done_tail = &w->next;
+			--self->nr_pending;
+			++finished;
+		}
+	}
+	return finished;
+}
+
+static void poller_notify(PollerObject *self)
+{
+	uint64_t one = 1;
+
+	/* Can only fail when the counter is full, and then it is readable
+	 * anyway. */
+	if (write(self->efd, &one, sizeof(one)) < 0)
+		return;
+}
+
+static void *poller_thread(void *arg)
+{
+	PollerObject *self = arg;
+
+	pthread_mutex_lock(&self->lock);
+	while (!self->stopping) {
+		struct timespec ts;
+
+		if (!self->pending) {
+			pthread_cond_wait(&self->wake, &self->lock);
+			continue;
+		}
+		if (poller_sweep(self))
+			poller_notify(self);
+		if (!self->pending)
+			continue;
+		ts.tv_sec = self->interval_ns / 1000000000UL;
+		ts.tv_nsec = self->interval_ns % 1000000000UL;
+		pthread_mutex_unlock(&self->lock);
+		nanosleep(&ts, NULL);
+		pthread_mutex_lock(&self->lock);
+	}
+	pthread_mutex_unlock(&self->lock);
+	return NULL;
+}
+
+static void poller_free_list(struct poller_wait *w)
+{
+	while (w) {
+		struct poller_wait *next = w->next;
+		free(w);
+		w = next;
+	}
+}
+
+static void poller_stop(PollerObject *self)
+{
+	if (self->started) {
+		pthread_mutex_lock(&self->lock);
+		self->stopping = 1;
+		pthread_cond_signal(&self->wake);
+		pthread_mutex_unlock(&self->lock);
+		Py_BEGIN_ALLOW_THREADS
+		pthread_join(self->thread, NULL);
+		Py_END_ALLOW_THREADS
+		self->started = 0;
+	}
+	poller_free_list(self->pending);
+	poller_free_list(self->done);
+	self->pending = self->done = NULL;
+	self->done_tail = &self->done;
+	self->nr_pending = 0;
+	if (self->efd != -1) {
+		close(self->efd);
+		self->efd = -1;
+	}
+}
+
+static int
+poller_init(PollerObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"interval_ns", NULL};
+	unsigned long interval_ns = 10000;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|k", kwlist, &interval_ns))
+		return -1;
+	if (self->done_tail) {
+		PyErr_SetString(PyExc_ValueError, "Poller is already initialized.");
+		return -1;
+	}
+	self->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (self->efd == -1) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return -1;
+	}
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->wake, NULL);
+	self->interval_ns = interval_ns;
+	self->next_id = 1;
+	self->done_tail = &self->done;
+	return 0;
+}
+
+static void
+poller_dealloc(PollerObject *self)
+{
+	if (self->done_tail) {
+		poller_stop(self);
+		pthread_cond_destroy(&self->wake);
+		pthread_mutex_destroy(&self->lock);
+	}
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int poller_check(PollerObject *self)
+{
+	if (!self->done_tail || self->efd == -1) {
+		PyErr_SetString(PyExc_ValueError, "Poller is closed.");
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *
+poller_add(PollerObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"address", "mask", "value", "timeout_ns",
+				 "width", NULL};
+	unsigned long address;
+	unsigned long long mask;
+	unsigned long long value;
+	long long timeout_ns = -1;
+	int width = 4;
+	struct poller_wait *w;
+	unsigned long id;
+	int res = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "kKK|Li", kwlist,
+					 &address, &mask, &value, &timeout_ns,
+					 &width))
+		return NULL;
+	if (poller_check(self) || check_block_args(address, width, width))
+		return NULL;
+	if (is_ram(address)) {
+		open_khwtest();
+		if (PyErr_Occurred() != NULL)
+			return NULL;
+	}
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return PyErr_NoMemory();
+	w->address = address;
+	w->mask = mask;
+	w->value = value;
+	w->width = width;
+	w->deadline_ns = (timeout_ns < 0) ? UINT64_MAX : now_ns() + timeout_ns;
+
+	pthread_mutex_lock(&self->lock);
+	if (!self->started) {
+		res = pthread_create(&self->thread, NULL, poller_thread, self);
+		self->started = !res;
+	}
+	if (!res) {
+		id = w->id = self->next_id++;
+		w->next = self->pending;
+		self->pending = w;
+		++self->nr_pending;
+		pthread_cond_signal(&self->wake);
+	}
+	pthread_mutex_unlock(&self->lock);
+	if (res) {
+		free(w);
+		errno = res;
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+	return PyLong_FromUnsignedLong(id);
+}
+
+static PyObject *
+poller_cancel(PollerObject *self, PyObject *args)
+{
+	struct poller_wait **pw;
+	struct poller_wait *w = NULL;
+	unsigned long id;
+	int found = 0;
+
+	if (!PyArg_ParseTuple(args, "k", &id))
+		return NULL;
+	if (poller_check(self))
+		return NULL;
+
+	pthread_mutex_lock(&self->lock);
+	for (pw = &self->pending; *pw; pw = &(*pw)->next) {
+		if ((*pw)->id == id) {
+			w = *pw;
+			*pw = w->next;
+			--self->nr_pending;
+			break;
+		}
+	}
+	if (!w) {
+		/* The sweep frees it when it is done with it. */
+		for (pw = &self->sweeping; *pw; pw = &(*pw)->next) {
+			if ((*pw)->id == id && !(*pw)->cancelled) {
+				(*pw)->cancelled = 1;
+				--self->nr_pending;
+				found = 1;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&self->lock);
+	free(w);
+	return PyBool_FromLong(w != NULL || found);
+}
+
+static PyObject *
+poller_completed(PollerObject *self, PyObject *args)
+{
+	struct poller_wait *done;
+	struct poller_wait *w;
+	PyObject *list;
+	uint64_t count;
+
+	if (poller_check(self))
+		return NULL;
+	/* Clear the eventfd first so that a wait finishing meanwhile makes it
+	 * readable again. */
+	if (read(self->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	pthread_mutex_lock(&self->lock);
+	done = self->done;
+	self->done = NULL;
+	self->done_tail = &self->done;
+	pthread_mutex_unlock(&self->lock);
+
+	list = PyList_New(0);
+	for (w = done; list && w; w = w->next) {
+		PyObject *item = Py_BuildValue("kiK", w->id, w->status,
+					       (unsigned long long)w->result);
+		if (!item || PyList_Append(list, item)) {
+			Py_XDECREF(item);
+			Py_CLEAR(list);
+			break;
+		}
+		Py_DECREF(item);
+	}
+	poller_free_list(done);
+	return list;
+}
+
+static PyObject *
+poller_fileno(PollerObject *self, PyObject *args)
+{
+	if (poller_check(self))
+		return NULL;
+	return PyLong_FromLong(self->efd);
+}
+
+static PyObject *
+poller_close(PollerObject *self, PyObject *args)
+{
+	if (self->done_tail)
+		poller_stop(self);
+	Py_RETURN_NONE;
+}
+
+static PyMemberDef poller_members[] = {
+	{"interval_ns", T_ULONG, offsetof(PollerObject, interval_ns), 0,
+	 "Time the thread sleeps between checks of the pending waits."},
+	{"pending", T_ULONG, offsetof(PollerObject, nr_pending), READONLY,
+	 "Number of waits that have not finished."},
+	{NULL},
+};
+
+static PyMethodDef poller_methods[] = {
+	{"add", (PyCFunction)poller_add, METH_VARARGS | METH_KEYWORDS,
+	 "add(address, mask, value, timeout_ns=-1, width=4)\n\n"
+	 "Start waiting until (register & mask) == (value & mask) and return\n"
+	 "an id for the wait.  A negative timeout_ns waits forever.\n"},
+	{"cancel", (PyCFunction)poller_cancel, METH_VARARGS,
+	 "Stop a pending wait.  Returns False if it already finished."},
+	{"completed", (PyCFunction)poller_completed, METH_NOARGS,
+	 "Return the waits that finished since the last call, in the order\n"
+	 "they finished, as (id, status, value) tuples.  status is 0 when the\n"
+	 "value matched, 1 on timeout and a negative errno on failure.\n"},
+	{"fileno", (PyCFunction)poller_fileno, METH_NOARGS,
+	 "Return an eventfd that is readable while completed() has waits."},
+	{"close", (PyCFunction)poller_close, METH_NOARGS,
+	 "Stop the thread and drop all waits."},
+	{NULL},
+};
+
+static PyTypeObject PollerType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "chwtest.Poller",
+	.tp_basicsize = sizeof(PollerObject),
+	.tp_dealloc = (destructor)poller_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_doc = "Poller(interval_ns=10000)\n\n"
+		  "Waits for many registers from one background thread.",
+	.tp_methods = poller_methods,
+	.tp_members = poller_members,
+	.tp_init = (initproc)poller_init,
+	.tp_new = PyType_GenericNew,
+};
+
+/*
+ * A Ring fills and reaps descriptor rings in DMA memory a batch at a time.
+ * The descriptor layout is compiled once to offsets and widths, and each
+ * batch is assembled in a local buffer and moved with one block access,
+ * instead of one Python call per field.  head and tail run freely and are
+ * reduced modulo the ring size, so a full ring needs no spare slot.
+ */
+#define RING_MAX_STRIDE		65536
+
+struct ring_field {
+	PyObject *name;
+	unsigned int offset;
+	unsigned int width;
+	int big_endian;
+};
+
+typedef struct {
+	PyObject_HEAD
+	unsigned long address;
+	unsigned long count;
+	unsigned long stride;
+	unsigned long doorbell;
+	int doorbell_width;
+	int width;		/* block access width */
+	Py_ssize_t nr_fields;
+	struct ring_field *fields;
+	uint64_t head;
+	uint64_t tail;
+	int busy;		/* a transfer runs without the GIL */
+} RingObject;
+
+static uint64_t ring_swap(uint64_t value, unsigned int width)
+{
+	switch (width) {
+	case 2: return __builtin_bswap16(value);
+	case 4: return __builtin_bswap32(value);
+	case 8: return __builtin_bswap64(value);
+	default: return value;
+	}
+}
+
+static void ring_put(const struct ring_field *f, uint8_t *desc, uint64_t value)
+{
+	if (f->big_endian)
+		value = ring_swap(value, f->width);
+	/* Little endian hosts only, like the rest of this file. */
+	memcpy(desc + f->offset, &value, f->width);
+}
+
+static uint64_t ring_get(const struct ring_field *f, const uint8_t *desc)
+{
+	uint64_t value = 0;
+
+	memcpy(&value, desc + f->offset, f->width);
+	return f->big_endian ? ring_swap(value, f->width) : value;
+}
+
+static void free_ring_fields(struct ring_field *fields, Py_ssize_t nr_fields)
+{
+	Py_ssize_t i;
+
+	for (i = 0; i < nr_fields; ++i)
+		Py_XDECREF(fields[i].name);
+	PyMem_Free(fields);
+}
+
+/*
+ * Everything is checked before it is stored, and a ring cannot be
+ * initialized twice: the fields and geometry are used without the GIL.
+ */
+static int
+ring_init(RingObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"address", "count", "layout", "stride",
+				 "doorbell", "doorbell_width", NULL};
+	PyObject *layout;
+	PyObject *seq;
+	struct ring_field *fields;
+	Py_ssize_t nr_fields;
+	unsigned long address;
+	unsigned long count;
+	unsigned long stride = 0;
+	unsigned long doorbell = 0;
+	int doorbell_width = 4;
+	uint64_t end = 0;
+	Py_ssize_t i;
+
+	if (self->fields) {
+		PyErr_SetString(PyExc_RuntimeError, "Ring is already initialized.");
+		return -1;
+	}
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "kkO|kki", kwlist,
+					 &address, &count, &layout,
+					 &stride, &doorbell, &doorbell_width))
+		return -1;
+	if (!count) {
+		PyErr_SetString(PyExc_ValueError, "A ring needs at least one descriptor.");
+		return -1;
+	}
+	if (doorbell && check_block_args(doorbell, doorbell_width,
+					 doorbell_width))
+		return -1;
+
+	seq = PySequence_Fast(layout, "layout must be a sequence of fields.");
+	if (!seq)
+		return -1;
+	nr_fields = PySequence_Fast_GET_SIZE(seq);
+	fields = PyMem_Malloc((nr_fields + 1) * sizeof(*fields));
+	if (!fields) {
+		Py_DECREF(seq);
+		PyErr_NoMemory();
+		return -1;
+	}
+	memset(fields, 0, (nr_fields + 1) * sizeof(*fields));
+	for (i = 0; i < nr_fields; ++i) {
+		struct ring_field *f = &fields[i];
+
+		if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i),
+				      "OII|i;layout fields are (name, offset, width[, big_endian])",
+				      &f->name, &f->offset, &f->width,
+				      &f->big_endian)) {
+			f->name = NULL;
+			goto fail;
+		}
+		Py_INCREF(f->name);
+		if (f->width != 1 && f->width != 2 && f->width != 4 && f->width != 8) {
+			PyErr_Format(PyExc_ValueError,
+				     "Field %zd: width must be 1, 2, 4 or 8.", i);
+			goto fail;
+		}
+		/* In 64 bits, so that offsets near 4G do not wrap. */
+		if ((uint64_t)f->offset + f->width > end)
+			end = (uint64_t)f->offset + f->width;
+	}
+
+	if (!stride)
+		stride = (end + 7) & ~7UL;
+	if (!stride || stride < end) {
+		PyErr_SetString(PyExc_ValueError,
+				"The stride must hold every field.");
+		goto fail;
+	}
+	/* Descriptors are staged in buffers of n * stride bytes. */
+	if (stride > RING_MAX_STRIDE || count > ULONG_MAX / stride ||
+	    address + count * stride < address) {
+		PyErr_Format(PyExc_ValueError,
+			     "Descriptors are limited to %u bytes and the ring must fit the address space.",
+			     RING_MAX_STRIDE);
+		goto fail;
+	}
+	Py_DECREF(seq);
+
+	self->address = address;
+	self->count = count;
+	self->stride = stride;
+	self->doorbell = doorbell;
+	self->doorbell_width = doorbell_width;
+	/* The widest access that fits both the ring and the descriptors. */
+	for (self->width = 8; self->width > 1; self->width /= 2) {
+		if (!((address | stride) & (self->width - 1)))
+			break;
+	}
+	self->head = self->tail = 0;
+	self->nr_fields = nr_fields;
+	self->fields = fields;
+	return 0;
+fail:
+	Py_DECREF(seq);
+	free_ring_fields(fields, nr_fields);
+	return -1;
+}
+
+static void
+ring_dealloc(RingObject *self)
+{
+	free_ring_fields(self->fields, self->nr_fields);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/*
+ * head and tail only change with the GIL held, but a transfer releases it
+ * between reading them and moving them on, so only one may run at a time.
+ */
+static int ring_idle(RingObject *self)
+{
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError,
+				"Ring is in use by another thread.");
+		return -1;
+	}
+	return 0;
+}
+
+static int ring_check(RingObject *self)
+{
+	if (!self->fields) {
+		PyErr_SetString(PyExc_ValueError, "Ring is not initialized.");
+		return -1;
+	}
+	if (ring_idle(self))
+		return -1;
+	if (range_has_ram(self->address, self->count * self->stride)) {
+		open_khwtest();
+		if (PyErr_Occurred() != NULL)
+			return -1;
+	}
+	return 0;
+}
+
+/* Moves n descriptors from index on, wrapping at the end of the ring. */
+static int ring_io(RingObject *self, uint64_t index, unsigned long n,
+		   uint8_t *buf, int write)
+{
+	const unsigned long base = self->address;
+	const unsigned long count = self->count;
+	const unsigned long stride = self->stride;
+	const int width = self->width;
+	int res = 0;
+
+	self->busy = 1;
+	Py_BEGIN_ALLOW_THREADS
+	while (n && !res) {
+		unsigned long slot = index % count;
+		unsigned long run = count - slot;
+		unsigned long address = base + slot * stride;
+
+		if (run > n)
+			run = n;
+		if (write)
+			res = write_block(address, buf, run * stride, width);
+		else
+			res = read_block(address, buf, run * stride, width);
+		index += run;
+		buf += run * stride;
+		n -= run;
+	}
+	Py_END_ALLOW_THREADS
+	self->busy = 0;
+	if (res) {
+		set_errno_error(res, backend_path(base));
+		return -1;
+	}
+	return 0;
+}
+
+/* Converts a field value like the "K" format, without its overhead. */
+static int value_from_object(PyObject *obj, unsigned long long *value)
+{
+#if PY_MAJOR_VERSION < 3
+	if (PyInt_Check(obj)) {
+		*value = PyInt_AS_LONG(obj);
+		return 0;
+	}
+#endif
+	*value = PyLong_AsUnsignedLongLongMask(obj);
+	if (*value == (unsigned long long)-1 && PyErr_Occurred() != NULL)
+		return -1;
+	return 0;
+}
+
+/* Stores one descriptor given as a sequence in layout order or a dict. */
+static int ring_pack(RingObject *self, PyObject *item, uint8_t *desc)
+{
+	Py_ssize_t i;
+	PyObject *seq = NULL;
+
+	if (!PyDict_Check(item)) {
+		seq = PySequence_Fast(item, "descriptors must be sequences or dicts.");
+		if (!seq)
+			return -1;
+		if (PySequence_Fast_GET_SIZE(seq) > self->nr_fields) {
+			PyErr_SetString(PyExc_ValueError,
+					"Descriptor has more values than fields.");
+			goto fail;
+		}
+	}
+	memset(desc, 0, self->stride);
+	for (i = 0; i < self->nr_fields; ++i) {
+		const struct ring_field *f = &self->fields[i];
+		PyObject *obj;
+		unsigned long long value;
+
+		if (seq)
+			obj = (i < PySequence_Fast_GET_SIZE(seq)) ?
+				PySequence_Fast_GET_ITEM(seq, i) : NULL;
+		else
+			obj = PyDict_GetItem(item, f->name);
+		if (!obj)
+			continue;
+		if (value_from_object(obj, &value))
+			goto fail;
+		if (f->width < 8 && (value >> (8 * f->width))) {
+			PyErr_Format(PyExc_OverflowError,
+				     "Value does not fit field %zd.", i);
+			goto fail;
+		}
+		ring_put(f, desc, value);
+	}
+	Py_XDECREF(seq);
+	return 0;
+fail:
+	Py_XDECREF(seq);
+	return -1;
+}
+
+static PyObject *ring_unpack(RingObject *self, const uint8_t *desc)
+{
+	PyObject *tuple = PyTuple_New(self->nr_fields);
+	Py_ssize_t i;
+
+	for (i = 0; tuple && i < self->nr_fields; ++i) {
+		PyObject *value = PyLong_FromUnsignedLongLong(
+				ring_get(&self->fields[i], desc));
+		if (!value) {
+			Py_CLEAR(tuple);
+			break;
+		}
+		PyTuple_SET_ITEM(tuple, i, value);
+	}
+	return tuple;
+}
+
+static PyObject *ring_unpack_list(RingObject *self, const uint8_t *buf,
+				  unsigned long n)
+{
+	PyObject *list = PyList_New(n);
+	unsigned long i;
+
+	for (i = 0; list && i < n; ++i) {
+		PyObject *desc = ring_unpack(self, buf + i * self->stride);
+		if (!desc) {
+			Py_CLEAR(list);
+			break;
+		}
+		PyList_SET_ITEM(list, i, desc);
+	}
+	return list;
+}
+
+static PyObject *
+ring_fill(RingObject *self, PyObject *args)
+{
+	PyObject *descriptors;
+	PyObject *seq;
+	uint8_t *buf;
+	Py_ssize_t n, i;
+	int res = -1;
+
+	if (!PyArg_ParseTuple(args, "O", &descriptors))
+		return NULL;
+	if (ring_check(self))
+		return NULL;
+	seq = PySequence_Fast(descriptors, "descriptors must be a sequence.");
+	if (!seq)
+		return NULL;
+	n = PySequence_Fast_GET_SIZE(seq);
+	if ((uint64_t)n > self->count - (self->head - self->tail)) {
+		PyErr_Format(PyExc_ValueError,
+			     "%zd descriptors do not fit, %llu are free.", n,
+			     (unsigned long long)(self->count - (self->head - self->tail)));
+		Py_DECREF(seq);
+		return NULL;
+	}
+	buf = PyMem_Malloc(n * self->stride + 1);
+	if (!buf) {
+		Py_DECREF(seq);
+		return PyErr_NoMemory();
+	}
+	for (i = 0; i < n; ++i) {
+		if (ring_pack(self, PySequence_Fast_GET_ITEM(seq, i),
+			      buf + i * self->stride))
+			goto out;
+	}
+	if (ring_io(self, self->head, n, buf, 1))
+		goto out;
+	self->head += n;
+	if (self->doorbell && n) {
+		/* The descriptors must be visible before the device is told. */
+		__sync_synchronize();
+		if (write_phys(self->doorbell, self->doorbell_width,
+			       self->head % self->count))
+			goto out;
+	}
+	res = 0;
+out:
+	PyMem_Free(buf);
+	Py_DECREF(seq);
+	if (res)
+		return NULL;
+	return PyLong_FromUnsignedLong(self->head % self->count);
+}
+
+static PyObject *
+ring_reap(RingObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"field", "mask", "value", "max", NULL};
+	unsigned long long mask;
+	unsigned long long value;
+	Py_ssize_t field;
+	Py_ssize_t max = -1;
+	const struct ring_field *f;
+	PyObject *result;
+	uint8_t *buf;
+	unsigned long used, n;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "nKK|n", kwlist,
+					 &field, &mask, &value, &max))
+		return NULL;
+	if (ring_check(self))
+		return NULL;
+	if (field < 0 || field >= self->nr_fields) {
+		PyErr_SetString(PyExc_IndexError, "No such field.");
+		return NULL;
+	}
+	f = &self->fields[field];
+	used = self->head - self->tail;
+	if (max >= 0 && (unsigned long)max < used)
+		used = max;
+
+	buf = PyMem_Malloc(used * self->stride + 1);
+	if (!buf)
+		return PyErr_NoMemory();
+	if (ring_io(self, self->tail, used, buf, 0)) {
+		PyMem_Free(buf);
+		return NULL;
+	}
+	/* Devices complete in order, so stop at the first busy one. */
+	for (n = 0; n < used; ++n) {
+		if ((ring_get(f, buf + n * self->stride) & mask) != (value & mask))
+			break;
+	}
+	result = ring_unpack_list(self, buf, n);
+	if (result)
+		self->tail += n;
+	PyMem_Free(buf);
+	return result;
+}
+
+static PyObject *
+ring_reap_to(RingObject *self, PyObject *args)
+{
+	unsigned long index;
+	unsigned long n;
+
+	if (!PyArg_ParseTuple(args, "k", &index))
+		return NULL;
+	if (ring_idle(self))
+		return NULL;
+	if (index >= self->count) {
+		PyErr_SetString(PyExc_IndexError, "Index is outside of the ring.");
+		return NULL;
+	}
+	n = (index + self->count - self->tail % self->count) % self->count;
+	/* With a full ring head and tail are at the same index. */
+	if (!n && self->head - self->tail == self->count)
+		n = self->count;
+	if (n > self->head - self->tail) {
+		PyErr_SetString(PyExc_ValueError,
+				"Index is past the last filled descriptor.");
+		return NULL;
+	}
+	self->tail += n;
+	return PyLong_FromUnsignedLong(n);
+}
+
+static PyObject *
+ring_read(RingObject *self, PyObject *args)
+{
+	unsigned long index;
+	unsigned long n = 1;
+	PyObject *result;
+	uint8_t *buf;
+
+	if (!PyArg_ParseTuple(args, "k|k", &index, &n))
+		return NULL;
+	if (ring_check(self))
+		return NULL;
+	if (index >= self->count || n > self->count) {
+		PyErr_SetString(PyExc_IndexError, "Read is outside of the ring.");
+		return NULL;
+	}
+	buf = PyMem_Malloc(n * self->stride + 1);
+	if (!buf)
+		return PyErr_NoMemory();
+	result = NULL;
+	if (!ring_io(self, index, n, buf, 0))
+		result = ring_unpack_list(self, buf, n);
+	PyMem_Free(buf);
+	return result;
+}
+
+static PyObject *
+ring_reset(RingObject *self, PyObject *args)
+{
+	if (ring_idle(self))
+		return NULL;
+	self->head = self->tail = 0;
+	Py_RETURN_NONE;
+}
+
+static PyObject *ring_get_head(RingObject *self, void *closure)
+{
+	/* count is 0 until the ring is initialized. */
+	return PyLong_FromUnsignedLong(self->count ? self->head % self->count : 0);
+}
+
+static PyObject *ring_get_tail(RingObject *self, void *closure)
+{
+	/* count is 0 until the ring is initialized. */
+	return PyLong_FromUnsignedLong(self->count ? self->tail % self->count : 0);
+}
+
+static PyObject *ring_get_used(RingObject *self, void *closure)
+{
+	return PyLong_FromUnsignedLong(self->head - self->tail);
+}
+
+static PyObject *ring_get_free(RingObject *self, void *closure)
+{
+	return PyLong_FromUnsignedLong(self->count - (self->head - self->tail));
+}
+
+static PyGetSetDef ring_getset[] = {
+	{"head", (getter)ring_get_head, NULL,
+	 "Slot the next filled descriptor goes to, the producer index."},
+	{"tail", (getter)ring_get_tail, NULL,
+	 "Oldest descriptor that has not been reaped, the consumer index."},
+	{"used", (getter)ring_get_used, NULL,
+	 "Descriptors filled and not reaped yet."},
+	{"free", (getter)ring_get_free, NULL,
+	 "Descriptors that can be filled."},
+	{NULL},
+};
+
+static PyMemberDef ring_members[] = {
+	{"address", T_ULONG, offsetof(RingObject, address), READONLY,
+	 "Physical address of the first descriptor."},
+	{"count", T_ULONG, offsetof(RingObject, count), READONLY,
+	 "Number of descriptors in the ring."},
+	{"stride", T_ULONG, offsetof(RingObject, stride), READONLY,
+	 "Bytes from one descriptor to the next."},
+	{NULL},
+};
+
+static PyMethodDef ring_methods[] = {
+	{"fill", (PyCFunction)ring_fill, METH_VARARGS,
+	 "fill(descriptors)\n\n"
+	 "Write descriptors at head, given as sequences in layout order or as\n"
+	 "dicts by field name, with missing fields 0.  Advances head, rings the\n"
+	 "doorbell with the new head and returns it.\n"},
+	{"reap", (PyCFunction)ring_reap, METH_VARARGS | METH_KEYWORDS,
+	 "reap(field, mask, value, max=-1)\n\n"
+	 "Return the descriptors from tail on whose field number field has\n"
+	 "(field & mask) == (value & mask) as tuples, up to the first one that\n"
+	 "does not, and advance tail past them.\n"},
+	{"reap_to", (PyCFunction)ring_reap_to, METH_VARARGS,
+	 "reap_to(index)\n\n"
+	 "Advance tail to a consumer index reported by the device and return\n"
+	 "how many descriptors that completed.\n"},
+	{"read", (PyCFunction)ring_read, METH_VARARGS,
+	 "read(index, count=1)\n\n"
+	 "Return count descriptors from slot index on as tuples.\n"},
+	{"reset", (PyCFunction)ring_reset, METH_NOARGS,
+	 "Set head and tail back to slot 0."},
+	{NULL},
+};
+
+static PyTypeObject RingType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "chwtest.Ring",
+	.tp_basicsize = sizeof(RingObject),
+	.tp_dealloc = (destructor)ring_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_doc = "Ring(address, count, layout, stride=0, doorbell=0, doorbell_width=4)\n\n"
+		  "Descriptor ring of count descriptors at a physical address.\n"
+		  "layout is a list of (name, offset, width[, big_endian]) fields.\n"
+		  "The stride defaults to the descriptor size rounded up to 8 bytes.\n"
+		  "With a doorbell, fill() writes the new head to that register.\n"
+		  "Only one thread can use a ring at a time, others get RuntimeError.",
+	.tp_methods = ring_methods,
+	.tp_members = ring_members,
+	.tp_getset = ring_getset,
+	.tp_init = (initproc)ring_init,
+	.tp_new = PyType_GenericNew,
+};
+
+/*
+ * A Shadow keeps the last value written to registers so that they do not
+ * have to be read back from the device, where every read stalls until the
+ * device answers.  Reads of registers marked cacheable are served from the
+ * shadow once it holds their value, other reads go to the device.  With
+ * coalescing, writes are only recorded and repeated writes to a register
+ * merge, until flush() writes the pending values in the order the
+ * registers were first written.  Any read that has to go to the device
+ * flushes first, since the device may depend on the pending writes.
+ *
+ * The table is indexed by physical address with open addressing, and only
+ * holds registers that were marked, cached or written while coalescing.
+ */
+#define SHADOW_USED		1
+#define SHADOW_CACHEABLE	2
+#define SHADOW_VALID		4
+#define SHADOW_DIRTY		8
+
+struct shadow_entry {
+	unsigned long address;
+	uint64_t value;
+	uint8_t width;
+	uint8_t flags;
+};
+
+struct shadow_stats {
+	unsigned long long reads;
+	unsigned long long writes;
+	unsigned long long mmio_reads;
+	unsigned long long mmio_writes;
+	unsigned long long read_hits;	/* reads served from the shadow */
+	unsigned long long coalesced;	/* writes merged into a pending one */
+	unsigned long long flushes;
+	unsigned long long barriers;	/* flushes forced by a device read */
+};
+
+typedef struct {
+	PyObject_HEAD
+	struct shadow_entry *table;
+	unsigned long capacity;		/* a power of two */
+	unsigned long used;
+	unsigned long *dirty;		/* addresses in first write order */
+	unsigned long nr_dirty;
+	unsigned long dirty_capacity;
+	int coalesce;
+	int cache_all;
+	struct shadow_stats stats;
+} ShadowObject;
+
+static unsigned long shadow_hash(const ShadowObject *self, unsigned long address)
+{
+	return ((address >> 1) * 0x9e3779b97f4a7c15ULL >> 24) & (self->capacity - 1);
+}
+
+static int shadow_grow(ShadowObject *self)
+{
+	struct shadow_entry *old = self->table;
+	unsigned long old_capacity = self->capacity;
+	unsigned long i;
+
+	self->capacity = old_capacity ? old_capacity * 2 : 64;
+	self->table = PyMem_Malloc(self->capacity * sizeof(*self->table));
+	if (!self->table) {
+		self->table = old;
+		self->capacity = old_capacity;
+		PyErr_NoMemory();
+		return -1;
+	}
+	memset(self->table, 0, self->capacity * sizeof(*self->table));
+	for (i = 0; i < old_capacity; ++i) {
+		unsigned long j;
+
+		if (!(old[i].flags & SHADOW_USED))
+			continue;
+		j = shadow_hash(self, old[i].address);
+		while (self->table[j].flags & SHADOW_USED)
+			j = (j + 1) & (self->capacity - 1);
+		self->table[j] = old[i];
+	}
+	PyMem_Free(old);
+	return 0;
+}
+
+/* Returns the entry of address, adding it if create is set.  Returns NULL
+ * if there is none, or with an exception if it could not be added.  The
+ * entry moves when the table grows. */
+static struct shadow_entry *
+shadow_lookup(ShadowObject *self, unsigned long address, int create)
+{
+	unsigned long i = 0;
+
+	if (self->capacity) {
+		i = shadow_hash(self, address);
+		while (self->table[i].flags & SHADOW_USED) {
+			if (self->table[i].address == address)
+				return &self->table[i];
+			i = (i + 1) & (self->capacity - 1);
+		}
+	}
+	if (!create)
+		return NULL;
+	if ((self->used + 1) * 2 > self->capacity) {
+		if (shadow_grow(self))
+			return NULL;
+		return shadow_lookup(self, address, create);
+	}
+	self->table[i].address = address;
+	self->table[i].flags = SHADOW_USED;
+	++self->used;
+	return &self->table[i];
+}
+
+static int shadow_add_dirty(ShadowObject *self, unsigned long address)
+{
+	if (self->nr_dirty == self->dirty_capacity) {
+		unsigned long capacity = self->dirty_capacity ? self->dirty_capacity * 2 : 16;
+		unsigned long *dirty = PyMem_Realloc(self->dirty, capacity * sizeof(*dirty));
+
+		if (!dirty) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		self->dirty = dirty;
+		self->dirty_capacity = capacity;
+	}
+	self->dirty[self->nr_dirty++] = address;
+	return 0;
+}
+
+/*
+ * Writes the pending values.  write_phys may release the GIL, so entries
+ * are looked up again for every write and writes that are recorded
+ * meanwhile go to a fresh list, which is flushed by the next round.
+ */
+static int shadow_flush(ShadowObject *self)
+{
+	while (self->nr_dirty) {
+		unsigned long *dirty = self->dirty;
+		unsigned long n = self->nr_dirty;
+		unsigned long i;
+
+		self->dirty = NULL;
+		self->nr_dirty = self->dirty_capacity = 0;
+		for (i = 0; i < n; ++i) {
+			struct shadow_entry *e = shadow_lookup(self, dirty[i], 0);
+			uint64_t value;
+			int width;
+
+			if (!e || !(e->flags & SHADOW_DIRTY))
+				continue;
+			e->flags &= ~SHADOW_DIRTY;
+			value = e->value;
+			width = e->width;
+			if (write_phys(dirty[i], width, value)) {
+				/* Keep what was not written for the next flush. */
+				e = shadow_lookup(self, dirty[i], 0);
+				if (e)
+					e->flags |= SHADOW_DIRTY;
+				for (; i < n; ++i)
+					shadow_add_dirty(self, dirty[i]);
+				PyMem_Free(dirty);
+				return -1;
+			}
+			++self->stats.mmio_writes;
+		}
+		PyMem_Free(dirty);
+		++self->stats.flushes;
+	}
+	return 0;
+}
+
+static int shadow_cacheable(ShadowObject *self, const struct shadow_entry *e)
+{
+	return self->cache_all || (e && (e->flags & SHADOW_CACHEABLE));
+}
+
+static int
+shadow_read(ShadowObject *self, unsigned long address, int width, uint64_t *value)
+{
+	struct shadow_entry *e = shadow_lookup(self, address, 0);
+	int cacheable = shadow_cacheable(self, e);
+
+	++self->stats.reads;
+	if (cacheable && e && (e->flags & SHADOW_VALID) && e->width == width) {
+		*value = e->value;
+		++self->stats.read_hits;
+		return 0;
+	}
+	if (self->nr_dirty) {
+		++self->stats.barriers;
+		if (shadow_flush(self))
+			return -1;
+	}
+	if (read_phys(address, width, value))
+		return -1;
+	++self->stats.mmio_reads;
+	if (cacheable) {
+		e = shadow_lookup(self, address, 1);
+		if (!e)
+			return -1;
+		e->value = *value;
+		e->width = width;
+		e->flags |= SHADOW_VALID;
+	}
+	return 0;
+}
+
+static int
+shadow_write(ShadowObject *self, unsigned long address, int width, uint64_t value)
+{
+	struct shadow_entry *e = shadow_lookup(self, address, 0);
+	int cacheable = shadow_cacheable(self, e);
+
+	++self->stats.writes;
+	if (self->coalesce || cacheable) {
+		e = shadow_lookup(self, address, 1);
+		if (!e)
+			return -1;
+		e->value = value;
+		e->width = width;
+		if (cacheable)
+			e->flags |= SHADOW_VALID;
+		else
+			e->flags &= ~SHADOW_VALID;
+	}
+	if (self->coalesce) {
+		if (e->flags & SHADOW_DIRTY) {
+			++self->stats.coalesced;
+			return 0;
+		}
+		e->flags |= SHADOW_DIRTY;
+		return shadow_add_dirty(self, address);
+	}
+	if (write_phys(address, width, value))
+		return -1;
+	++self->stats.mmio_writes;
+	return 0;
+}
+
+static int
+shadow_init(ShadowObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"coalesce", "cache_all", NULL};
+	int coalesce = 0;
+	int cache_all = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ii", kwlist,
+					 &coalesce, &cache_all))
+		return -1;
+	self->coalesce = coalesce;
+	self->cache_all = cache_all;
+	return 0;
+}
+
+static void
+shadow_dealloc(ShadowObject *self)
+{
+	PyMem_Free(self->table);
+	PyMem_Free(self->dirty);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int shadow_mark(ShadowObject *self, unsigned long address, int cacheable)
+{
+	struct shadow_entry *e = shadow_lookup(self, address, cacheable);
+
+	if (!e)
+		return PyErr_Occurred() ? -1 : 0;
+	if (cacheable)
+		e->flags |= SHADOW_CACHEABLE;
+	else
+		e->flags &= ~(SHADOW_CACHEABLE | SHADOW_VALID);
+	return 0;
+}
+
+static PyObject *
+shadow_cache(ShadowObject *self, PyObject *args)
+{
+	unsigned long address;
+	int cacheable = 1;
+
+	if (!PyArg_ParseTuple(args, "k|i", &address, &cacheable))
+		return NULL;
+	if (shadow_mark(self, address, cacheable))
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+shadow_read_method(ShadowObject *self, PyObject *args)
+{
+	unsigned long address;
+	int width = 4;
+	uint64_t value;
+
+	if (!PyArg_ParseTuple(args, "k|i", &address, &width))
+		return NULL;
+	if (check_block_args(address, width, width) ||
+	    shadow_read(self, address, width, &value))
+		return NULL;
+	return PyLong_FromUnsignedLongLong(value);
+}
+
+static PyObject *
+shadow_write_method(ShadowObject *self, PyObject *args)
+{
+	unsigned long address;
+	unsigned long long value;
+	int width = 4;
+
+	if (!PyArg_ParseTuple(args, "kK|i", &address, &value, &width))
+		return NULL;
+	if (check_block_args(address, width, width) ||
+	    shadow_write(self, address, width, value))
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+shadow_modify(ShadowObject *self, PyObject *args)
+{
+	unsigned long address;
+	unsigned long long mask;
+	unsigned long long value;
+	int width = 4;
+	uint64_t current;
+
+	if (!PyArg_ParseTuple(args, "kKK|i", &address, &mask, &value, &width))
+		return NULL;
+	if (check_block_args(address, width, width) ||
+	    shadow_read(self, address, width, &current))
+		return NULL;
+	current = (current & ~mask) | (value & mask);
+	if (shadow_write(self, address, width, current))
+		return NULL;
+	return PyLong_FromUnsignedLongLong(current);
+}
+
+static PyObject *
+shadow_flush_method(ShadowObject *self, PyObject *args)
+{
+	if (shadow_flush(self))
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+shadow_invalidate(ShadowObject *self, PyObject *args)
+{
+	PyObject *obj = Py_None;
+	unsigned long i;
+
+	if (!PyArg_ParseTuple(args, "|O", &obj))
+		return NULL;
+	if (obj == Py_None) {
+		for (i = 0; i < self->capacity; ++i)
+			self->table[i].flags &= ~SHADOW_VALID;
+	} else {
+		struct shadow_entry *e;
+		unsigned long long address;
+
+		if (value_from_object(obj, &address))
+			return NULL;
+		e = shadow_lookup(self, address, 0);
+		if (e)
+			e->flags &= ~SHADOW_VALID;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+shadow_stats_method(ShadowObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"reset", NULL};
+	const struct shadow_stats *s = &self->stats;
+	int reset = 0;
+	PyObject *result;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &reset))
+		return NULL;
+	result = Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:k}",
+			       "reads", s->reads,
+			       "writes", s->writes,
+			       "mmio_reads", s->mmio_reads,
+			       "mmio_writes", s->mmio_writes,
+			       "read_hits", s->read_hits,
+			       "coalesced", s->coalesced,
+			       "flushes", s->flushes,
+			       "barriers", s->barriers,
+			       "avoided", s->reads + s->writes -
+					  s->mmio_reads - s->mmio_writes,
+			       "pending", self->nr_dirty);
+	if (result && reset)
+		memset(&self->stats, 0, sizeof(self->stats));
+	return result;
+}
+
+static PyMemberDef shadow_members[] = {
+	{"coalesce", T_INT, offsetof(ShadowObject, coalesce), READONLY,
+	 "Whether writes wait for flush()."},
+	{"cache_all", T_INT, offsetof(ShadowObject, cache_all), READONLY,
+	 "Whether every register is cacheable."},
+	{"pending", T_ULONG, offsetof(ShadowObject, nr_dirty), READONLY,
+	 "Number of registers with a write waiting for flush()."},
+	{NULL},
+};
+
+static PyMethodDef shadow_methods[] = {
+	{"cache", (PyCFunction)shadow_cache, METH_VARARGS,
+	 "cache(address, cacheable=True)\n\n"
+	 "Mark the register at address as only changing when it is written,\n"
+	 "so that its reads can be served from the shadow.\n"},
+	{"read", (PyCFunction)shadow_read_method, METH_VARARGS,
+	 "read(address, width=4)\n\nRead a register through the shadow."},
+	{"write", (PyCFunction)shadow_write_method, METH_VARARGS,
+	 "write(address, value, width=4)\n\nWrite a register through the shadow."},
+	{"modify", (PyCFunction)shadow_modify, METH_VARARGS,
+	 "modify(address, mask, value, width=4)\n\n"
+	 "Replace the bits in mask and return the new value.\n"},
+	{"flush", (PyCFunction)shadow_flush_method, METH_NOARGS,
+	 "Write all pending values to the device."},
+	{"invalidate", (PyCFunction)shadow_invalidate, METH_VARARGS,
+	 "invalidate(address=None)\n\n"
+	 "Forget the cached value of one or all registers, for example after\n"
+	 "the device was reset.  Pending writes are kept.\n"},
+	{"stats", (PyCFunction)shadow_stats_method, METH_VARARGS | METH_KEYWORDS,
+	 "stats(reset=False)\n\n"
+	 "Return a dictionary of access counts.  avoided is the number of\n"
+	 "device transactions saved, counting pending writes.\n"},
+	{NULL},
+};
+
+static PyTypeObject ShadowType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "chwtest.Shadow",
+	.tp_basicsize = sizeof(ShadowObject),
+	.tp_dealloc = (destructor)shadow_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_doc = "Shadow(coalesce=False, cache_all=False)\n\n"
+		  "Cache of the values written to registers.  Deleting a Shadow\n"
+		  "drops the writes that were not flushed.",
+	.tp_methods = shadow_methods,
+	.tp_members = shadow_members,
+	.tp_init = (initproc)shadow_init,
+	.tp_new = PyType_GenericNew,
+};
+
+/*
+ * Register maps.  A description of blocks, registers and fields is compiled
+ * once into a tree of RegisterBlock and Register objects with the absolute
+ * address of every register and the mask and shift of every field, so that
+ * reading a field, writing one or updating several is a single call that
+ * does the masking in C:
+ *
+ *	dev.CTRL.ENABLE = 1		read, modify, write
+ *	dev.STATUS.READY		read and extract
+ *	dev.CTRL.modify(MODE=2, ENABLE=1)
+ *
+ * Field names are looked up before methods, so a field named like a method
+ * hides it; read_field and write_field still reach it.
+ */
+struct reg_field {
+	uint64_t mask;		/* in place */
+	unsigned int shift;
+};
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *name;
+	unsigned long address;
+	int width;
+	unsigned long long reset_value;
+	PyObject *fields;	/* name -> index into field */
+	struct reg_field *field;
+	ShadowObject *shadow;	/* or NULL */
+} RegisterObject;
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *name;
+	unsigned long address;
+	PyObject *members;	/* name -> Register or RegisterBlock */
+	PyObject *shadow;	/* a Shadow or None */
+} RegisterBlockObject;
+
+static PyTypeObject RegisterType;
+static PyTypeObject RegisterBlockType;
+
+/* Reads an optional integer entry of a description. */
+static int desc_value(PyObject *desc, const char *key, unsigned long long *value)
+{
+	PyObject *obj = PyDict_GetItemString(desc, key);
+
+	if (!obj)
+		return 0;
+	if (!PyArg_Parse(obj, "K", value)) {
+		PyErr_Format(PyExc_TypeError, "\"%s\" must be an integer.", key);
+		return -1;
+	}
+	return 1;
+}
+
+static PyObject *desc_name(PyObject *desc)
+{
+	PyObject *name = PyDict_GetItemString(desc, "name");
+
+	if (!name) {
+		PyErr_SetString(PyExc_ValueError, "Every entry needs a \"name\".");
+		return NULL;
+	}
+	Py_INCREF(name);
+	return name;
+}
+
+static PyObject *desc_list(PyObject *desc, const char *key)
+{
+	PyObject *obj = PyDict_GetItemString(desc, key);
+
+	if (!obj)
+		return PyTuple_New(0);
+	return PySequence_Fast(obj, "Registers, blocks and fields must be lists.");
+}
+
+static int compile_field(RegisterObject *reg, PyObject *desc, Py_ssize_t i)
+{
+	unsigned long long lsb = 0, msb, width = 1, bit;
+	struct reg_field *f = &reg->field[i];
+	PyObject *name;
+	PyObject *index;
+	int res;
+
+	if (!PyDict_Check(desc)) {
+		PyErr_SetString(PyExc_TypeError, "Fields must be dictionaries.");
+		return -1;
+	}
+	if ((res = desc_value(desc, "bit", &bit)) < 0)
+		return -1;
+	if (res)
+		lsb = bit;
+	else if (desc_value(desc, "lsb", &lsb) < 0)
+		return -1;
+	if ((res = desc_value(desc, "msb", &msb)) < 0)
+		return -1;
+	if (res)
+		width = msb + 1 - lsb;
+	else if (desc_value(desc, "width", &width) < 0)
+		return -1;
+	/* lsb is checked first so that neither lsb + width nor msb + 1 - lsb
+	 * can wrap into a field that seems to fit. */
+	if (lsb >= 8 * (unsigned int)reg->width || !width ||
+	    width > 8 * (unsigned int)reg->width - lsb) {
+		PyErr_Format(PyExc_ValueError,
+			     "Field %zd does not fit its register.", i);
+		return -1;
+	}
+	f->shift = lsb;
+	f->mask = ((width == 64) ? ~0ULL : ((1ULL << width) - 1)) << lsb;
+
+	name = desc_name(desc);
+	if (!name)
+		return -1;
+	index = PyLong_FromSsize_t(i);
+	res = index ? PyDict_SetItem(reg->fields, name, index) : -1;
+	Py_XDECREF(index);
+	Py_DECREF(name);
+	return res;
+}
+
+static PyObject *
+compile_register(PyObject *desc, unsigned long base, ShadowObject *shadow)
+{
+	RegisterObject *reg;
+	unsigned long long offset = 0, width = 4;
+	PyObject *cacheable;
+	PyObject *fields;
+	Py_ssize_t i, n;
+
+	if (!PyDict_Check(desc)) {
+		PyErr_SetString(PyExc_TypeError, "Registers must be dictionaries.");
+		return NULL;
+	}
+	reg = PyObject_New(RegisterObject, &RegisterType);
+	if (!reg)
+		return NULL;
+	reg->fields = NULL;
+	reg->field = NULL;
+	reg->reset_value = 0;
+	Py_XINCREF(shadow);
+	reg->shadow = shadow;
+	reg->name = desc_name(desc);
+	if (!reg->name)
+		goto fail;
+	if (desc_value(desc, "offset", &offset) < 0 ||
+	    desc_value(desc, "width", &width) < 0 ||
+	    desc_value(desc, "reset", &reg->reset_value) < 0)
+		goto fail;
+	reg->address = base + offset;
+	reg->width = width;
+	if (check_block_args(reg->address, reg->width, reg->width))
+		goto fail;
+	cacheable = PyDict_GetItemString(desc, "cacheable");
+	if (shadow && cacheable && PyObject_IsTrue(cacheable) &&
+	    shadow_mark(shadow, reg->address, 1))
+		goto fail;
+
+	fields = desc_list(desc, "fields");
+	if (!fields)
+		goto fail;
+	n = PySequence_Fast_GET_SIZE(fields);
+	reg->fields = PyDict_New();
+	reg->field = PyMem_Malloc((n + 1) * sizeof(*reg->field));
+	if (!reg->fields || !reg->field) {
+		Py_DECREF(fields);
+		PyErr_NoMemory();
+		goto fail;
+	}
+	for (i = 0; i < n; ++i) {
+		if (compile_field(reg, PySequence_Fast_GET_ITEM(fields, i), i)) {
+			Py_DECREF(fields);
+			goto fail;
+		}
+	}
+	Py_DECREF(fields);
+	return (PyObject *)reg;
+fail:
+	Py_DECREF(reg);
+	return NULL;
+}
+
+static PyObject *compile_block(PyObject *desc, unsigned long base,
+				PyObject *name, PyObject *shadow);
+
+/* Adds the registers and blocks listed under key to block. */
+static int compile_members(RegisterBlockObject *block, PyObject *desc,
+			   const char *key)
+{
+	PyObject *list = desc_list(desc, key);
+	Py_ssize_t i;
+
+	if (!list)
+		return -1;
+	for (i = 0; i < PySequence_Fast_GET_SIZE(list); ++i) {
+		PyObject *item = PySequence_Fast_GET_ITEM(list, i);
+		PyObject *member;
+		int res;
+
+		if (key[0] == 'r')
+			member = compile_register(item, block->address,
+				(block->shadow == Py_None) ? NULL :
+				(ShadowObject *)block->shadow);
+		else
+			member = compile_block(item, block->address, NULL,
+					       block->shadow);
+		if (!member) {
+			Py_DECREF(list);
+			return -1;
+		}
+		/* Compiling checked that the entry has a name. */
+		res = PyDict_SetItem(block->members,
+				     PyDict_GetItemString(item, "name"), member);
+		Py_DECREF(member);
+		if (res) {
+			Py_DECREF(list);
+			return -1;
+		}
+	}
+	Py_DECREF(list);
+	return 0;
+}
+
+static PyObject *
+compile_block(PyObject *desc, unsigned long base, PyObject *name, PyObject *shadow)
+{
+	RegisterBlockObject *block;
+	unsigned long long offset = 0;
+
+	if (!PyDict_Check(desc)) {
+		PyErr_SetString(PyExc_TypeError, "Blocks must be dictionaries.");
+		return NULL;
+	}
+	block = PyObject_New(RegisterBlockObject, &RegisterBlockType);
+	if (!block)
+		return NULL;
+	block->members = NULL;
+	Py_INCREF(shadow);
+	block->shadow = shadow;
+	if (name) {
+		Py_INCREF(name);
+		block->name = name;
+	} else {
+		block->name = desc_name(desc);
+		if (!block->name)
+			goto fail;
+	}
+	if (desc_value(desc, "offset", &offset) < 0)
+		goto fail;
+	block->address = base + offset;
+	block->members = PyDict_New();
+	if (!block->members)
+		goto fail;
+	if (compile_members(block, desc, "registers") ||
+	    compile_members(block, desc, "blocks"))
+		goto fail;
+	return (PyObject *)block;
+fail:
+	Py_DECREF(block);
+	return NULL;
+}
+
+static void
+register_dealloc(RegisterObject *self)
+{
+	Py_XDECREF(self->name);
+	Py_XDECREF(self->fields);
+	PyMem_Free(self->field);
+	Py_XDECREF(self->shadow);
+	PyObject_Del(self);
+}
+
+/* Returns the field called name, or NULL without an exception. */
+static const struct reg_field *register_field(RegisterObject *self, PyObject *name)
+{
+	PyObject *index = PyDict_GetItem(self->fields, name);
+
+	if (!index)
+		return NULL;
+	return &self->field[PyLong_AsSsize_t(index)];
+}
+
+static int register_read(RegisterObject *self, uint64_t *value)
+{
+	if (self->shadow)
+		return shadow_read(self->shadow, self->address, self->width, value);
+	return read_phys(self->address, self->width, value);
+}
+
+static int register_write(RegisterObject *self, uint64_t value)
+{
+	if (self->shadow)
+		return shadow_write(self->shadow, self->address, self->width, value);
+	return write_phys(self->address, self->width, value);
+}
+
+/* Replaces the bits in mask with value, in one read and one write. */
+static int register_update(RegisterObject *self, uint64_t mask, uint64_t value)
+{
+	uint64_t current;
+
+	if (register_read(self, &current))
+		return -1;
+	return register_write(self, (current & ~mask) | (value & mask));
+}
+
+/* Shifts a value for a field into place, checking that it fits. */
+static int field_value(const struct reg_field *f, PyObject *obj, uint64_t *value)
+{
+	unsigned long long v;
+
+	if (value_from_object(obj, &v))
+		return -1;
+	if (v > (f->mask >> f->shift)) {
+		PyErr_SetString(PyExc_OverflowError, "Value does not fit the field.");
+		return -1;
+	}
+	*value = v << f->shift;
+	return 0;
+}
+
+static PyObject *read_field(RegisterObject *self, const struct reg_field *f)
+{
+	uint64_t value;
+
+	if (register_read(self, &value))
+		return NULL;
+	return PyLong_FromUnsignedLongLong((value & f->mask) >> f->shift);
+}
+
+static int write_field(RegisterObject *self, const struct reg_field *f,
+		       PyObject *obj)
+{
+	uint64_t value;
+
+	if (field_value(f, obj, &value))
+		return -1;
+	return register_update(self, f->mask, value);
+}
+
+static PyObject *
+register_getattro(RegisterObject *self, PyObject *name)
+{
+	const struct reg_field *f = register_field(self, name);
+
+	if (f)
+		return read_field(self, f);
+	return PyObject_GenericGetAttr((PyObject *)self, name);
+}
+
+static int
+register_setattro(RegisterObject *self, PyObject *name, PyObject *obj)
+{
+	const struct reg_field *f = register_field(self, name);
+
+	if (f && obj)
+		return write_field(self, f, obj);
+	return PyObject_GenericSetAttr((PyObject *)self, name, obj);
+}
+
+static const struct reg_field *
+register_lookup(RegisterObject *self, PyObject *name)
+{
+	const struct reg_field *f = register_field(self, name);
+
+	if (!f)
+		PyErr_SetObject(PyExc_KeyError, name);
+	return f;
+}
+
+static PyObject *
+register_read_method(RegisterObject *self, PyObject *args)
+{
+	uint64_t value;
+
+	if (register_read(self, &value))
+		return NULL;
+	return PyLong_FromUnsignedLongLong(value);
+}
+
+static PyObject *
+register_write_method(RegisterObject *self, PyObject *args)
+{
+	unsigned long long value;
+
+	if (!PyArg_ParseTuple(args, "K", &value))
+		return NULL;
+	if (register_write(self, value))
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+register_read_field(RegisterObject *self, PyObject *args)
+{
+	const struct reg_field *f;
+	PyObject *name;
+
+	if (!PyArg_ParseTuple(args, "O", &name))
+		return NULL;
+	if (!(f = register_lookup(self, name)))
+		return NULL;
+	return read_field(self, f);
+}
+
+static PyObject *
+register_write_field(RegisterObject *self, PyObject *args)
+{
+	const struct reg_field *f;
+	PyObject *name;
+	PyObject *value;
+
+	if (!PyArg_ParseTuple(args, "OO", &name, &value))
+		return NULL;
+	if (!(f = register_lookup(self, name)))
+		return NULL;
+	if (write_field(self, f, value))
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+register_modify(RegisterObject *self, PyObject *args, PyObject *kwds)
+{
+	uint64_t mask = 0, value = 0, current;
+	PyObject *name, *obj;
+	Py_ssize_t pos = 0;
+
+	if (PyTuple_GET_SIZE(args)) {
+		PyErr_SetString(PyExc_TypeError, "modify() takes fields as keywords.");
+		return NULL;
+	}
+	while (kwds && PyDict_Next(kwds, &pos, &name, &obj)) {
+		const struct reg_field *f = register_lookup(self, name);
+		uint64_t v;
+
+		if (!f || field_value(f, obj, &v))
+			return NULL;
+		mask |= f->mask;
+		value = (value & ~f->mask) | v;
+	}
+	if (register_read(self, &current))
+		return NULL;
+	current = (current & ~mask) | value;
+	if (register_write(self, current))
+		return NULL;
+	return PyLong_FromUnsignedLongLong(current);
+}
+
+static PyObject *
+register_reset(RegisterObject *self, PyObject *args)
+{
+	if (register_write(self, self->reset_value))
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *register_get_value(RegisterObject *self, void *closure)
+{
+	return register_read_method(self, NULL);
+}
+
+static int register_set_value(RegisterObject *self, PyObject *obj, void *closure)
+{
+	unsigned long long value;
+
+	if (!obj) {
+		PyErr_SetString(PyExc_AttributeError, "value cannot be deleted.");
+		return -1;
+	}
+	if (value_from_object(obj, &value))
+		return -1;
+	return register_write(self, value);
+}
+
+static PyObject *register_get_fields(RegisterObject *self, void *closure)
+{
+	return PyDict_Keys(self->fields);
+}
+
+static PyGetSetDef register_getset[] = {
+	{"value", (getter)register_get_value, (setter)register_set_value,
+	 "The whole register."},
+	{"fields", (getter)register_get_fields, NULL,
+	 "Names of the fields."},
+	{NULL},
+};
+
+static PyMemberDef register_members[] = {
+	{"name", T_OBJECT, offsetof(RegisterObject, name), READONLY, NULL},
+	{"address", T_ULONG, offsetof(RegisterObject, address), READONLY,
+	 "Physical address of the register."},
+	{"width", T_INT, offsetof(RegisterObject, width), READONLY,
+	 "Access width in bytes."},
+	{"reset_value", T_ULONGLONG, offsetof(RegisterObject, reset_value), READONLY,
+	 "Value written by reset()."},
+	{NULL},
+};
+
+static PyMethodDef register_methods[] = {
+	{"read", (PyCFunction)register_read_method, METH_NOARGS,
+	 "Read the whole register."},
+	{"write", (PyCFunction)register_write_method, METH_VARARGS,
+	 "Write the whole register."},
+	{"read_field", (PyCFunction)register_read_field, METH_VARARGS,
+	 "read_field(name)\n\nRead one field by name."},
+	{"write_field", (PyCFunction)register_write_field, METH_VARARGS,
+	 "write_field(name, value)\n\nUpdate one field by name."},
+	{"modify", (PyCFunction)register_modify, METH_VARARGS | METH_KEYWORDS,
+	 "modify(**fields)\n\n"
+	 "Update any number of fields with one read and one write and return\n"
+	 "the value written.\n"},
+	{"reset", (PyCFunction)register_reset, METH_NOARGS,
+	 "Write the reset value of the register."},
+	{NULL},
+};
+
+static PyTypeObject RegisterType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "chwtest.Register",
+	.tp_basicsize = sizeof(RegisterObject),
+	.tp_dealloc = (destructor)register_dealloc,
+	.tp_getattro = (getattrofunc)register_getattro,
+	.tp_setattro = (setattrofunc)register_setattro,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "A register of a RegisterBlock.  Its fields are attributes.",
+	.tp_methods = register_methods,
+	.tp_members = register_members,
+	.tp_getset = register_getset,
+};
+
+static void
+regblock_dealloc(RegisterBlockObject *self)
+{
+	Py_XDECREF(self->name);
+	Py_XDECREF(self->members);
+	Py_XDECREF(self->shadow);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *
+regblock_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"address", "description", "name", "shadow", NULL};
+	unsigned long address;
+	PyObject *desc;
+	PyObject *name = NULL;
+	PyObject *shadow = Py_None;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "kO!|OO", kwlist, &address,
+					 &PyDict_Type, &desc, &name, &shadow))
+		return NULL;
+	if (shadow != Py_None && !PyObject_TypeCheck(shadow, &ShadowType)) {
+		PyErr_SetString(PyExc_TypeError, "shadow must be a Shadow or None.");
+		return NULL;
+	}
+	if (!name) {
+		name = PyDict_GetItemString(desc, "name");
+		if (!name)
+			name = Py_None;
+	}
+	/* The offset of the top block is relative to address too. */
+	return compile_block(desc, address, name, shadow);
+}
+
+static PyObject *
+regblock_getattro(RegisterBlockObject *self, PyObject *name)
+{
+	PyObject *member = PyDict_GetItem(self->members, name);
+
+	if (member) {
+		Py_INCREF(member);
+		return member;
+	}
+	return PyObject_GenericGetAttr((PyObject *)self, name);
+}
+
+static int
+regblock_setattro(RegisterBlockObject *self, PyObject *name, PyObject *obj)
+{
+	PyObject *member = PyDict_GetItem(self->members, name);
+
+	if (member && obj && Py_TYPE(member) == &RegisterType)
+		return register_set_value((RegisterObject *)member, obj, NULL);
+	return PyObject_GenericSetAttr((PyObject *)self, name, obj);
+}
+
+static int regblock_reset_all(RegisterBlockObject *self)
+{
+	PyObject *name, *member;
+	Py_ssize_t pos = 0;
+
+	while (PyDict_Next(self->members, &pos, &name, &member)) {
+		int res;
+
+		if (Py_TYPE(member) == &RegisterType)
+			res = register_write((RegisterObject *)member,
+					     ((RegisterObject *)member)->reset_value);
+		else
+			res = regblock_reset_all((RegisterBlockObject *)member);
+		if (res)
+			return -1;
+	}
+	return 0;
+}
+
+static PyObject *
+regblock_reset(RegisterBlockObject *self, PyObject *args)
+{
+	if (regblock_reset_all(self))
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+regblock_flush(RegisterBlockObject *self, PyObject *args)
+{
+	if (self->shadow != Py_None &&
+	    shadow_flush((ShadowObject *)self->shadow))
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *regblock_get_members(RegisterBlockObject *self, void *closure)
+{
+	return PyDict_Copy(self->members);
+}
+
+static PyGetSetDef regblock_getset[] = {
+	{"members", (getter)regblock_get_members, NULL,
+	 "Dictionary of the registers and blocks by name."},
+	{NULL},
+};
+
+static PyMemberDef regblock_members[] = {
+	{"name", T_OBJECT, offsetof(RegisterBlockObject, name), READONLY, NULL},
+	{"address", T_ULONG, offsetof(RegisterBlockObject, address), READONLY,
+	 "Physical address of the block."},
+	{"shadow", T_OBJECT, offsetof(RegisterBlockObject, shadow), READONLY,
+	 "Shadow the registers are accessed through, or None."},
+	{NULL},
+};
+
+static PyMethodDef regblock_methods[] = {
+	{"reset", (PyCFunction)regblock_reset, METH_NOARGS,
+	 "Write the reset value of every register in the block."},
+	{"flush", (PyCFunction)regblock_flush, METH_NOARGS,
+	 "Write the pending values of the shadow, if there is one."},
+	{NULL},
+};
+
+static PyTypeObject RegisterBlockType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "chwtest.RegisterBlock",
+	.tp_basicsize = sizeof(RegisterBlockObject),
+	.tp_dealloc = (destructor)regblock_dealloc,
+	.tp_getattro = (getattrofunc)regblock_getattro,
+	.tp_setattro = (setattrofunc)regblock_setattro,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "RegisterBlock(address, description, name=None, shadow=None)\n\n"
+		  "Register map compiled from a description such as:\n\n"
+		  "  {\"registers\": [{\"name\": \"CTRL\", \"offset\": 0, \"width\": 4,\n"
+		  "                  \"reset\": 0, \"fields\": [\n"
+		  "                      {\"name\": \"ENABLE\", \"bit\": 0},\n"
+		  "                      {\"name\": \"MODE\", \"lsb\": 1, \"msb\": 3}]}],\n"
+		  "   \"blocks\": [{\"name\": \"DMA\", \"offset\": 0x100,\n"
+		  "               \"registers\": [...], \"blocks\": [...]}]}\n\n"
+		  "Registers and blocks are attributes of their block, and fields\n"
+		  "are attributes of their register.  Offsets are relative to the\n"
+		  "enclosing block and the top block is at address.\n\n"
+		  "With a Shadow all registers are accessed through it, and those\n"
+		  "with \"cacheable\": true in the description are cached.",
+	.tp_methods = regblock_methods,
+	.tp_members = regblock_members,
+	.tp_getset = regblock_getset,
+	.tp_new = regblock_new,
+};
+
+static PyObject *
+chwtest_read_block(PyObject *self, PyObject *args)
+{
+	unsigned long int address;
+	Py_ssize_t nbytes;
+	int width = 4;
+	PyObject *result;
+	int res;
+
+	if (!PyArg_ParseTuple(args, "kn|i", &address, &nbytes, &width))
+		return NULL;
+	if (nbytes < 0) {
+		PyErr_SetString(PyExc_ValueError, "Length must not be negative.");
+		return NULL;
+	}
+	if (check_block_args(address, nbytes, width))
+		return NULL;
+	if (range_has_ram(address, nbytes)) {
+		open_khwtest();
+		if (PyErr_Occurred() != NULL)
+			return NULL;
+	}
+	result = PyByteArray_FromStringAndSize(NULL, nbytes);
+	if (!result)
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	res = read_block(address, PyByteArray_AS_STRING(result), nbytes, width);
+	Py_END_ALLOW_THREADS
+	if (res) {
+		set_errno_error(res, backend_path(address));
+		Py_DECREF(result);
+		return NULL;
+	}
+	trace_access(address, width, TRACE_READ | TRACE_BLOCK, nbytes);
+	return result;
+}
+
+static PyObject *
+chwtest_write_block(PyObject *self, PyObject *args)
+{
+	unsigned long int address;
+	Py_buffer buffer;
+	int width = 4;
+	int res;
+
+	if (!PyArg_ParseTuple(args, "ks*|i", &address, &buffer, &width))
+		return NULL;
+	if (check_block_args(address, buffer.len, width))
+		goto fail;
+	if (range_has_ram(address, buffer.len)) {
+		open_khwtest();
+		if (PyErr_Occurred() != NULL)
+			goto fail;
+	}
+	/* The buffer stays locked by buffer, so it can be used without the
+	 * GIL. */
+	Py_BEGIN_ALLOW_THREADS
+	res = write_block(address, buffer.buf, buffer.len, width);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&buffer);
+	if (res) {
+		set_errno_error(res, backend_path(address));
+		return NULL;
+	}
+	trace_access(address, width, TRACE_WRITE | TRACE_BLOCK, buffer.len);
+	Py_RETURN_NONE;
+fail:
+	PyBuffer_Release(&buffer);
+	return NULL;
+}
+
+/*
+ * Parses the arguments shared by fill_pattern and verify_pattern.  On
+ * success the caller must release data.
+ */
+static int
+parse_pattern_args(PyObject *args, PyObject *kwds, int verify,
+		   unsigned long *address, unsigned long *nbytes,
+		   struct pattern *p, Py_buffer *data, unsigned long *max_mismatches)
+{
+	static char *kwlist[] = {"address", "nbytes", "pattern", "width", "seed",
+				 "data", "max_mismatches", NULL};
+	static char *fill_kwlist[] = {"address", "nbytes", "pattern", "width",
+				      "seed", "data", NULL};
+	unsigned long long seed = 0;
+	Py_ssize_t max = 16;
+	Py_ssize_t len;
+
+	memset(p, 0, sizeof(*p));
+	memset(data, 0, sizeof(*data));
+	p->width = 4;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds,
+					 verify ? "kni|iKz*n" : "kni|iKz*",
+					 verify ? kwlist : fill_kwlist,
+					 address, &len, &p->type, &p->width,
+					 &seed, data, &max))
+		return -1;
+	if (len < 0 || max < 0) {
+		PyErr_SetString(PyExc_ValueError, "Lengths must not be negative.");
+		goto fail;
+	}
+	*nbytes = len;
+	*max_mismatches = max;
+	if (check_block_args(*address, *nbytes, p->width))
+		goto fail;
+	if (p->type < PATTERN_WALKING_ONES || p->type > PATTERN_USER) {
+		PyErr_SetString(PyExc_ValueError, "Unknown pattern.");
+		goto fail;
+	}
+	if (p->type == PATTERN_USER) {
+		if (!data->buf || !data->len || data->len % p->width) {
+			PyErr_SetString(PyExc_ValueError,
+				"PATTERN_USER needs data that is a multiple of the width.");
+			goto fail;
+		}
+		p->data = data->buf;
+		p->data_len = data->len;
+	}
+	/* xorshift gets stuck at zero. */
+	p->state = seed ? seed : 0x2545f4914f6cdd1dULL;
+	if (range_has_ram(*address, *nbytes)) {
+		open_khwtest();
+		if (PyErr_Occurred() != NULL)
+			goto fail;
+	}
+	return 0;
+fail:
+	if (data->buf)
+		PyBuffer_Release(data);
+	return -1;
+}
+
+static PyObject *
+chwtest_fill_pattern(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	unsigned long address;
+	unsigned long nbytes;
+	unsigned long max_mismatches;
+	struct pattern p;
+	Py_buffer data;
+	int res;
+
+	if (parse_pattern_args(args, kwds, 0, &address, &nbytes, &p, &data,
+			       &max_mismatches))
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	res = pattern_run(&p, address, nbytes, NULL);
+	Py_END_ALLOW_THREADS
+	if (data.buf)
+		PyBuffer_Release(&data);
+	if (res) {
+		set_errno_error(res, backend_path(address));
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+chwtest_verify_pattern(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	unsigned long address;
+	unsigned long nbytes;
+	struct pattern p;
+	struct pattern_result r;
+	Py_buffer data;
+	PyObject *list = NULL;
+	PyObject *result = NULL;
+	unsigned long i;
+	int res;
+
+	if (parse_pattern_args(args, kwds, 1, &address, &nbytes, &p, &data,
+			       &r.max_mismatches))
+		return NULL;
+	r.nr_mismatches = 0;
+	r.mismatches = PyMem_Malloc((r.max_mismatches ? r.max_mismatches : 1) *
+				    sizeof(*r.mismatches));
+	if (!r.mismatches) {
+		PyErr_NoMemory();
+		goto out;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	res = pattern_run(&p, address, nbytes, &r);
+	Py_END_ALLOW_THREADS
+	if (res) {
+		set_errno_error(res, backend_path(address));
+		goto out;
+	}
+
+	i = (r.nr_mismatches < r.max_mismatches) ? r.nr_mismatches : r.max_mismatches;
+	list = PyList_New(i);
+	if (!list)
+		goto out;
+	for (i = 0; i < (unsigned long)PyList_GET_SIZE(list); ++i) {
+		PyObject *item = Py_BuildValue("kKK", r.mismatches[i].address,
+				(unsigned long long)r.mismatches[i].expected,
+				(unsigned long long)r.mismatches[i].actual);
+		if (!item)
+			goto out;
+		PyList_SET_ITEM(list, i, item);
+	}
+	result = Py_BuildValue("kO", r.nr_mismatches, list);
+out:
+	Py_XDECREF(list);
+	PyMem_Free(r.mismatches);
+	if (data.buf)
+		PyBuffer_Release(&data);
+	return result;
+}
+
+static int check_io(void)
+{
+	uint64_t start;
+
+	if (io_allowed)
+		return 0;
+	if (emulated) {
+		PyErr_SetString(PyExc_IOError, "Port I/O is not available with HWTEST_MEM.");
+		return -1;
+	}
+	start = now_ns();
+	if (iopl(3)) { /* So that we can access the io space */
+		PyErr_SetString(PyExc_IOError,
+			"Failed to enable permissions to access IO space for this process.");
+		return -1;
+	}
+	if (!startup.iopl_ns)
+		startup.iopl_ns = now_ns() - start;
+	io_allowed = 1;
+	return 0;
+}
+
+static PyObject *in_common(PyObject *const *args, Py_ssize_t nargs,
+			   PyObject *kw, const char *name, int width)
+{
+	uint64_t port;
+	uint32_t value;
+	int paused;
+
+	if (check_nargs(name, nargs, 1, 2) || arg_bits(args[0], 16, "port", &port) ||
+	    arg_paused(name, args, nargs, kw, 1, &paused))
+		return NULL;
+	if (check_io())
+		return NULL;
+	switch (width) {
+	case 1: value = paused ? inb_p(port) : inb(port); break;
+	case 2: value = paused ? inw_p(port) : inw(port); break;
+	default: value = paused ? inl_p(port) : inl(port); break;
+	}
+	trace_access(port, width, TRACE_READ | TRACE_PORT, value);
+	return unsigned_to_object(value);
+}
+
+static PyObject *out_common(PyObject *const *args, Py_ssize_t nargs,
+			    PyObject *kw, const char *name, int width)
+{
+	uint64_t port;
+	uint64_t value;
+	int paused;
+
+	if (check_nargs(name, nargs, 2, 3) || arg_bits(args[0], 16, "port", &port) ||
+	    arg_bits(args[1], 8 * width, "value", &value) ||
+	    arg_paused(name, args, nargs, kw, 2, &paused))
+		return NULL;
+	if (check_io())
+		return NULL;
+	switch (width) {
+	case 1:
+		if (paused)
+			outb_p(value, port);
+		else
+			outb(value, port);
+		break;
+	case 2:
+		if (paused)
+			outw_p(value, port);
+		else
+			outw(value, port);
+		break;
+	default:
+		if (paused)
+			outl_p(value, port);
+		else
+			outl(value, port);
+		break;
+	}
+	trace_access(port, width, TRACE_WRITE | TRACE_PORT, value);
+	Py_RETURN_NONE;
+}
+
+DEFINE_FASTCALL_KW(chwtest_inb)
+{
+	return in_common(args, nargs, kw, "inb", 1);
+}
+
+DEFINE_FASTCALL_KW(chwtest_inw)
+{
+	return in_common(args, nargs, kw, "inw", 2);
+}
+
+DEFINE_FASTCALL_KW(chwtest_inlw)
+{
+	return in_common(args, nargs, kw, "inlw", 4);
+}
+
+DEFINE_FASTCALL_KW(chwtest_outb)
+{
+	return out_common(args, nargs, kw, "outb", 1);
+}
+
+DEFINE_FASTCALL_KW(chwtest_outw)
+{
+	return out_common(args, nargs, kw, "outw", 2);
+}
+
+DEFINE_FASTCALL_KW(chwtest_outlw)
+{
+	return out_common(args, nargs, kw, "outlw", 4);
+}
+
+/*
+ * String port I/O moves a whole buffer through one port with the rep ins /
+ * outs instructions, without the delay of the paused single accesses.
+ */
+static PyObject *
+port_ins(PyObject *args, int width)
+{
+	PyObject *port;
+	uint64_t address;
+	Py_ssize_t count;
+	PyObject *result;
+	void *buf;
+
+	if (!PyArg_ParseTuple(args, "On", &port, &count))
+		return NULL;
+	if (arg_bits(port, 16, "port", &address))
+		return NULL;
+	if (count < 0 || count > PY_SSIZE_T_MAX / width) {
+		PyErr_SetString(PyExc_ValueError,
+				"Count must not be negative or overflow the buffer size.");
+		return NULL;
+	}
+	if (check_io())
+		return NULL;
+	result = PyByteArray_FromStringAndSize(NULL, count * width);
+	if (!result)
+		return NULL;
+	buf = PyByteArray_AS_STRING(result);
+	Py_BEGIN_ALLOW_THREADS
+	switch (width) {
+	case 1: insb(address, buf, count); break;
+	case 2: insw(address, buf, count); break;
+	case 4: insl(address, buf, count); break;
+	}
+	Py_END_ALLOW_THREADS
+	trace_access(address, width, TRACE_READ | TRACE_PORT | TRACE_BLOCK,
+		     count * width);
+	return result;
+}
+
+static PyObject *
+port_outs(PyObject *args, int width)
+{
+	PyObject *port;
+	uint64_t address;
+	Py_buffer buffer;
+
+	if (!PyArg_ParseTuple(args, "Os*", &port, &buffer))
+		return NULL;
+	if (arg_bits(port, 16, "port", &address) || check_io())
+		goto fail;
+	if (buffer.len % width) {
+		PyErr_SetString(PyExc_ValueError,
+			"Length must be a multiple of the width.");
+		goto fail;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	switch (width) {
+	case 1: outsb(address, buffer.buf, buffer.len); break;
+	case 2: outsw(address, buffer.buf, buffer.len / 2); break;
+	case 4: outsl(address, buffer.buf, buffer.len / 4); break;
+	}
+	Py_END_ALLOW_THREADS
+	trace_access(address, width, TRACE_WRITE | TRACE_PORT | TRACE_BLOCK,
+		     buffer.len);
+	PyBuffer_Release(&buffer);
+	Py_RETURN_NONE;
+fail:
+	PyBuffer_Release(&buffer);
+	return NULL;
+}
+
+static PyObject *
+chwtest_insb(PyObject *self, PyObject *args)
+{
+	return port_ins(args, 1);
+}
+
+static PyObject *
+chwtest_insw(PyObject *self, PyObject *args)
+{
+	return port_ins(args, 2);
+}
+
+static PyObject *
+chwtest_inslw(PyObject *self, PyObject *args)
+{
+	return port_ins(args, 4);
+}
+
+static PyObject *
+chwtest_outsb(PyObject *self, PyObject *args)
+{
+	return port_outs(args, 1);
+}
+
+static PyObject *
+chwtest_outsw(PyObject *self, PyObject *args)
+{
+	return port_outs(args, 2);
+}
+
+static PyObject *
+chwtest_outslw(PyObject *self, PyObject *args)
+{
+	return port_outs(args, 4);
+}
+
+/*
+ * DMA buffers allocated through khwtest are mapped into the process and
+ * pinned in the window cache, so accesses to them run at memory speed
+ * instead of going through a lseek / read pair on khwtest.
+ */
+struct dma_buffer {
+	struct dma_buffer *next;
+	unsigned int handle;
+	unsigned long phys;
+	unsigned long size;
+	void *virt;
+};
+
+static struct dma_buffer *dma_buffers = NULL;
+
+static void
+map_dma_buffer(unsigned long phys, unsigned long size, unsigned int handle)
+{
+	struct dma_buffer *buf;
+	void *virt;
+
+	virt = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    khwtest_fd, phys);
+	if (MAP_FAILED == virt) {
+		/* An older khwtest without mmap support.  Use read / write. */
+		return;
+	}
+	buf = malloc(sizeof(*buf));
+	if (!buf) {
+		munmap(virt, size);
+		return;
+	}
+	buf->handle = handle;
+	buf->phys = phys;
+	buf->size = size;
+	buf->virt = virt;
+	buf->next = dma_buffers;
+	dma_buffers = buf;
+	/* DMA buffers are ordinary cacheable memory, accesses to them are
+	 * made without dropping the GIL. */
+	Py_BEGIN_ALLOW_THREADS
+	pin_window(phys, size, virt, buf, 1);
+	Py_END_ALLOW_THREADS
+}
+
+static PyObject *
+chwtest_allocdmapage(PyObject *self, PyObject *args)
+{
+	struct khwtest_dma_alloc request;
+	__u32 physical_address;
+
+	open_khwtest();
+	if (PyErr_Occurred() != NULL)
+		return NULL;
+
+	/* A page from KHWTEST_ALLOC_DMA has a handle, so it can be mapped
+	 * and freed like any other buffer. */
+	memset(&request, 0, sizeof(request));
+	request.size = getpagesize();
+	request.dma_bits = 32;
+	if (!ioctl(khwtest_fd, KHWTEST_ALLOC_DMA, &request)) {
+		map_dma_buffer(request.bus_address, getpagesize(),
+			       request.handle);
+		return Py_BuildValue("KI",
+				     (unsigned long long)request.bus_address,
+				     request.handle);
+	}
+	if (errno != ENOTTY) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return NULL;
+	}
+	/* An older khwtest.  The page has no handle and is freed when the
+	 * file is closed. */
+	if (ioctl(khwtest_fd, KHWTEST_ALLOC_DMA_PAGE32, &physical_address)) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return NULL;
+	}
+	return Py_BuildValue("KI", (unsigned long long)physical_address, 0);
+}
+
+static void unmap_dma_buffer(unsigned int handle)
+{
+	struct dma_buffer **pbuf;
+	struct dma_buffer *buf;
+
+	for (pbuf = &dma_buffers; *pbuf; pbuf = &(*pbuf)->next) {
+		buf = *pbuf;
+		if (buf->handle == handle) {
+			*pbuf = buf->next;
+			Py_BEGIN_ALLOW_THREADS
+			unpin_window(buf);
+			Py_END_ALLOW_THREADS
+			munmap(buf->virt, buf->size);
+			free(buf);
+			return;
+		}
+	}
+}
+
+static PyObject *
+chwtest_alloc_dma(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"size", "align", "dma_bits", NULL};
+	struct khwtest_dma_alloc request;
+	unsigned long long size;
+	unsigned long long align = 0;
+	unsigned int dma_bits = 32;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "K|KI", kwlist,
+					 &size, &align, &dma_bits))
+		return NULL;
+	open_khwtest();
+	if (PyErr_Occurred() != NULL)
+		return NULL;
+
+	memset(&request, 0, sizeof(request));
+	request.size = size;
+	request.align = align;
+	request.dma_bits = dma_bits;
+	if (ioctl(khwtest_fd, KHWTEST_ALLOC_DMA, &request)) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return NULL;
+	}
+	/* The kernel rounds the size up to whole pages. */
+	size = (size + getpagesize() - 1) & ~(getpagesize() - 1ULL);
+	map_dma_buffer(request.bus_address, size, request.handle);
+	return Py_BuildValue("KI", (unsigned long long)request.bus_address,
+			     request.handle);
+}
+
+static PyObject *
+chwtest_free_dma(PyObject *self, PyObject *args)
+{
+	__u32 handle;
+
+	if (!PyArg_ParseTuple(args, "I", &handle))
+		return NULL;
+	open_khwtest();
+	if (PyErr_Occurred() != NULL)
+		return NULL;
+
+	/* Our own mapping has to go first, khwtest refuses to free mapped
+	 * memory. */
+	unmap_dma_buffer(handle);
+	if (ioctl(khwtest_fd, KHWTEST_FREE_DMA, &handle)) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+chwtest_dma_pool_reserve(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"size", "count", "dma_bits", NULL};
+	struct khwtest_pool_reserve reserve;
+	unsigned long long size;
+	unsigned int count;
+	unsigned int dma_bits = 32;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "KI|I", kwlist,
+					 &size, &count, &dma_bits))
+		return NULL;
+	open_khwtest();
+	if (PyErr_Occurred() != NULL)
+		return NULL;
+
+	memset(&reserve, 0, sizeof(reserve));
+	reserve.size = size;
+	reserve.count = count;
+	reserve.dma_bits = dma_bits;
+	if (ioctl(khwtest_fd, KHWTEST_POOL_RESERVE, &reserve)) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+chwtest_dma_pool_stats(PyObject *self, PyObject *args)
+{
+	struct khwtest_pool_stats stats;
+
+	open_khwtest();
+	if (PyErr_Occurred() != NULL)
+		return NULL;
+	if (ioctl(khwtest_fd, KHWTEST_POOL_STATS, &stats)) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return NULL;
+	}
+	return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K}",
+			     "hits", (unsigned long long)stats.hits,
+			     "misses", (unsigned long long)stats.misses,
+			     "recycled", (unsigned long long)stats.recycled,
+			     "released", (unsigned long long)stats.released,
+			     "live", (unsigned long long)stats.live,
+			     "live_bytes", (unsigned long long)stats.live_bytes,
+			     "live_high_water", (unsigned long long)stats.live_high_water,
+			     "live_bytes_high_water", (unsigned long long)stats.live_bytes_high_water,
+			     "cached", (unsigned long long)stats.cached,
+			     "cached_bytes", (unsigned long long)stats.cached_bytes);
+}
 
-static void open_khwtest(void)
+static PyObject *
+chwtest_irq_request(PyObject *self, PyObject *args, PyObject *kwds)
 {
-	if (khwtest_fd != -1)
-		return;
+	static char *kwlist[] = {"type", "domain", "bus", "devfn", "vector",
+				 "eventfd", NULL};
+	struct khwtest_irq_request req;
+	int eventfd = -1;
 
-	khwtest_fd = open("/dev/khwtest", O_RDWR);
-	if (-1 == khwtest_fd) {
-		PyErr_SetFromErrnoWithFilename(PyExc_ImportError, "/dev/khwtest");
-		return;
+	memset(&req, 0, sizeof(req));
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "I|IIIIi", kwlist,
+					 &req.type, &req.domain, &req.bus,
+					 &req.devfn, &req.vector, &eventfd))
+		return NULL;
+	open_khwtest();
+	if (PyErr_Occurred() != NULL)
+		return NULL;
+
+	req.eventfd = eventfd;
+	if (ioctl(khwtest_fd, KHWTEST_IRQ_REQUEST, &req)) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return NULL;
 	}
+	return Py_BuildValue("iI", req.fd, req.irq);
 }
 
-static int mmap_address(unsigned long address) 
+/* Waits for the interrupt file to become readable, without the GIL, and
+ * returns 1 with the event, 0 on timeout or -errno.  -EINTR is returned to
+ * the caller so that it can run the signal handlers. */
+static int irq_wait(int fd, long long timeout_ns, struct khwtest_irq_event *event)
 {
-	unsigned long local_base;
-	unsigned long local_offset;
-	const unsigned long PAGE_SIZE = getpagesize();
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct timespec ts;
+	ssize_t res;
 
-	local_base = address & ~(PAGE_SIZE-1);
-	local_offset = address % PAGE_SIZE;
+	ts.tv_sec = timeout_ns / 1000000000LL;
+	ts.tv_nsec = timeout_ns % 1000000000LL;
+	res = ppoll(&pfd, 1, timeout_ns < 0 ? NULL : &ts, NULL);
+	if (res < 0)
+		return -errno;
+	if (!res)
+		return 0;
+	res = read(fd, event, sizeof(*event));
+	if (res < 0)
+		return -errno;
+	if (res != sizeof(*event))
+		return -EIO;
+	return 1;
+}
 
-	if (base_address != local_base) {
-		if (base_address) {
-			munmap(mmaped_ptr, PAGE_SIZE);
-			base_address = 0;
-			base_offset = 0;
-			mmaped_ptr = NULL;
-		}
-		mmaped_ptr = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, 
-				  MAP_SHARED | MAP_FIXED, mem_fd, local_base);
-		if (MAP_FAILED == mmaped_ptr) {
-			PyErr_SetFromErrno(PyExc_IOError); 
-			return -1;
-		}
+static PyObject *
+chwtest_irq_wait(PyObject *self, PyObject *args)
+{
+	struct khwtest_irq_event event;
+	long long timeout_ns = -1;
+	uint64_t deadline;
+	uint64_t woken;
+	int fd;
+	int res;
 
-		base_address = local_base;
-	} 
+	if (!PyArg_ParseTuple(args, "i|L", &fd, &timeout_ns))
+		return NULL;
 
-	base_offset = local_offset;
+	deadline = now_ns() + (uint64_t)timeout_ns;
+	for (;;) {
+		Py_BEGIN_ALLOW_THREADS
+		res = irq_wait(fd, timeout_ns, &event);
+		woken = now_ns();
+		Py_END_ALLOW_THREADS
 
-	/* We have a good mapping... */
-	return 0;
+		if (res != -EINTR)
+			break;
+		/* A KeyboardInterrupt ends the wait, other handlers resume it
+		 * with what is left of the timeout. */
+		if (PyErr_CheckSignals())
+			return NULL;
+		if (timeout_ns >= 0)
+			timeout_ns = deadline > woken ? deadline - woken : 0;
+	}
+	if (res < 0) {
+		errno = -res;
+		PyErr_SetFromErrno(PyExc_IOError);
+		return NULL;
+	}
+	if (!res)
+		Py_RETURN_NONE;
+	/* Both sides use CLOCK_MONOTONIC, so the difference is the time from
+	 * the handler to this thread running again. */
+	return Py_BuildValue("KKK", (unsigned long long)event.count,
+			     (unsigned long long)event.timestamp_ns,
+			     (unsigned long long)(woken - event.timestamp_ns));
 }
 
-static unsigned char 
-readb(unsigned long address)
+static PyObject *
+chwtest_irq_trigger(PyObject *self, PyObject *args)
 {
-	if (address >= ram_high) {
-		if (mmap_address(address)) {
-			return -1;
-		}
-		return *((volatile unsigned char *)(mmaped_ptr + base_offset));
-	} else {
-		unsigned char value;
-		if (-1 == lseek(khwtest_fd, address, SEEK_SET)) {
-			PyErr_SetFromErrnoWithFilename(PyExc_IOError, "/dev/mem");
-			return -1;
-		} else {
-			if (-1 == read(khwtest_fd, &value, sizeof(value))) {
-				PyErr_SetFromErrnoWithFilename(PyExc_IOError, "/dev/mem");
-				return -1;
-			}
-			return value;
-		}
+	int fd;
+
+	if (!PyArg_ParseTuple(args, "i", &fd))
+		return NULL;
+	if (ioctl(fd, KHWTEST_IRQ_TRIGGER)) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return NULL;
 	}
+	Py_RETURN_NONE;
 }
 
-static unsigned short int 
-readw(unsigned long address)
+static PyObject *
+chwtest_irq_unmask(PyObject *self, PyObject *args)
 {
-	if (address >= ram_high) {
-		if (mmap_address(address)) {
-			return -1;
-		}
-		return *((volatile unsigned short int *)(mmaped_ptr + base_offset));
-	} else {
-		unsigned short int value;
-		if (-1 == lseek(khwtest_fd, address, SEEK_SET)) {
-			PyErr_SetFromErrnoWithFilename(PyExc_IOError, "/dev/mem");
-			return -1;
-		} else {
-			if (-1 == read(khwtest_fd, &value, sizeof(value))) {
-				PyErr_SetFromErrnoWithFilename(PyExc_IOError, "/dev/mem");
-				return -1;
-			}
-			return value;
-		}
+	int fd;
+
+	if (!PyArg_ParseTuple(args, "i", &fd))
+		return NULL;
+	if (ioctl(fd, KHWTEST_IRQ_UNMASK)) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return NULL;
 	}
+	Py_RETURN_NONE;
 }
 
-static unsigned long
-readlw(unsigned long address)
+static PyObject *
+chwtest_irq_info(PyObject *self, PyObject *args)
 {
-	if (address >= ram_high) {
-		if (mmap_address(address)) {
-			return -1;
-		}
-		return *((volatile unsigned long *)(mmaped_ptr + base_offset));
-	} else {
-		unsigned long int value;
-		open_khwtest();
-		if (-1 == lseek(khwtest_fd, address, SEEK_SET)) {
-			PyErr_SetFromErrnoWithFilename(PyExc_IOError, "/dev/khwtest");
-			return -1;
-		} else {
-			if (-1 == read(khwtest_fd, &value, sizeof(value))) {
-				PyErr_SetFromErrnoWithFilename(PyExc_IOError, "/dev/khwtest");
-				return -1;
-			}
-			return value;
-		}
+	struct khwtest_irq_info info;
+	int fd;
+
+	if (!PyArg_ParseTuple(args, "i", &fd))
+		return NULL;
+	if (ioctl(fd, KHWTEST_IRQ_INFO, &info)) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return NULL;
 	}
+	return Py_BuildValue("{s:K,s:K,s:K,s:I,s:I}",
+			     "count", (unsigned long long)info.count,
+			     "timestamp_ns", (unsigned long long)info.timestamp_ns,
+			     "unhandled", (unsigned long long)info.unhandled,
+			     "irq", info.irq,
+			     "type", info.type);
 }
 
-static void
-writeb(unsigned long address, unsigned char val)
+static PyObject *
+chwtest_execute_batch(PyObject *self, PyObject *args)
 {
-	if (address >= ram_high) {
-		mmap_address(address);
-		*(volatile unsigned char *)(mmaped_ptr + base_offset) = val;
-	} else {
-		if (-1 == lseek(khwtest_fd, address, SEEK_SET)) {
-			PyErr_SetFromErrnoWithFilename(PyExc_IOError, "/dev/mem");
-		} else {
-			if (-1 == write(khwtest_fd, &val, sizeof(val))) {
-				PyErr_SetFromErrnoWithFilename(PyExc_IOError, "/dev/mem");
-			}
-		}
+	PyObject *seq;
+	PyObject *result = NULL;
+	struct khwtest_op *ops;
+	struct khwtest_batch batch;
+	Py_ssize_t count;
+	Py_ssize_t i;
+	int res;
+
+	if (!PyArg_ParseTuple(args, "O", &seq))
+		return NULL;
+	seq = PySequence_Fast(seq, "Operations must be a sequence of tuples.");
+	if (!seq)
+		return NULL;
+	count = PySequence_Fast_GET_SIZE(seq);
+	ops = PyMem_Malloc((count ? count : 1) * sizeof(*ops));
+	if (!ops) {
+		Py_DECREF(seq);
+		return PyErr_NoMemory();
 	}
-}
 
-static void
-writew(unsigned long address, unsigned short int val)
-{
-	if (address >= ram_high) {
-		mmap_address(address);
-		*(volatile unsigned short int *)(mmaped_ptr + base_offset) = val;
-	} else {
-		if (-1 == lseek(khwtest_fd, address, SEEK_SET)) {
-			PyErr_SetFromErrnoWithFilename(PyExc_IOError, "/dev/mem");
-		} else {
-			if (-1 == write(khwtest_fd, &val, sizeof(val))) {
-				PyErr_SetFromErrnoWithFilename(PyExc_IOError, "/dev/mem");
-			}
-		}
+	for (i = 0; i < count; ++i) {
+		struct khwtest_op *op = &ops[i];
+		unsigned long long value = 0;
+		unsigned long long mask = 0;
+		unsigned long long timeout_ns = 0;
+		unsigned int width = 4;
+
+		if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i),
+				      "IK|KKIK;Operations are (op, address[, value[, mask[, width[, timeout_ns]]]])",
+				      &op->op, &op->address, &value, &mask,
+				      &width, &timeout_ns))
+			goto out;
+		op->value = value;
+		op->mask = mask;
+		op->width = width;
+		op->timeout_ns = timeout_ns;
 	}
-}
 
+	open_khwtest();
+	if (PyErr_Occurred() != NULL)
+		goto out;
 
-static void
-writelw(unsigned long address, unsigned long val)
-{
-	if (address >= ram_high) {
-		mmap_address(address);
-		*(volatile unsigned long *)(mmaped_ptr + base_offset) = val;
-	} else {
-		if (-1 == lseek(khwtest_fd, address, SEEK_SET)) {
-			PyErr_SetFromErrnoWithFilename(PyExc_IOError, "/dev/khwtest");
-		} else {
-			if (-1 == write(khwtest_fd, &val, sizeof(val))) {
-				PyErr_SetFromErrnoWithFilename(PyExc_IOError, "/dev/khwtest");
-			}
+	batch.ops = (unsigned long)ops;
+	batch.count = count;
+	batch.completed = 0;
+	Py_BEGIN_ALLOW_THREADS
+	res = ioctl(khwtest_fd, KHWTEST_EXECUTE_BATCH, &batch);
+	Py_END_ALLOW_THREADS
+	if (res) {
+		char msg[64];
+		PyObject *exc;
+		snprintf(msg, sizeof(msg), "Batch failed at operation %u: %s",
+			 batch.completed, strerror(errno));
+		exc = Py_BuildValue("(is)", errno, msg);
+		if (exc) {
+			PyErr_SetObject(PyExc_IOError, exc);
+			Py_DECREF(exc);
 		}
+		goto out;
 	}
+
+	result = PyList_New(count);
+	if (!result)
+		goto out;
+	for (i = 0; i < count; ++i) {
+		PyObject *value = PyLong_FromUnsignedLongLong(ops[i].value);
+		if (!value) {
+			Py_CLEAR(result);
+			goto out;
+		}
+		PyList_SET_ITEM(result, i, value);
+	}
+out:
+	PyMem_Free(ops);
+	Py_DECREF(seq);
+	return result;
 }
 
 static PyObject *
-chwtest_readb(PyObject *self, PyObject *args)
+chwtest_trace_start(PyObject *self, PyObject *args, PyObject *kwds)
 {
-	unsigned long int address;
-	unsigned char value; 
-	if (!PyArg_ParseTuple(args, "l", &address))
+	static char *kwlist[] = {"entries", NULL};
+	unsigned long entries = trace_entries;
+	struct thread_state *ts;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|k", kwlist, &entries))
+		return NULL;
+	if (entries < 2 || (entries & (entries - 1))) {
+		PyErr_SetString(PyExc_ValueError,
+			"Entries must be a power of two of at least two.");
 		return NULL;
-	value = readb(address);
-	return Py_BuildValue("b", value);
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&threads_lock);
+	/* Rings are resized by their owners on the next access.  Discard
+	 * what was logged before. */
+	trace_entries = entries;
+	for (ts = thread_states; ts; ts = ts->next) {
+		if (ts->trace)
+			ts->trace->tail = __atomic_load_n(&ts->trace->head,
+							  __ATOMIC_ACQUIRE);
+	}
+	while (retired_traces) {
+		struct trace_ring *ring = retired_traces;
+		retired_traces = ring->next;
+		free(ring);
+	}
+	trace_dropped = 0;
+	trace_start_counter = trace_counter();
+	trace_start_ns = trace_clock_ns();
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&threads_lock);
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
 }
 
 static PyObject *
-chwtest_readw(PyObject *self, PyObject *args)
+chwtest_trace_stop(PyObject *self, PyObject *args)
 {
-	unsigned long int address;
-	unsigned short int value; 
-	if (!PyArg_ParseTuple(args, "l", &address))
-		return NULL;
-	value = readw(address);
-	return Py_BuildValue("h", value);
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+	Py_RETURN_NONE;
 }
 
-
 static PyObject *
-chwtest_readlw(PyObject *self, PyObject *args)
+chwtest_trace_dump(PyObject *self, PyObject *args)
 {
-	unsigned long int address;
-	unsigned long int value; 
-	if (!PyArg_ParseTuple(args, "l", &address))
+	const char *path;
+	long count;
+	int err;
+
+	if (!PyArg_ParseTuple(args, "s", &path))
 		return NULL;
-	value = readlw(address);
-	return Py_BuildValue("l", value);
+	/* Taking the GIL back may change errno. */
+	Py_BEGIN_ALLOW_THREADS
+	count = trace_dump(path);
+	err = errno;
+	Py_END_ALLOW_THREADS
+	if (count < 0) {
+		errno = err;
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+	}
+	return PyLong_FromLong(count);
 }
 
 static PyObject *
-chwtest_writeb(PyObject *self, PyObject *args)
+chwtest_iomem_ranges(PyObject *self, PyObject *args, PyObject *kwds)
 {
-	unsigned long int address;
-	unsigned char value; 
+	static char *kwlist[] = {"reset", NULL};
+	static const char *kinds[] = {"ram", "reserved", "mmio"};
+	PyObject *list;
+	int reset = 0;
+	int i;
 
-	if (!PyArg_ParseTuple(args, "lb", &address, &value)) {
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &reset))
+		return NULL;
+	list = PyList_New(nr_ranges);
+	if (!list)
 		return NULL;
+	for (i = 0; i < nr_ranges; ++i) {
+		struct phys_range *r = &ranges[i];
+		PyObject *item;
+
+		item = Py_BuildValue("{s:k,s:k,s:s,s:s,s:k,s:k,s:k}",
+				     "start", r->start,
+				     "end", r->end,
+				     "kind", kinds[r->kind],
+				     "name", r->name,
+				     "reads", __atomic_load_n(&r->reads, __ATOMIC_RELAXED),
+				     "writes", __atomic_load_n(&r->writes, __ATOMIC_RELAXED),
+				     "bytes", __atomic_load_n(&r->bytes, __ATOMIC_RELAXED));
+		if (!item) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i, item);
+		if (reset) {
+			__atomic_store_n(&r->reads, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&r->writes, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&r->bytes, 0, __ATOMIC_RELAXED);
+		}
 	}
-	writeb(address, value);
-	Py_RETURN_NONE;
+	return list;
 }
 
 static PyObject *
-chwtest_writew(PyObject *self, PyObject *args)
+chwtest_map_region(PyObject *self, PyObject *args)
 {
+	const unsigned long PAGE_SIZE = getpagesize();
 	unsigned long int address;
-	unsigned short int value; 
+	unsigned long int size;
+	unsigned long int start;
+	unsigned long int end;
+	int res;
 
-	if (!PyArg_ParseTuple(args, "lh", &address, &value)) {
+	if (!PyArg_ParseTuple(args, "kk", &address, &size))
+		return NULL;
+	start = address & ~(PAGE_SIZE-1);
+	end = (address + size + PAGE_SIZE - 1) & ~(PAGE_SIZE-1);
+	if (!size || end - start > map_limit) {
+		PyErr_SetString(PyExc_ValueError,
+			"Region size must be non-zero and within the mapping limit.");
 		return NULL;
 	}
-	writew(address, value);
-	if (PyErr_Occurred() != NULL) {
+
+	Py_BEGIN_ALLOW_THREADS
+	res = map_region(start, end);
+	Py_END_ALLOW_THREADS
+	if (res == -EEXIST) {
+		PyErr_SetString(PyExc_ValueError, "Region overlaps a pinned mapping.");
+		return NULL;
+	}
+	if (res) {
+		set_errno_error(res, mem_path);
 		return NULL;
-	} else {
-		Py_RETURN_NONE;
 	}
+	Py_RETURN_NONE;
 }
 
 static PyObject *
-chwtest_writelw(PyObject *self, PyObject *args)
+chwtest_map_flush(PyObject *self, PyObject *args)
 {
-	unsigned long int address;
-	unsigned long int value;
+	Py_BEGIN_ALLOW_THREADS
+	shrink_windows(0);
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+chwtest_set_map_limit(PyObject *self, PyObject *args)
+{
+	unsigned long int limit;
+	unsigned long int window_size = map_window_size;
+	const unsigned long PAGE_SIZE = getpagesize();
 
-	if (!PyArg_ParseTuple(args, "ll", &address, &value)) {
+	if (!PyArg_ParseTuple(args, "k|k", &limit, &window_size))
 		return NULL;
-	}
-	writelw(address, value);
-	if (PyErr_Occurred() != NULL) {
+	if (window_size < PAGE_SIZE || (window_size & (window_size - 1)) ||
+	    limit < window_size) {
+		PyErr_SetString(PyExc_ValueError,
+			"Window size must be a power of two of at least a page "
+			"and no larger than the limit.");
 		return NULL;
-	} else {
-		Py_RETURN_NONE;
 	}
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&map_lock);
+	map_limit = limit;
+	map_window_size = window_size;
+	pthread_mutex_unlock(&map_lock);
+	shrink_windows(limit);
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
 }
 
 static PyObject *
-chwtest_inb(PyObject *self, PyObject *args)
+chwtest_map_stats(PyObject *self, PyObject *args)
 {
-	unsigned long int address;
-	unsigned char value; 
-	if (!PyArg_ParseTuple(args, "l", &address))
-		return NULL;
-	value = inb_p(address);
-	return Py_BuildValue("b", value);
+	struct thread_state *ts;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions, mapped, pinned, limit, window_size;
+	int windows;
+
+	/* Writers free the old table, so its count is read under map_lock. */
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&map_lock);
+	evictions = map_evictions;
+	windows = window_table->count;
+	mapped = mapped_bytes;
+	pinned = pinned_bytes;
+	limit = map_limit;
+	window_size = map_window_size;
+	pthread_mutex_unlock(&map_lock);
+	Py_END_ALLOW_THREADS
+
+	pthread_mutex_lock(&threads_lock);
+	hits = retired_hits;
+	misses = retired_misses;
+	for (ts = thread_states; ts; ts = ts->next) {
+		hits += ts->hits;
+		misses += ts->misses;
+	}
+	pthread_mutex_unlock(&threads_lock);
+
+	return Py_BuildValue("{s:k,s:k,s:k,s:i,s:k,s:k,s:k,s:k}",
+			     "hits", hits,
+			     "misses", misses,
+			     "evictions", evictions,
+			     "windows", windows,
+			     "mapped_bytes", mapped,
+			     "pinned_bytes", pinned,
+			     "limit", limit,
+			     "window_size", window_size);
 }
 
-static PyObject *
-chwtest_inw(PyObject *self, PyObject *args)
+/*
+ * Mapping objects own a persistent mapping of [base, base + size) and export
+ * it through the buffer protocol, so memoryview, struct.unpack_from and
+ * numpy.frombuffer access device memory directly.  The mapping is also
+ * pinned in the window cache so that the single access functions use it for
+ * addresses inside the region.
+ *
+ * NOTE: Access widths through the buffer are chosen by whoever reads it
+ * (memcpy, numpy, ...).  Use read_block / write_block for registers that
+ * are sensitive to the transaction size.
+ */
+typedef struct {
+	PyObject_HEAD
+	unsigned long base;
+	unsigned long size;
+	void *virt;
+	unsigned long map_size;
+	unsigned long offset;
+	Py_ssize_t exports;
+} MappingObject;
+
+static int
+mapping_unmap(MappingObject *self)
 {
-	unsigned long int address;
-	unsigned short int value; 
-	if (!PyArg_ParseTuple(args, "l", &address))
-		return NULL;
-	value = inw_p(address);
-	return Py_BuildValue("h", value);
+	if (self->exports) {
+		PyErr_SetString(PyExc_BufferError,
+			"Mapping is still exported by a memoryview.");
+		return -1;
+	}
+	if (self->virt) {
+		Py_BEGIN_ALLOW_THREADS
+		unpin_window(self);
+		Py_END_ALLOW_THREADS
+		munmap(self->virt, self->map_size);
+		self->virt = NULL;
+	}
+	return 0;
 }
 
+static int
+mapping_init(MappingObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"base", "size", "path", "offset", NULL};
+	const unsigned long PAGE_SIZE = getpagesize();
+	unsigned long base;
+	unsigned long size;
+	unsigned long start;
+	const char *path = NULL;
+	unsigned long offset = 0;
+	int fd;
+	void *virt;
+	int res;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "kk|zk", kwlist, &base,
+					 &size, &path, &offset))
+		return -1;
+	if (!size) {
+		PyErr_SetString(PyExc_ValueError, "Size must be non-zero.");
+		return -1;
+	}
+	if (path && (offset & (PAGE_SIZE-1)) != (base & (PAGE_SIZE-1))) {
+		PyErr_SetString(PyExc_ValueError,
+			"Offset and base must be at the same offset into a page.");
+		return -1;
+	}
+	if (mapping_unmap(self))
+		return -1;
 
-static PyObject *
-chwtest_inlw(PyObject *self, PyObject *args)
+	start = base & ~(PAGE_SIZE-1);
+	self->offset = base - start;
+	self->map_size = (self->offset + size + PAGE_SIZE - 1) & ~(PAGE_SIZE-1);
+	if (path) {
+		/* A file that maps the region itself, such as a PCI resource
+		 * file in sysfs, at offset. */
+		fd = open(path, O_RDWR | O_SYNC);
+		if (-1 == fd) {
+			PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+			return -1;
+		}
+		offset &= ~(PAGE_SIZE-1);
+	} else {
+		Py_BEGIN_ALLOW_THREADS
+		pthread_mutex_lock(&map_lock);
+		res = open_mem();
+		pthread_mutex_unlock(&map_lock);
+		Py_END_ALLOW_THREADS
+		if (res) {
+			set_errno_error(res, mem_path);
+			return -1;
+		}
+		fd = mem_fd;
+		path = mem_path;
+		offset = start;
+	}
+	virt = mmap(NULL, self->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, offset);
+	if (fd != mem_fd)
+		close(fd);
+	if (MAP_FAILED == virt) {
+		PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+		return -1;
+	}
+	self->virt = virt;
+	self->base = base;
+	self->size = size;
+	Py_BEGIN_ALLOW_THREADS
+	pin_window(start, self->map_size, virt, self, 0);
+	Py_END_ALLOW_THREADS
+	return 0;
+}
+
+static void
+mapping_dealloc(MappingObject *self)
 {
-	unsigned long int address;
-	unsigned long int value; 
-	if (!PyArg_ParseTuple(args, "l", &address))
-		return NULL;
-	value = inl_p(address);
-	return Py_BuildValue("l", value);
+	if (self->virt) {
+		Py_BEGIN_ALLOW_THREADS
+		unpin_window(self);
+		Py_END_ALLOW_THREADS
+		munmap(self->virt, self->map_size);
+	}
+	Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
 static PyObject *
-chwtest_outb(PyObject *self, PyObject *args)
+mapping_close(MappingObject *self, PyObject *args)
 {
-	unsigned long int address;
-	unsigned char value; 
-
-	if (!PyArg_ParseTuple(args, "lb", &address, &value)) {
+	if (mapping_unmap(self))
 		return NULL;
-	}
-	outb_p(value, address);
 	Py_RETURN_NONE;
 }
 
-static PyObject *
-chwtest_outw(PyObject *self, PyObject *args)
+static int
+mapping_getbuffer(MappingObject *self, Py_buffer *view, int flags)
 {
-	unsigned long int address;
-	unsigned short int value; 
-
-	if (!PyArg_ParseTuple(args, "lh", &address, &value)) {
-		return NULL;
+	if (!self->virt) {
+		PyErr_SetString(PyExc_ValueError, "Mapping is closed.");
+		view->obj = NULL;
+		return -1;
 	}
-	outw_p(value, address);
-	Py_RETURN_NONE;
+	if (PyBuffer_FillInfo(view, (PyObject *)self, self->virt + self->offset,
+			      self->size, 0, flags))
+		return -1;
+	++self->exports;
+	return 0;
 }
 
-static PyObject *
-chwtest_outlw(PyObject *self, PyObject *args)
+static void
+mapping_releasebuffer(MappingObject *self, Py_buffer *view)
 {
-	unsigned long int address;
-	unsigned long int value;
+	--self->exports;
+}
 
-	if (!PyArg_ParseTuple(args, "ll", &address, &value)) {
-		return NULL;
+#if PY_MAJOR_VERSION < 3
+static Py_ssize_t
+mapping_getrwbuffer(MappingObject *self, Py_ssize_t segment, void **ptr)
+{
+	if (segment != 0) {
+		PyErr_SetString(PyExc_SystemError, "Invalid buffer segment.");
+		return -1;
 	}
-	outl_p(value, address);
-	Py_RETURN_NONE;
+	if (!self->virt) {
+		PyErr_SetString(PyExc_ValueError, "Mapping is closed.");
+		return -1;
+	}
+	*ptr = self->virt + self->offset;
+	return self->size;
+}
+
+static Py_ssize_t
+mapping_getsegcount(MappingObject *self, Py_ssize_t *lenp)
+{
+	if (lenp)
+		*lenp = self->size;
+	return 1;
+}
+#endif
+
+static Py_ssize_t
+mapping_length(MappingObject *self)
+{
+	return self->size;
 }
 
+static PyBufferProcs mapping_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+	(readbufferproc)mapping_getrwbuffer,
+	(writebufferproc)mapping_getrwbuffer,
+	(segcountproc)mapping_getsegcount,
+	NULL,
+#endif
+	(getbufferproc)mapping_getbuffer,
+	(releasebufferproc)mapping_releasebuffer,
+};
+
+static PySequenceMethods mapping_as_sequence = {
+	(lenfunc)mapping_length,
+};
+
+static PyMemberDef mapping_members[] = {
+	{"base", T_ULONG, offsetof(MappingObject, base), READONLY,
+	 "Physical address of the first byte of the mapping."},
+	{"size", T_ULONG, offsetof(MappingObject, size), READONLY,
+	 "Size of the mapping in bytes."},
+	{NULL},
+};
+
+static PyMethodDef mapping_methods[] = {
+	{"close", (PyCFunction)mapping_close, METH_NOARGS,
+	 "Unmap the region.  Fails while a memoryview of it is alive."},
+	{NULL},
+};
+
+static PyTypeObject MappingType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "chwtest.Mapping",
+	.tp_basicsize = sizeof(MappingObject),
+	.tp_dealloc = (destructor)mapping_dealloc,
+	.tp_as_sequence = &mapping_as_sequence,
+	.tp_as_buffer = &mapping_as_buffer,
+#if PY_MAJOR_VERSION < 3
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE |
+		    Py_TPFLAGS_HAVE_NEWBUFFER,
+#else
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+#endif
+	.tp_doc = "Mapping(base, size, path=None, offset=0)\n\n"
+		  "Persistent mapping of physical memory exported through the "
+		  "buffer protocol.  With a path the memory at base is mapped from "
+		  "that file at offset instead of from /dev/mem.",
+	.tp_methods = mapping_methods,
+	.tp_members = mapping_members,
+	.tp_init = (initproc)mapping_init,
+	.tp_new = PyType_GenericNew,
+};
+
 static PyObject *
-chwtest_allocdmapage(PyObject *self, PyObject *args)
+chwtest_startup_stats(PyObject *self, PyObject *args)
 {
-	__u32 physical_address;
-	open_khwtest();
-	if (ioctl(khwtest_fd, KHWTEST_ALLOC_DMA_PAGE32, &physical_address)) {
-		PyErr_SetFromErrno(PyExc_IOError);
-		return NULL;
-	}
-	return Py_BuildValue("l", physical_address);
+	return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K}",
+			     "init_ns", (unsigned long long)startup.init_ns,
+			     "backend_ns", (unsigned long long)startup.backend_ns,
+			     "iomem_ns", (unsigned long long)startup.iomem_ns,
+			     "mem_open_ns", (unsigned long long)startup.mem_open_ns,
+			     "khwtest_open_ns", (unsigned long long)startup.khwtest_open_ns,
+			     "iopl_ns", (unsigned long long)startup.iopl_ns);
 }
 
 static PyMethodDef ChwtestMethods[] = {
-	{"readb",   chwtest_readb,   METH_VARARGS, "Read a byte from physical memory."},
-	{"readw",   chwtest_readw,   METH_VARARGS, "Read a word from physical memory."},
-	{"readlw",  chwtest_readlw,  METH_VARARGS, "Read a long word from physical memory."},
-	{"writeb",  chwtest_writeb,  METH_VARARGS, "Write a byte to physical memory."},
-	{"writew",  chwtest_writew,  METH_VARARGS, "Write a word to physical memory."},
-	{"writelw", chwtest_writelw, METH_VARARGS, "Write a long word to physical memory."},
-	{"inb",     chwtest_inb,     METH_VARARGS, "Read a byte from I/O space."},
-	{"inw",     chwtest_inw,     METH_VARARGS, "Read a word from I/O space."},
-	{"inlw",    chwtest_inlw,    METH_VARARGS, "Read a long word from I/O space."},
-	{"outb",    chwtest_outb,    METH_VARARGS, "Write a byte to I/O space."},
-	{"outw",    chwtest_outw,    METH_VARARGS, "Write a word to I/O space."},
-	{"outlw",   chwtest_outlw,   METH_VARARGS, "Write a long word to I/O space."},
+	{"readb",   FASTCALL_METHOD(chwtest_readb),   FASTCALL_FLAGS, "Read a byte from physical memory."},
+	{"readw",   FASTCALL_METHOD(chwtest_readw),   FASTCALL_FLAGS, "Read a word from physical memory."},
+	{"readlw",  FASTCALL_METHOD(chwtest_readlw),  FASTCALL_FLAGS, "Read a long word from physical memory."},
+	{"writeb",  FASTCALL_METHOD(chwtest_writeb),  FASTCALL_FLAGS, "Write a byte to physical memory."},
+	{"writew",  FASTCALL_METHOD(chwtest_writew),  FASTCALL_FLAGS, "Write a word to physical memory."},
+	{"writelw", FASTCALL_METHOD(chwtest_writelw), FASTCALL_FLAGS, "Write a long word to physical memory."},
+	{"readq",   FASTCALL_METHOD(chwtest_readq),   FASTCALL_FLAGS, "Read a 64 bit quad word from physical memory in one access."},
+	{"writeq",  FASTCALL_METHOD(chwtest_writeq),  FASTCALL_FLAGS, "Write a 64 bit quad word to physical memory in one access."},
+	{"read_block",  chwtest_read_block,  METH_VARARGS,
+	 "Read a block of physical memory into a bytearray using accesses of the given width."},
+	{"write_block", chwtest_write_block, METH_VARARGS,
+	 "Write a buffer to physical memory using accesses of the given width."},
+	{"poll_until", (PyCFunction)chwtest_poll_until, METH_VARARGS | METH_KEYWORDS,
+	 "poll_until(address, mask, value, timeout_ns, width=4, spin_ns=-1)\n\n"
+	 "Wait until (*address & mask) == (value & mask) and return\n"
+	 "(value, iterations, elapsed_ns).  On a timeout the returned value does\n"
+	 "not match.  After spin_ns the wait backs off by sleeping, a negative\n"
+	 "spin_ns spins for the whole timeout.\n"},
+	{"fill_pattern", (PyCFunction)chwtest_fill_pattern, METH_VARARGS | METH_KEYWORDS,
+	 "fill_pattern(address, nbytes, pattern, width=4, seed=0, data=None)\n\n"
+	 "Fill physical memory with one of the PATTERN_* test patterns.\n"},
+	{"verify_pattern", (PyCFunction)chwtest_verify_pattern, METH_VARARGS | METH_KEYWORDS,
+	 "verify_pattern(address, nbytes, pattern, width=4, seed=0, data=None,\n"
+	 "               max_mismatches=16)\n\n"
+	 "Compare physical memory against a test pattern.  Returns the number of\n"
+	 "mismatching words and a list of (address, expected, actual) for the\n"
+	 "first max_mismatches of them.\n"},
+	{"inb",     FASTCALL_METHOD(chwtest_inb),     FASTCALL_KW_FLAGS, "Read a byte from I/O space, paused unless paused is false."},
+	{"inw",     FASTCALL_METHOD(chwtest_inw),     FASTCALL_KW_FLAGS, "Read a word from I/O space, paused unless paused is false."},
+	{"inlw",    FASTCALL_METHOD(chwtest_inlw),    FASTCALL_KW_FLAGS, "Read a long word from I/O space, paused unless paused is false."},
+	{"outb",    FASTCALL_METHOD(chwtest_outb),    FASTCALL_KW_FLAGS, "Write a byte to I/O space, paused unless paused is false."},
+	{"outw",    FASTCALL_METHOD(chwtest_outw),    FASTCALL_KW_FLAGS, "Write a word to I/O space, paused unless paused is false."},
+	{"outlw",   FASTCALL_METHOD(chwtest_outlw),   FASTCALL_KW_FLAGS, "Write a long word to I/O space, paused unless paused is false."},
+	{"insb",    chwtest_insb,    METH_VARARGS, "Read count bytes from one I/O port into a bytearray."},
+	{"insw",    chwtest_insw,    METH_VARARGS, "Read count words from one I/O port into a bytearray."},
+	{"inslw",   chwtest_inslw,   METH_VARARGS, "Read count long words from one I/O port into a bytearray."},
+	{"outsb",   chwtest_outsb,   METH_VARARGS, "Write a buffer to one I/O port a byte at a time."},
+	{"outsw",   chwtest_outsw,   METH_VARARGS, "Write a buffer to one I/O port a word at a time."},
+	{"outslw",  chwtest_outslw,  METH_VARARGS, "Write a buffer to one I/O port a long word at a time."},
 	{"alloc_dma_page", 
 	 chwtest_allocdmapage, 
 	 METH_VARARGS, 
-	 "Allocate a DMAable page of memory and return the physical address.\n"
+	 "Allocate a DMAable page of memory and return (bus_address, handle).\n"
+	 "The handle is 0 if khwtest is too old to free the page.\n"
 	},
+	{"alloc_dma", (PyCFunction)chwtest_alloc_dma, METH_VARARGS | METH_KEYWORDS,
+	 "alloc_dma(size, align=0, dma_bits=32)\n\n"
+	 "Allocate a contiguous DMA buffer and return (bus_address, handle).\n"},
+	{"free_dma", chwtest_free_dma, METH_VARARGS,
+	 "Free a DMA buffer by the handle returned from alloc_dma.\n"},
+	{"dma_pool_reserve", (PyCFunction)chwtest_dma_pool_reserve,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "dma_pool_reserve(size, count, dma_bits=32)\n\n"
+	 "Pre-allocate count DMA buffers of size bytes into the recycling pool.\n"},
+	{"dma_pool_stats", chwtest_dma_pool_stats, METH_VARARGS,
+	 "Return a dictionary of DMA pool hit, miss and high water statistics.\n"},
+	{"irq_request", (PyCFunction)chwtest_irq_request, METH_VARARGS | METH_KEYWORDS,
+	 "irq_request(type, domain=0, bus=0, devfn=0, vector=0, eventfd=-1)\n\n"
+	 "Install a handler for an interrupt with khwtest and return (fd, irq).\n"
+	 "Closing fd frees the interrupt.\n"},
+	{"irq_wait", chwtest_irq_wait, METH_VARARGS,
+	 "irq_wait(fd, timeout_ns=-1)\n\n"
+	 "Wait for interrupts since the last wait and return (count,\n"
+	 "timestamp_ns, latency_ns), or None on timeout.\n"},
+	{"irq_trigger", chwtest_irq_trigger, METH_VARARGS,
+	 "Fire an interrupt file from software."},
+	{"irq_unmask", chwtest_irq_unmask, METH_VARARGS,
+	 "Unmask a legacy interrupt after it has been acknowledged."},
+	{"irq_info", chwtest_irq_info, METH_VARARGS,
+	 "Return a dictionary with the counters of an interrupt file."},
+	{"execute_batch", chwtest_execute_batch, METH_VARARGS,
+	 "Run a list of (op, address[, value[, mask[, width[, timeout_ns]]]]) register\n"
+	 "operations in the kernel with one system call.  Returns the list of values\n"
+	 "read by each operation.\n"},
+	{"map_region", chwtest_map_region, METH_VARARGS,
+	 "Map a whole physical region (such as a BAR) as one cached window."},
+	{"map_flush", chwtest_map_flush, METH_VARARGS,
+	 "Unmap all cached windows that are not pinned by a Mapping."},
+	{"set_map_limit", chwtest_set_map_limit, METH_VARARGS,
+	 "Set the limit on total mapped bytes and optionally the default window size."},
+	{"map_stats", chwtest_map_stats, METH_VARARGS,
+	 "Return a dictionary of mapping cache statistics."},
+	{"iomem_ranges", (PyCFunction)chwtest_iomem_ranges, METH_VARARGS | METH_KEYWORDS,
+	 "iomem_ranges(reset=False)\n\n"
+	 "Return the physical address map used to route accesses as a list of\n"
+	 "dictionaries with the access counts of each range.  end is exclusive.\n"},
+	{"trace_start", (PyCFunction)chwtest_trace_start, METH_VARARGS | METH_KEYWORDS,
+	 "trace_start(entries=65536)\n\n"
+	 "Start logging every access into a ring of entries per thread.\n"},
+	{"trace_stop", chwtest_trace_stop, METH_NOARGS,
+	 "Stop logging accesses.\n"},
+	{"trace_dump", chwtest_trace_dump, METH_VARARGS,
+	 "trace_dump(path)\n\n"
+	 "Write the accesses logged since the last dump to a binary file and\n"
+	 "return how many there were.  Decode the file with hwtrace.py.\n"},
+	{"startup_stats", chwtest_startup_stats, METH_NOARGS,
+	 "Return how many nanoseconds module init and the first use of each\n"
+	 "device took, 0 for devices that were not used yet."},
 	{ NULL, NULL, 0, NULL},
 };
 
-PyMODINIT_FUNC initchwtest(void)
+static void open_backend(void)
 {
-	(void)Py_InitModule("chwtest", ChwtestMethods);
+	const char *backend = getenv("HWTEST_MEM");
+	const char *env;
 
-	mem_fd = open("/dev/mem", O_RDWR);
-	if (-1 == mem_fd) {
-		PyErr_SetFromErrnoWithFilename(PyExc_ImportError, "/dev/mem");
+	/* /dev/mem, khwtest and the I/O space are all opened on first use. */
+	if (!backend)
 		return;
+
+	emulated = 1;
+
+	if (!strncmp(backend, "memfd:", 6)) {
+		unsigned long size = strtoul(backend + 6, NULL, 0);
+
+		mem_path = backend;
+		mem_fd = memfd_create("hwtest", MFD_CLOEXEC);
+		if (-1 == mem_fd || ftruncate(mem_fd, size)) {
+			PyErr_SetFromErrnoWithFilename(PyExc_ImportError, (char *)mem_path);
+			return;
+		}
+	} else {
+		mem_path = backend;
+		mem_fd = open(mem_path, O_RDWR);
+		if (-1 == mem_fd) {
+			PyErr_SetFromErrnoWithFilename(PyExc_ImportError, (char *)mem_path);
+			return;
+		}
 	}
-	if (iopl(3)) { /* So that we can access the io space */
-		PyErr_SetString(PyExc_ImportError, 
-			"Failed to enable permissions to access IO space for this process.");
-		return;
+
+	env = getenv("HWTEST_KHWTEST");
+	if (env) {
+		khwtest_path = env;
+	} else {
+		/* The same memory also stands in for khwtest. */
+		khwtest_path = mem_path;
+		khwtest_fd = mem_fd;
+	}
+	env = getenv("HWTEST_RAM_HIGH");
+	if (env)
+		ram_high = strtoul(env, NULL, 0);
+	/* A made up memory has no address map of its own. */
+	iomem_path = NULL;
+}
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef chwtest_module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "chwtest",
+	.m_size = -1,
+	.m_methods = ChwtestMethods,
+};
+#endif
+
+/* Returns the module, or NULL with an exception set. */
+static PyObject *chwtest_init(void)
+{
+	uint64_t start = now_ns();
+	uint64_t step;
+	PyObject *m;
+
+#if PY_MAJOR_VERSION >= 3
+	m = PyModule_Create(&chwtest_module);
+#else
+	m = Py_InitModule("chwtest", ChwtestMethods);
+#endif
+	if (!m)
+		return NULL;
+
+	if (pthread_key_create(&thread_key, thread_state_destroy)) {
+		PyErr_SetFromErrno(PyExc_ImportError);
+		goto fail;
+	}
+#if PY_VERSION_HEX < 0x03070000
+	PyEval_InitThreads();
+#endif
+
+	PyModule_AddIntConstant(m, "OP_READ", KHWTEST_OP_READ);
+	PyModule_AddIntConstant(m, "OP_WRITE", KHWTEST_OP_WRITE);
+	PyModule_AddIntConstant(m, "OP_RMW", KHWTEST_OP_RMW);
+	PyModule_AddIntConstant(m, "OP_DELAY", KHWTEST_OP_DELAY);
+	PyModule_AddIntConstant(m, "OP_POLL", KHWTEST_OP_POLL);
+	PyModule_AddIntConstant(m, "OP_LOOP", PROG_OP_LOOP);
+	PyModule_AddIntConstant(m, "OP_BRANCH", PROG_OP_BRANCH);
+
+	PyModule_AddIntConstant(m, "PATTERN_WALKING_ONES", PATTERN_WALKING_ONES);
+	PyModule_AddIntConstant(m, "PATTERN_WALKING_ZEROS", PATTERN_WALKING_ZEROS);
+	PyModule_AddIntConstant(m, "PATTERN_ADDRESS", PATTERN_ADDRESS);
+	PyModule_AddIntConstant(m, "PATTERN_CHECKERBOARD", PATTERN_CHECKERBOARD);
+	PyModule_AddIntConstant(m, "PATTERN_LFSR", PATTERN_LFSR);
+	PyModule_AddIntConstant(m, "PATTERN_USER", PATTERN_USER);
+
+	PyModule_AddIntConstant(m, "IRQ_LEGACY", KHWTEST_IRQ_LEGACY);
+	PyModule_AddIntConstant(m, "IRQ_MSI", KHWTEST_IRQ_MSI);
+	PyModule_AddIntConstant(m, "IRQ_SOFTWARE", KHWTEST_IRQ_SOFTWARE);
+
+	if (PyType_Ready(&MappingType) < 0)
+		goto fail;
+	Py_INCREF(&MappingType);
+	PyModule_AddObject(m, "Mapping", (PyObject *)&MappingType);
+
+	if (PyType_Ready(&ProgramType) < 0)
+		goto fail;
+	Py_INCREF(&ProgramType);
+	PyModule_AddObject(m, "Program", (PyObject *)&ProgramType);
+
+	if (PyType_Ready(&PollerType) < 0)
+		goto fail;
+	Py_INCREF(&PollerType);
+	PyModule_AddObject(m, "Poller", (PyObject *)&PollerType);
+
+	if (PyType_Ready(&RingType) < 0)
+		goto fail;
+	Py_INCREF(&RingType);
+	PyModule_AddObject(m, "Ring", (PyObject *)&RingType);
+
+	if (PyType_Ready(&ShadowType) < 0)
+		goto fail;
+	Py_INCREF(&ShadowType);
+	PyModule_AddObject(m, "Shadow", (PyObject *)&ShadowType);
+
+	if (PyType_Ready(&RegisterType) < 0 ||
+	    PyType_Ready(&RegisterBlockType) < 0)
+		goto fail;
+	Py_INCREF(&RegisterType);
+	PyModule_AddObject(m, "Register", (PyObject *)&RegisterType);
+	Py_INCREF(&RegisterBlockType);
+	PyModule_AddObject(m, "RegisterBlock", (PyObject *)&RegisterBlockType);
+
+	step = now_ns();
+	open_backend();
+	startup.backend_ns = now_ns() - step;
+	if (PyErr_Occurred() != NULL)
+		goto fail;
+	if (getenv("HWTEST_IOMEM"))
+		iomem_path = getenv("HWTEST_IOMEM");
+	step = now_ns();
+	if (load_ranges(iomem_path)) {
+		PyErr_NoMemory();
+		goto fail;
 	}
+	startup.iomem_ns = now_ns() - step;
+	startup.init_ns = now_ns() - start;
+	return m;
+fail:
+#if PY_MAJOR_VERSION >= 3
+	Py_DECREF(m);
+#endif
+	return NULL;
+}
+
+#if PY_MAJOR_VERSION >= 3
+PyMODINIT_FUNC PyInit_chwtest(void)
+{
+	return chwtest_init();
+}
+#else
+PyMODINIT_FUNC initchwtest(void)
+{
+	chwtest_init();
 }
+#endif
@@ -0,0 +1,183 @@
+#!/usr/bin/env python
+#
+# Copyright (c) 2009-2014, Shaun Ruffell <sruffell@sruffell.net>
+# All rights reserved.
+# 
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+# 
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer. 
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+'''
+Micro benchmarks for the hwtest physical memory access paths.
+
+By default the benchmarks run against an anonymous memory file standing in
+for physical memory, so they need neither root nor hardware.  Set HWTEST_MEM
+(and optionally HWTEST_KHWTEST and HWTEST_RAM_HIGH) before running to use
+another backend.  Results are written as JSON with one entry per benchmark
+giving ns/op and ops/s, so that runs can be compared for regressions.
+'''
+
+import os
+import sys
+import json
+import time
+import platform
+import argparse
+
+MEM_SIZE = 64 << 20
+RAM_HIGH = 16 << 20
+
+if "HWTEST_MEM" not in os.environ:
+    os.environ["HWTEST_MEM"] = "memfd:%d" % MEM_SIZE
+    os.environ["HWTEST_RAM_HIGH"] = "%d" % RAM_HIGH
+
+import chwtest
+import hwtest
+
+clock = getattr(time, "perf_counter", time.time)
+
+def measure(func, iterations, repeat):
+    '''
+    Calls func(iterations) repeat times and returns the best time per
+    iteration in nanoseconds.  func runs the operation under test iterations
+    times.
+    '''
+    best = None
+    for i in range(repeat):
+        start = clock()
+        func(iterations)
+        elapsed = clock() - start
+        if best is None or elapsed < best:
+            best = elapsed
+    return best * 1e9 / iterations
+
+def single_access(module, name, address, value):
+    access = getattr(module, name)
+    if name.startswith("read"):
+        def run(n):
+            for i in range(n):
+                access(address)
+    else:
+        def run(n):
+            for i in range(n):
+                access(address, value)
+    return run
+
+def page_switch(addresses):
+    readlw = chwtest.readlw
+    count = len(addresses)
+    def run(n):
+        for i in range(n):
+            readlw(addresses[i % count])
+    return run
+
+def block(name, address, nbytes, width):
+    if name == "read_block":
+        def run(n):
+            for i in range(n):
+                chwtest.read_block(address, nbytes, width)
+    else:
+        data = bytearray(nbytes)
+        def run(n):
+            for i in range(n):
+                chwtest.write_block(address, data, width)
+    return run
+
+def benchmarks(mmio, syscall):
+    '''
+    Yields (description, function, units per iteration) for every benchmark.
+    '''
+    window = 1 << 20
+
+    for path, address in (("mmap", mmio), ("syscall", syscall)):
+        for layer, module in (("chwtest", chwtest), ("hwtest", hwtest)):
+            for width, suffix in ((1, "b"), (2, "w"), (4, "lw"), (8, "q")):
+                for op in ("read", "write"):
+                    name = op + suffix
+                    yield ({"name": name, "layer": layer, "path": path,
+                            "width": width},
+                           single_access(module, name, address, 0x5a), 1)
+
+    # Page switching through the mapping cache, from staying on one page to
+    # touching more windows than the limit allows on every access.
+    patterns = (
+        ("same_page", [mmio]),
+        ("pages_in_window", [mmio + i * 4096 for i in range(16)]),
+        ("windows_in_limit", [mmio + i * window for i in range(4)]),
+        ("windows_over_limit", [mmio + i * window for i in range(8)]),
+    )
+    for pattern, addresses in patterns:
+        yield ({"name": "page_switch", "pattern": pattern, "layer": "chwtest",
+                "path": "mmap", "width": 4},
+               page_switch(addresses), 1)
+
+    for path, address in (("mmap", mmio), ("syscall", syscall)):
+        for name in ("read_block", "write_block"):
+            for width in (1, 4, 8):
+                yield ({"name": name, "layer": "chwtest", "path": path,
+                        "width": width, "bytes": 65536},
+                       block(name, address, 65536, width), 1)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().split("\n")[0])
+    parser.add_argument("-n", "--iterations", type=int, default=100000,
+                        help="operations per measurement")
+    parser.add_argument("-r", "--repeat", type=int, default=5,
+                        help="measurements per benchmark, the best is kept")
+    parser.add_argument("-o", "--output", help="write the JSON here instead of stdout")
+    parser.add_argument("--mmio", type=lambda x: int(x, 0), default=RAM_HIGH,
+                        help="address used for the mmap path")
+    parser.add_argument("--syscall", type=lambda x: int(x, 0), default=0x1000,
+                        help="address used for the khwtest path")
+    args = parser.parse_args()
+
+    results = []
+    for desc, func, units in benchmarks(args.mmio, args.syscall):
+        iterations = args.iterations
+        if desc["name"] in ("read_block", "write_block"):
+            iterations = max(1, iterations // 100)
+        if desc["name"] == "page_switch":
+            # Only the over limit pattern evicts; keep it to four windows.
+            chwtest.set_map_limit(4 << 20, 1 << 20)
+            chwtest.map_flush()
+        ns = measure(func, iterations, args.repeat)
+        desc["ns_per_op"] = round(ns, 1)
+        desc["ops_per_s"] = round(1e9 / ns, 1)
+        if "bytes" in desc:
+            desc["mb_per_s"] = round(desc["bytes"] * 1e3 / ns, 1)
+        results.append(desc)
+
+    report = {
+        "backend": os.environ["HWTEST_MEM"],
+        "python": platform.python_version(),
+        "machine": platform.machine(),
+        "iterations": args.iterations,
+        "repeat": args.repeat,
+        "map_stats": chwtest.map_stats(),
+        "results": results,
+    }
+    output = json.dumps(report, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(output + "\n")
+    else:
+        sys.stdout.write(output + "\n")
+
+if __name__ == "__main__":
+    main()
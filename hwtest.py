@@ -29,105 +29,317 @@ Contains functions for testing registers on physical boards.
 
 import sys
 import os
+import struct
+import re
+import time
 
-if os.getuid() != 0:
-    raise ImportError("You must be root to use the hwtest module")
+_startup = {}
 
-if os.system("modprobe khwtest"):
-    sys.stderr.write("Failed to load the khwtest module. This is OK if you do not plan to use DMA operations.\n")
+# With HWTEST_MEM set physical memory is emulated by a file (see chwtest.c),
+# which needs neither root nor the kernel module.
+if not os.environ.get("HWTEST_MEM"):
+    if os.getuid() != 0:
+        raise ImportError("You must be root to use the hwtest module")
 
+    # Loaded modules are listed in sysfs, which is much cheaper to look at
+    # than running modprobe on every import.
+    _start = time.time()
+    if not os.path.isdir("/sys/module/khwtest"):
+        if os.spawnvp(os.P_WAIT, "modprobe", ["modprobe", "khwtest"]):
+            sys.stderr.write("Failed to load the khwtest module. This is OK if you do not plan to use DMA operations.\n")
+    _startup["module_check_ns"] = int((time.time() - _start) * 1e9)
+
+_start = time.time()
 import chwtest
+_startup["import_ns"] = int((time.time() - _start) * 1e9)
 
-def __convert(address):
-    # This is a bit of ugliness due to the fact that python integerrs aren't
-    # limited by 32-bits.  If bit 31 is set, we need to make sure that we pass
-    # a negative number to the extension.
-    if address & 0x80000000:
-        address = -((address^0xffffffff)+1)
-    return address
+# The single register accesses are called straight from the extension: a
+# Python wrapper around each would cost more than the access itself.
+# Addresses and values are unsigned, but negative values are still taken as
+# two's complement, and reads return unsigned values.  The port functions
+# follow the access with the short delay some old devices need unless paused
+# is False, as in inb(port, False) or outb(port, value, False).
+readb = chwtest.readb
+readw = chwtest.readw
+readlw = chwtest.readlw
+readq = chwtest.readq
+writeb = chwtest.writeb
+writew = chwtest.writew
+writelw = chwtest.writelw
+writeq = chwtest.writeq
+
+inb = chwtest.inb
+inw = chwtest.inw
+inlw = chwtest.inlw
+outb = chwtest.outb
+outw = chwtest.outw
+outlw = chwtest.outlw
 
-def __convert16(address):
-    # This is a bit of ugliness due to the fact that python integerrs aren't
-    # limited by 32-bits.  If bit 31 is set, we need to make sure that we pass
-    # a negative number to the extension.
-    if address & 0x8000:
-        address = -((address^0xffff)+1)
+def insb(address, count):
+    '''
+    Reads count bytes from a single IO port, such as a FIFO, with one string
+    instruction and returns them as a bytearray.
+    '''
+    return chwtest.insb(address, count)
+def insw(address, count):
+    '''
+    Reads count words from a single IO port and returns them as a bytearray.
+    '''
+    return chwtest.insw(address, count)
+def inslw(address, count):
+    '''
+    Reads count long words from a single IO port and returns them as a
+    bytearray.
+    '''
+    return chwtest.inslw(address, count)
+def outsb(address, buffer):
+    '''
+    Writes the contents of buffer to a single IO port a byte at a time with
+    one string instruction.
+    '''
+    chwtest.outsb(address, buffer)
+def outsw(address, buffer):
+    '''
+    Writes the contents of buffer to a single IO port a word at a time.
+    '''
+    chwtest.outsw(address, buffer)
+def outslw(address, buffer):
+    '''
+    Writes the contents of buffer to a single IO port a long word at a time.
+    '''
+    chwtest.outslw(address, buffer)
+
+def alloc_dma_page(return_handle=False):
+    '''
+    Allocates a page of physical memory and returns the physical address of
+    the page which can be passed to a device or read with the other physical
+    memory access functions.  The memory is freed when this module is
+    unloaded.  With return_handle=True, (address, handle) is returned and
+    the page can be freed earlier with free_dma(handle).
+    '''
+    address, handle = chwtest.alloc_dma_page()
+    if return_handle:
+        return address, handle
     return address
 
-def readb(address):
+def read_block(address, nbytes, width=4):
+    '''
+    Reads nbytes of physical memory starting at address and returns them as
+    a bytearray.  Every access is made with the given width in bytes.
+    '''
+    return chwtest.read_block(address, nbytes, width)
+
+def write_block(address, buffer, width=4):
     '''
-    Reads a byte in from memory mapped IO registers.
+    Writes the contents of buffer, which may be any object that supports the
+    buffer protocol, to physical memory starting at address.  Every access is
+    made with the given width in bytes.
     '''
-    return chwtest.readb(__convert(address)) & 0xff
-def readw(address):
+    chwtest.write_block(address, buffer, width)
+
+PATTERN_WALKING_ONES = chwtest.PATTERN_WALKING_ONES
+PATTERN_WALKING_ZEROS = chwtest.PATTERN_WALKING_ZEROS
+PATTERN_ADDRESS = chwtest.PATTERN_ADDRESS
+PATTERN_CHECKERBOARD = chwtest.PATTERN_CHECKERBOARD
+PATTERN_LFSR = chwtest.PATTERN_LFSR
+PATTERN_USER = chwtest.PATTERN_USER
+
+def fill_pattern(address, nbytes, pattern, width=4, seed=0, data=None):
     '''
-    Reads a word in from memory mapped IO registers.
+    Fills nbytes of physical memory starting at address with a test pattern,
+    generated width bytes at a time: PATTERN_WALKING_ONES,
+    PATTERN_WALKING_ZEROS, PATTERN_ADDRESS (every word holds its own
+    address), PATTERN_CHECKERBOARD, PATTERN_LFSR (pseudo random from seed)
+    or PATTERN_USER (data repeated).  Device memory is only accessed with
+    the given width.
     '''
-    return chwtest.readw(__convert(address)) & 0xffff
-def readlw(address):
+    chwtest.fill_pattern(address, nbytes, pattern, width, seed, data)
+
+def verify_pattern(address, nbytes, pattern, width=4, seed=0, data=None,
+                   max_mismatches=16):
     '''
-    Reads a long word in from memory mapped IO registers.
+    Checks memory written by fill_pattern with the same arguments.  Returns
+    a tuple of (number of mismatching words, list) where the list holds
+    (address, expected, actual) for the first max_mismatches of them.
     '''
-    return chwtest.readlw(__convert(address)) & 0xffffffff
-def writeb(address, value):
+    return chwtest.verify_pattern(address, nbytes, pattern, width, seed, data,
+                                  max_mismatches)
+
+def alloc_dma(size, align=0, dma_bits=32):
     '''
-    Writes a byte to a memory mapped IO register.
+    Allocates a physically contiguous buffer of size bytes for DMA by a
+    device that can address dma_bits (32 or 64) bits, aligned to align bytes
+    if given.  Returns a tuple of (bus_address, handle).  The buffer can be
+    accessed like any other memory and is released with free_dma(handle) or
+    when this module is unloaded.
     '''
-    chwtest.writeb(__convert(address), __convert(value))
-def writew(address, value):
-    ''' 
-    Writes a word to a memory mapped IO register.
+    return chwtest.alloc_dma(size, align, dma_bits)
+
+def free_dma(handle):
     '''
-    chwtest.writew(__convert(address), __convert16(value))
-def writelw(address, value):
-    ''' 
-    Writes a long word to a memory mapped IO register.
+    Frees a buffer allocated with alloc_dma.
     '''
-    chwtest.writelw(__convert(address), __convert(value))
-def inb(address):
-    ''' 
-    Reads a byte from an IO port.
+    chwtest.free_dma(handle)
+
+def dma_pool_reserve(size, count, dma_bits=32):
     '''
-    return chwtest.inb(__convert(address)) & 0xff
-def inw(address):
+    Pre-allocates count buffers of size bytes into the pool that freed DMA
+    buffers are recycled through, so that later calls to alloc_dma of that
+    size do not have to go to the kernel's DMA allocator.  The pool holds
+    at most the pool_max parameter of khwtest per size, so count is capped
+    at that.  Recycled buffers are not cleared.
     '''
-    Reads a word from an IO port.
+    chwtest.dma_pool_reserve(size, count, dma_bits)
+
+def dma_pool_stats():
     '''
-    return chwtest.inw(__convert(address)) & 0xffff
-def inlw(address):
+    Returns a dictionary with the hit and miss counts of the DMA buffer pool
+    along with the number and size of live allocations and their high water
+    marks.
     '''
-    Reads a long word from an IO port.
+    return chwtest.dma_pool_stats()
+
+OP_READ = chwtest.OP_READ
+OP_WRITE = chwtest.OP_WRITE
+OP_RMW = chwtest.OP_RMW
+OP_DELAY = chwtest.OP_DELAY
+OP_POLL = chwtest.OP_POLL
+
+def execute_batch(ops):
     '''
-    return chwtest.inlw(__convert(address)) & 0xffffffff
-def outb(address, value):
+    Runs a sequence of register operations in the kernel with a single
+    system call.  Each operation is a tuple of
+    (op, address[, value[, mask[, width[, timeout_ns]]]]) where op is one of
+    OP_READ, OP_WRITE, OP_RMW, OP_DELAY (value is the delay in nanoseconds)
+    or OP_POLL, and width is in bytes.  Returns a list with the value read by
+    each operation.
+
+    >>> execute_batch([(OP_WRITE, ctrl, 1),
+    ...                (OP_POLL, status, 0x1, 0x1, 4, 1000000),
+    ...                (OP_READ, result)])
     '''
-    Writes a byte to an IO port.
+    return chwtest.execute_batch(ops)
+
+OP_LOOP = chwtest.OP_LOOP
+OP_BRANCH = chwtest.OP_BRANCH
+
+# Program(ops) compiles a register access sequence once so that run() can
+# replay it in C without the interpreter lock.  Reads are stored in numbered
+# slots, which run() returns as an array.  See help(Program) for the ops.
+#
+# >>> kick = Program([(OP_WRITE, ctrl, 1),
+# ...                 (OP_POLL, status, 0x1, 0x1, 1000000),
+# ...                 (OP_READ, result, 0)])
+# >>> kick.run()
+# array('L', [3L])
+Program = chwtest.Program
+
+# Ring(address, count, layout) builds descriptor rings in DMA memory a batch
+# at a time.  The layout lists (name, offset, width[, big_endian]) fields,
+# fill() writes descriptors at the head and rings the doorbell, and reap()
+# collects completed descriptors from the tail.  See help(Ring).
+#
+# >>> ring = Ring(alloc_dma(4096)[0], 256,
+# ...             [("addr", 0, 8), ("len", 8, 4), ("status", 12, 4)],
+# ...             doorbell=bar0.base + TX_HEAD)
+# >>> ring.fill([(buf, 1500), (buf + 2048, 60)])
+# 2
+# >>> ring.reap(2, DONE, DONE)
+# [(3221229568L, 1500L, 2147483648L)]
+Ring = chwtest.Ring
+
+def poll_until(address, mask, value, timeout_ns, width=4, spin_ns=-1):
     '''
-    chwtest.outb(__convert(address), __convert(value))
-def outw(address, value):
+    Waits in C, without holding the interpreter lock, until the register at
+    address has (register & mask) == (value & mask) or timeout_ns has passed.
+    Returns a tuple of (register value, iterations, elapsed nanoseconds); on
+    a timeout the returned register value does not match.  By default the
+    wait spins for the whole time; with spin_ns it starts sleeping with an
+    increasing back off once spin_ns has passed.
     '''
-    Writes a word to an IO port.
+    return chwtest.poll_until(address, mask, value, timeout_ns, width, spin_ns)
+
+def trace_start(entries=65536):
     '''
-    chwtest.outw(__convert(address), __convert(value))
-def outlw(address, value):
+    Starts logging every access, with a timestamp, the address, width,
+    direction, value and thread, into a ring of entries per thread.  The
+    oldest entries are overwritten once a ring is full.  Anything logged
+    before is discarded.
     '''
-    Writes a long word to an IO port.
+    chwtest.trace_start(entries)
+
+def trace_stop():
+    '''
+    Stops logging accesses.  What was logged can still be dumped.
     '''
-    chwtest.outlw(__convert(address), __convert(value))
+    chwtest.trace_stop()
 
-def alloc_dma_page():
+def trace_dump(path):
     '''
-    Allocates a page of physical memory and returns the physical address of
-    the page which can be passed to a device or read with the other physical
-    memory access functions.  The memory is freed when this module is
-    unloaded.
+    Writes the accesses logged since the last dump to a binary file and
+    returns how many were written.  Use hwtrace.py to turn the file into
+    text or CSV.
     '''
-    return chwtest.alloc_dma_page() & 0xffffffff
+    return chwtest.trace_dump(path)
+
+def map_region(address, size):
+    '''
+    Maps a whole physical region, such as a PCI BAR, as one window in the
+    mapping cache so that later accesses anywhere inside it do not remap.
+    '''
+    chwtest.map_region(address, size)
+
+def map_flush():
+    '''
+    Unmaps every window in the mapping cache.
+    '''
+    chwtest.map_flush()
+
+def set_map_limit(limit, window_size=None):
+    '''
+    Sets the maximum number of bytes kept mapped by the mapping cache, and
+    optionally the size of the windows created on a cache miss.  The least
+    recently used windows are unmapped when the limit is exceeded.
+    '''
+    if window_size is None:
+        chwtest.set_map_limit(limit)
+    else:
+        chwtest.set_map_limit(limit, window_size)
+
+def map_stats():
+    '''
+    Returns a dictionary with the hit, miss and eviction counts of the
+    mapping cache along with its current size and limits.
+    '''
+    return chwtest.map_stats()
+
+def iomem_ranges(reset=False):
+    '''
+    Returns the physical address map that accesses are routed by, read from
+    /proc/iomem (or the file named by HWTEST_IOMEM) when the module was
+    loaded.  Each range is a dictionary with start, end (exclusive), kind
+    ("ram", "reserved" or "mmio"), name and the reads, writes and bytes
+    routed through it.  System RAM is accessed through khwtest and
+    everything else through /dev/mem.  With reset the counters are cleared
+    after they are read.
+    '''
+    return chwtest.iomem_ranges(reset)
+
+def startup_stats():
+    '''
+    Returns where the startup time went, in nanoseconds: checking for (and
+    loading) khwtest, importing chwtest and the parts of its init, and the
+    first use of /dev/mem, khwtest and the I/O space, which are only opened
+    when a script needs them.  Devices that were not used yet show 0.
+    '''
+    stats = dict(_startup)
+    stats.update(chwtest.startup_stats())
+    return stats
 
 def dump(address, words):
+    values = struct.unpack("=%dI" % words, bytes(read_block(address, 4*words)))
     for i in range(0, words, 1):
-        print "%08x:" % (address+ 4*i),
-        print hex(readlw(address + 4*i))
+        sys.stdout.write("%08x: %s\n" % (address + 4*i, hex(values[i])))
 
 class IORegion(object):
     '''
@@ -137,23 +349,249 @@ class IORegion(object):
         self.base = kwargs.get("base")
         if not self.base:
             raise Exception("You must specify a base address for the memory region.")
-    def inlw(self, address):
-        return inlw(self.base + address)
-    def outlw(self, address):
-        outlw(self.base + address)
+    def inb(self, address, paused=True):
+        return inb(self.base + address, paused)
+    def inw(self, address, paused=True):
+        return inw(self.base + address, paused)
+    def inlw(self, address, paused=True):
+        return inlw(self.base + address, paused)
+    def outb(self, address, value, paused=True):
+        outb(self.base + address, value, paused)
+    def outw(self, address, value, paused=True):
+        outw(self.base + address, value, paused)
+    def outlw(self, address, value, paused=True):
+        outlw(self.base + address, value, paused)
+    def insb(self, address, count):
+        return insb(self.base + address, count)
+    def insw(self, address, count):
+        return insw(self.base + address, count)
+    def inslw(self, address, count):
+        return inslw(self.base + address, count)
+    def outsb(self, address, buffer):
+        outsb(self.base + address, buffer)
+    def outsw(self, address, buffer):
+        outsw(self.base + address, buffer)
+    def outslw(self, address, buffer):
+        outslw(self.base + address, buffer)
+
+Register = chwtest.Register
+Shadow = chwtest.Shadow
+RegisterBlock = chwtest.RegisterBlock
+
+_REGISTER_MAP_NUMBERS = ("offset", "width", "reset", "bit", "lsb", "msb")
+_STRING_TYPES = (str, type(u""))
+
+def _register_map_numbers(entry):
+    if isinstance(entry, dict):
+        for key, value in entry.items():
+            if key in _REGISTER_MAP_NUMBERS and isinstance(value, _STRING_TYPES):
+                entry[key] = int(value, 0)
+            else:
+                _register_map_numbers(value)
+    elif isinstance(entry, list):
+        for item in entry:
+            _register_map_numbers(item)
+    return entry
+
+def load_register_map(path):
+    '''
+    Loads a register map description for RegisterBlock from a JSON file, or
+    a YAML file if its name ends in .yaml or .yml and PyYAML is installed.
+    Numbers may also be given as strings such as "0x100".
+    '''
+    with open(path) as f:
+        if path.endswith((".yaml", ".yml")):
+            import yaml
+            description = yaml.safe_load(f)
+        else:
+            import json
+            description = json.load(f)
+    return _register_map_numbers(description)
 
 class MemoryRegion(object):
     '''
     Provides an interface for reading and writing to meory from a given offset.
+
+    If a size is also given, the whole region is kept mapped and view()
+    returns a memoryview of it that can be used with struct.unpack_from or
+    numpy.frombuffer without a call into the extension per access.
+
+    With a shadow (a Shadow), readlw / writelw, readq / writeq and the
+    registers from registers() go through it, so registers marked cacheable
+    are not read back from the device and writes may wait for flush().
     '''
+    shadow = None
     def __init__(self, **kwargs):
         self.base = kwargs.get("base")
         if not self.base:
             raise Exception("You must specify a base address for the memory region.")
+        self.size = kwargs.get("size")
+        self.shadow = kwargs.get("shadow")
+        self.mapping = None
+        if self.size:
+            self.mapping = chwtest.Mapping(self.base, self.size)
+    def view(self):
+        if self.mapping is None:
+            raise Exception("The memory region was created without a size.")
+        return memoryview(self.mapping)
     def readlw(self, address):
+        if self.shadow is not None:
+            return self.shadow.read(self.base + address)
         return readlw(self.base + address)
-    def writelw(self, address):
-        writelw(self.base + address)
+    def writelw(self, address, value):
+        if self.shadow is not None:
+            self.shadow.write(self.base + address, value)
+        else:
+            writelw(self.base + address, value)
+    def flush(self):
+        if self.shadow is not None:
+            self.shadow.flush()
+    def readq(self, address):
+        if self.shadow is not None:
+            return self.shadow.read(self.base + address, 8)
+        return readq(self.base + address)
+    def writeq(self, address, value):
+        if self.shadow is not None:
+            self.shadow.write(self.base + address, value, 8)
+        else:
+            writeq(self.base + address, value)
+    def registers(self, description):
+        '''
+        Returns the registers of the region as a RegisterBlock compiled
+        from a register map, given as a dictionary or the path of a JSON or
+        YAML file (see load_register_map).  They are accessed through the
+        shadow of the region, if it has one.
+
+        >>> dev = PciBar("01:00.0", 0).registers("mydevice.json")
+        >>> dev.CTRL.ENABLE = 1
+        >>> dev.CTRL.modify(MODE=2, RESET=0)
+        >>> while not dev.STATUS.READY: pass
+        '''
+        if not isinstance(description, dict):
+            description = load_register_map(description)
+        return chwtest.RegisterBlock(self.base, description,
+                                     shadow=self.shadow)
+    def close(self):
+        if self.mapping is not None:
+            self.mapping.close()
+            self.mapping = None
+
+# Flags in the sysfs resource file of a PCI device (linux/ioport.h).
+IORESOURCE_IO = 0x100
+IORESOURCE_MEM = 0x200
+IORESOURCE_PREFETCH = 0x2000
+
+def pci_device_path(bdf, sysfs_root="/sys"):
+    '''
+    Returns the sysfs directory of the PCI device at bdf, which may leave out
+    the domain ("01:00.0" is "0000:01:00.0").
+    '''
+    if bdf.count(":") == 1:
+        bdf = "0000:" + bdf
+    return os.path.join(sysfs_root, "bus", "pci", "devices", bdf)
+
+def pci_resource(bdf, bar, sysfs_root="/sys"):
+    '''
+    Returns (start, size, flags) of a BAR of the PCI device at bdf, as listed
+    in its sysfs resource file.  size is 0 for unused BARs.
+    '''
+    with open(os.path.join(pci_device_path(bdf, sysfs_root), "resource")) as f:
+        lines = f.readlines()
+    if bar < 0 or bar >= len(lines):
+        raise ValueError("%s has no BAR %d" % (bdf, bar))
+    start, end, flags = [int(x, 16) for x in lines[bar].split()]
+    if not end:
+        return start, 0, flags
+    return start, end - start + 1, flags
+
+class PciBar(MemoryRegion):
+    '''
+    A memory BAR of a PCI device, mapped whole through its resourceN file in
+    sysfs.  The BAR is found by device address, so its physical address does
+    not need to be looked up by hand.
+
+    With wc=True a prefetchable BAR is mapped write-combined through
+    resourceN_wc, so that large writes reach the device as bursts instead of
+    single posted writes.  Reads and the single access functions still work,
+    but the order and size of writes to a write-combined BAR are not
+    guaranteed, so do not use it for registers.
+
+    sysfs_root may point at a copy of the sysfs tree, for example made of
+    regular files for testing.
+    '''
+    def __init__(self, bdf, bar, wc=False, sysfs_root="/sys", shadow=None):
+        start, size, flags = pci_resource(bdf, bar, sysfs_root)
+        if not size:
+            raise ValueError("BAR %d of %s is not in use" % (bar, bdf))
+        if not flags & IORESOURCE_MEM:
+            raise ValueError("BAR %d of %s is not a memory BAR" % (bar, bdf))
+        path = os.path.join(pci_device_path(bdf, sysfs_root), "resource%d" % bar)
+        if wc:
+            if not flags & IORESOURCE_PREFETCH:
+                raise ValueError("BAR %d of %s is not prefetchable" % (bar, bdf))
+            path += "_wc"
+        self.bdf = bdf
+        self.bar = bar
+        self.base = start
+        self.size = size
+        self.prefetchable = bool(flags & IORESOURCE_PREFETCH)
+        self.write_combining = wc
+        self.shadow = shadow
+        # The resource file starts at the page holding the BAR.
+        page_size = os.sysconf("SC_PAGE_SIZE")
+        self.mapping = chwtest.Mapping(start, size, path, start & (page_size - 1))
+
+IRQ_LEGACY = chwtest.IRQ_LEGACY
+IRQ_MSI = chwtest.IRQ_MSI
+IRQ_SOFTWARE = chwtest.IRQ_SOFTWARE
+
+class Interrupt(object):
+    '''
+    An interrupt of a PCI device delivered by khwtest, to wait on instead of
+    polling a status register.  Without a bdf the interrupt only fires from
+    trigger(), which is useful to test the waiting side or to measure the
+    wake up latency of the system.
+
+    The device must not be bound to a driver, and a device can have only
+    one MSI Interrupt open at a time.  A legacy interrupt stays
+    masked after it fired until unmask() is called, which should be after it
+    has been acknowledged in the device.
+
+    fileno() becomes readable when an interrupt arrived, so the object can
+    also be used with select, poll or an event loop.
+    '''
+    def __init__(self, bdf=None, vector=0, msi=False, eventfd=-1):
+        if bdf is None:
+            type = IRQ_SOFTWARE
+            domain = bus = devfn = 0
+        else:
+            type = IRQ_MSI if msi else IRQ_LEGACY
+            domain, bus, slot, function = [int(x, 16) for x in
+                re.split("[:.]", os.path.basename(pci_device_path(bdf)))]
+            devfn = (slot << 3) | function
+        self.bdf = bdf
+        self.fd, self.irq = chwtest.irq_request(type, domain, bus, devfn,
+                                                vector, eventfd)
+    def fileno(self):
+        return self.fd
+    def wait(self, timeout_ns=-1):
+        '''
+        Waits for interrupts since the last wait and returns (count,
+        timestamp_ns, latency_ns), where count is the total since the
+        interrupt was requested and latency_ns the time from the last
+        interrupt to the return.  Returns None on timeout.
+        '''
+        return chwtest.irq_wait(self.fd, timeout_ns)
+    def trigger(self):
+        chwtest.irq_trigger(self.fd)
+    def unmask(self):
+        chwtest.irq_unmask(self.fd)
+    def info(self):
+        return chwtest.irq_info(self.fd)
+    def close(self):
+        if self.fd >= 0:
+            os.close(self.fd)
+            self.fd = -1
     
     
 # vim: ai ts=4 sts=4 et sw=4
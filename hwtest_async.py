@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+# vim: ai ts=4 sts=4 et sw=4
+'''
+asyncio interface to hwtest, for supervising many devices from one event
+loop without a thread per device.
+
+Register waits are handed to a chwtest.Poller, which checks all of them
+from one native thread and signals an eventfd that is watched by the event
+loop, so waits complete in the order the registers become ready:
+
+    async def reset(dev):
+        hwtest.writelw(dev + CTRL, RESET)
+        await wait_for(dev + STATUS, READY, READY, timeout_ns=10**8)
+
+    async def main():
+        await asyncio.gather(*[reset(dev) for dev in devices])
+
+    asyncio.run(main())
+
+Requires Python 3.
+'''
+
+import asyncio
+import os
+import time
+
+import hwtest
+import chwtest
+
+class _Dispatcher(object):
+    '''
+    The poller of one event loop and the futures of its pending waits.
+    '''
+    def __init__(self, loop, interval_ns):
+        self.loop = loop
+        self.poller = chwtest.Poller(interval_ns)
+        self.futures = {}
+        loop.add_reader(self.poller.fileno(), self._completed)
+
+    def add(self, address, mask, value, timeout_ns, width):
+        id = self.poller.add(address, mask, value, timeout_ns, width)
+        future = self.loop.create_future()
+        self.futures[id] = future
+        return id, future
+
+    def cancel(self, id):
+        self.futures.pop(id, None)
+        self.poller.cancel(id)
+
+    def _completed(self):
+        for id, status, value in self.poller.completed():
+            future = self.futures.pop(id, None)
+            if future is None or future.done():
+                continue
+            if status == 0:
+                future.set_result(value)
+            elif status == 1:
+                future.set_exception(asyncio.TimeoutError(
+                    "Register did not match, last read 0x%x" % value))
+            else:
+                future.set_exception(OSError(-status, os.strerror(-status)))
+
+    def close(self):
+        self.loop.remove_reader(self.poller.fileno())
+        self.poller.close()
+        for future in self.futures.values():
+            future.cancel()
+        self.futures.clear()
+
+_dispatchers = {}
+
+def poller(interval_ns=10000):
+    '''
+    Returns the dispatcher of the running event loop, creating it on first
+    use.  interval_ns only takes effect when it is created; change it later
+    through poller().poller.interval_ns.
+    '''
+    loop = asyncio.get_running_loop()
+    dispatcher = _dispatchers.get(loop)
+    if dispatcher is None:
+        # Loops that were closed will never need theirs again.
+        for old in [l for l in _dispatchers if l.is_closed()]:
+            _dispatchers.pop(old).close()
+        dispatcher = _Dispatcher(loop, interval_ns)
+        _dispatchers[loop] = dispatcher
+    return dispatcher
+
+async def wait_for(address, mask, value, timeout_ns=-1, width=4):
+    '''
+    Waits until the register at address has (register & mask) ==
+    (value & mask) and returns the value read.  Raises asyncio.TimeoutError
+    after timeout_ns; a negative timeout_ns waits forever.  Cancelling the
+    task stops the wait.
+    '''
+    dispatcher = poller()
+    id, future = dispatcher.add(address, mask, value, timeout_ns, width)
+    try:
+        return await future
+    except asyncio.CancelledError:
+        dispatcher.cancel(id)
+        raise
+
+async def wait_interrupt(interrupt, timeout_ns=-1):
+    '''
+    Waits for an hwtest.Interrupt without blocking the event loop and
+    returns what Interrupt.wait() does.
+    '''
+    loop = asyncio.get_running_loop()
+    future = loop.create_future()
+    fd = interrupt.fileno()
+    loop.add_reader(fd, lambda: future.done() or future.set_result(None))
+    try:
+        if timeout_ns < 0:
+            await future
+        else:
+            await asyncio.wait_for(future, timeout_ns / 1e9)
+    finally:
+        loop.remove_reader(fd)
+    return interrupt.wait(0)
+
+async def dma_complete(status_address, mask, value, timeout_ns=-1, width=4,
+                       interrupt=None):
+    '''
+    Waits for the device to write a completion status into a DMA buffer,
+    for example the done bit of a descriptor, and returns the status word.
+    With an interrupt, the status is only checked after the interrupt
+    arrived instead of being polled all along.  timeout_ns bounds the whole
+    wait, interrupt included.
+    '''
+    if interrupt is not None:
+        start = time.monotonic()
+        await wait_interrupt(interrupt, timeout_ns)
+        if timeout_ns >= 0:
+            elapsed_ns = int((time.monotonic() - start) * 1e9)
+            timeout_ns = max(timeout_ns - elapsed_ns, 0)
+    return await wait_for(status_address, mask, value, timeout_ns, width)
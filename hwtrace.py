@@ -0,0 +1,134 @@
+#!/usr/bin/env python
+#
+# Copyright (c) 2009-2014, Shaun Ruffell <sruffell@sruffell.net>
+# All rights reserved.
+# 
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+# 
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer. 
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+'''
+Decodes the binary access traces written by hwtest.trace_dump() into text
+or CSV.
+
+    python hwtrace.py trace.bin
+    python hwtrace.py --csv trace.bin > trace.csv
+'''
+
+import sys
+import struct
+import argparse
+
+HEADER = struct.Struct("=8sIIQQQQQQ")
+ENTRY = struct.Struct("=QQQIBBH")
+MAGIC = b"HWTRACE\0"
+
+# Flags in each entry, see chwtest.c.
+TRACE_WRITE = 0x1
+TRACE_PORT = 0x2
+TRACE_BLOCK = 0x4
+TRACE_POLL = 0x8
+
+class TraceError(Exception):
+    pass
+
+def read_trace(f):
+    '''
+    Reads a trace file and returns (header, entries).  header is a dict and
+    entries a list of dicts sorted by time, with the time in nanoseconds
+    since tracing was started.
+    '''
+    data = f.read(HEADER.size)
+    if len(data) != HEADER.size:
+        raise TraceError("File is too short for a trace header")
+    (magic, version, entry_size, start_counter, start_ns, end_counter, end_ns,
+     count, dropped) = HEADER.unpack(data)
+    if magic != MAGIC:
+        raise TraceError("Not a hwtest trace file")
+    if version != 1 or entry_size != ENTRY.size:
+        raise TraceError("Unsupported trace version %d" % version)
+
+    # Timestamps are cycle counts; convert them with the two samples taken
+    # when tracing started and when the trace was dumped.
+    if end_counter != start_counter:
+        scale = float(end_ns - start_ns) / (end_counter - start_counter)
+    else:
+        scale = 1.0
+
+    entries = []
+    for i in range(count):
+        data = f.read(ENTRY.size)
+        if len(data) != ENTRY.size:
+            raise TraceError("Trace is truncated after %d entries" % i)
+        timestamp, address, value, tid, width, flags, reserved = ENTRY.unpack(data)
+        entries.append({
+            "time_ns": (timestamp - start_counter) * scale,
+            "tid": tid,
+            "op": describe(flags),
+            "space": "port" if flags & TRACE_PORT else "mem",
+            "address": address,
+            "width": width,
+            "value": value,
+        })
+    entries.sort(key=lambda e: e["time_ns"])
+    header = {"count": count, "dropped": dropped,
+              "duration_ns": end_ns - start_ns}
+    return header, entries
+
+def describe(flags):
+    op = "write" if flags & TRACE_WRITE else "read"
+    if flags & TRACE_BLOCK:
+        op += "_block"
+    if flags & TRACE_POLL:
+        op = "poll"
+    return op
+
+def format_text(entry):
+    if entry["op"].endswith("_block"):
+        value = "%d bytes" % entry["value"]
+    else:
+        value = "0x%0*x" % (2 * entry["width"], entry["value"])
+    return "%14.3f us %7d %-11s %-4s 0x%08x %d %s" % (
+        entry["time_ns"] / 1000.0, entry["tid"], entry["op"], entry["space"],
+        entry["address"], entry["width"], value)
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode a hwtest access trace.")
+    parser.add_argument("trace", help="file written by trace_dump()")
+    parser.add_argument("--csv", action="store_true", help="write CSV instead of text")
+    args = parser.parse_args()
+
+    with open(args.trace, "rb") as f:
+        header, entries = read_trace(f)
+
+    out = sys.stdout
+    if args.csv:
+        out.write("time_ns,tid,op,space,address,width,value\n")
+        for e in entries:
+            out.write("%.1f,%d,%s,%s,0x%x,%d,0x%x\n" % (
+                e["time_ns"], e["tid"], e["op"], e["space"], e["address"],
+                e["width"], e["value"]))
+    else:
+        for e in entries:
+            out.write(format_text(e) + "\n")
+        out.write("# %d entries, %d dropped, %.3f ms\n" % (
+            header["count"], header["dropped"], header["duration_ns"] / 1e6))
+
+if __name__ == "__main__":
+    main()
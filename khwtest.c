@@ -31,29 +31,467 @@
 #include <linux/pci.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/delay.h>
+#include <linux/io.h>
+#include <linux/sched.h>
+#include <linux/idr.h>
+#include <linux/rbtree.h>
+#include <linux/anon_inodes.h>
+#include <linux/eventfd.h>
+#include <linux/interrupt.h>
+#include <linux/poll.h>
+#include <linux/file.h>
+#include <linux/version.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
 #include "khwtest.h"
 
 static int debug = 0;
 const int khwtest_major = 0;
 
+/* Devices that DMA memory is allocated against, one per supported mask. */
+static struct platform_device *khwtest_dma32;
+static struct platform_device *khwtest_dma64;
+
+/*
+ * Every allocation is indexed twice: by handle in an idr for frees, and by
+ * bus address in an rbtree for mmap and lookups.
+ */
 struct allocation {
-	struct list_head node;
-	unsigned int size;
+	struct rb_node node;
+	struct list_head pool_node;
+	int handle;
+	int map_count;
+	unsigned int dma_bits;
+	struct device *dev;
+	size_t size;
 	void *memory;
 	dma_addr_t dma_handle;
 };
 
+/*
+ * Freed buffers are kept in a per-file pool and handed out again by later
+ * allocations of the same size class and DMA mask, without going back to
+ * the DMA API.  The size classes are the page orders the DMA API allocates
+ * in anyway, so rounding up to a class does not cost any extra memory.
+ *
+ * NOTE: Recycled buffers are not cleared.
+ */
+#define KHWTEST_POOL_ORDERS 11
+
+static int pool_reserve = 0;
+static int pool_max = 64;
+
+struct khwtest_pool {
+	struct list_head free[KHWTEST_POOL_ORDERS];
+	unsigned int cached[KHWTEST_POOL_ORDERS];
+};
+
+/*
+ * Statistics in debugfs, under khwtest/ wherever debugfs is mounted.  Every
+ * open file counts its own calls, and the global counters add up all files,
+ * including the ones that were closed since the module was loaded.  The
+ * global counters are kept per CPU, so that files used from different CPUs
+ * do not contend on them, and are summed when they are shown.
+ * Latencies are log2 histograms of nanoseconds: bucket n counts the calls
+ * that took from 2^(n-1) up to 2^n ns.
+ */
+#define KHWTEST_IOCTL_NR 16
+#define KHWTEST_HIST_BUCKETS 32
+
+struct khwtest_counters {
+	atomic64_t reads;
+	atomic64_t read_bytes;
+	atomic64_t writes;
+	atomic64_t write_bytes;
+	atomic64_t ioctls[KHWTEST_IOCTL_NR];	/* By command number, 0 for unknown. */
+};
+
+/* The same counters as plain values, for one CPU or a snapshot. */
+struct khwtest_counts {
+	u64 reads;
+	u64 read_bytes;
+	u64 writes;
+	u64 write_bytes;
+	u64 ioctls[KHWTEST_IOCTL_NR];
+};
+
+struct khwtest_histogram {
+	atomic64_t buckets[KHWTEST_HIST_BUCKETS];
+};
+
+static unsigned int stats_large = PAGE_SIZE;
+
+static struct dentry *khwtest_debugfs;
+static DEFINE_PER_CPU(struct khwtest_counts, khwtest_counts);
+static struct khwtest_histogram khwtest_alloc_latency;
+static struct khwtest_histogram khwtest_rw_latency;
+
+/* DMA memory allocated by all files.  khwtest_dma_lock nests inside
+ * pvt->lock. */
+static DEFINE_SPINLOCK(khwtest_dma_lock);
+static struct {
+	u64 live;
+	u64 live_bytes;
+	u64 live_high_water;
+	u64 live_bytes_high_water;
+} khwtest_dma;
+
+/* Every open file, so that debugfs can show who holds what. */
+static LIST_HEAD(khwtest_files);
+static DEFINE_MUTEX(khwtest_files_lock);
+
 struct khwtest_pvt {
 	spinlock_t lock;
-	struct list_head allocations;
+	struct idr handles;
+	struct rb_root allocations;
+	struct khwtest_pool pools[2];
+	struct khwtest_pool_stats stats;
+	struct khwtest_counters counters;
+	struct list_head node;
+	pid_t pid;
+	char comm[TASK_COMM_LEN];
 };
 
+#define khwtest_count(pvt, counter, n) do { \
+		atomic64_add((n), &(pvt)->counters.counter); \
+		this_cpu_add(khwtest_counts.counter, (n)); \
+	} while (0)
+
+static void khwtest_count_ioctl(struct khwtest_pvt *pvt, unsigned int cmd)
+{
+	unsigned int nr = _IOC_NR(cmd);
+
+	if (_IOC_TYPE(cmd) != KHWTEST_CODE || nr >= KHWTEST_IOCTL_NR)
+		nr = 0;
+	khwtest_count(pvt, ioctls[nr], 1);
+}
+
+static void khwtest_count_latency(struct khwtest_histogram *hist, u64 start_ns)
+{
+	u64 ns = ktime_get_ns() - start_ns;
+
+	atomic64_inc(&hist->buckets[min(fls64(ns), KHWTEST_HIST_BUCKETS - 1)]);
+}
+
+static void khwtest_count_dma(bool allocated, size_t size)
+{
+	spin_lock(&khwtest_dma_lock);
+	if (allocated) {
+		++khwtest_dma.live;
+		khwtest_dma.live_bytes += size;
+		khwtest_dma.live_high_water = max(khwtest_dma.live_high_water,
+						  khwtest_dma.live);
+		khwtest_dma.live_bytes_high_water =
+			max(khwtest_dma.live_bytes_high_water,
+			    khwtest_dma.live_bytes);
+	} else {
+		--khwtest_dma.live;
+		khwtest_dma.live_bytes -= size;
+	}
+	spin_unlock(&khwtest_dma_lock);
+}
+
 static void khwtest_init_pvt(struct khwtest_pvt *pvt) 
 {
-	INIT_LIST_HEAD(&pvt->allocations);
+	int i, order;
+
+	idr_init(&pvt->handles);
+	pvt->allocations = RB_ROOT;
+	for (i = 0; i < ARRAY_SIZE(pvt->pools); ++i) {
+		for (order = 0; order < KHWTEST_POOL_ORDERS; ++order)
+			INIT_LIST_HEAD(&pvt->pools[i].free[order]);
+	}
+	memset(&pvt->stats, 0, sizeof(pvt->stats));
+	memset(&pvt->counters, 0, sizeof(pvt->counters));
+	pvt->pid = task_tgid_nr(current);
+	get_task_comm(pvt->comm, current);
 	spin_lock_init(&pvt->lock);
 }
 
+static struct device *khwtest_dma_device(unsigned int dma_bits)
+{
+	switch (dma_bits) {
+	case 32:
+		return &khwtest_dma32->dev;
+	case 64:
+		return &khwtest_dma64->dev;
+	default:
+		return NULL;
+	}
+}
+
+static struct khwtest_pool *
+khwtest_pool(struct khwtest_pvt *pvt, unsigned int dma_bits)
+{
+	return &pvt->pools[dma_bits == 64];
+}
+
+/* Must be called with pvt->lock held. */
+static struct allocation *
+khwtest_find_allocation(struct khwtest_pvt *pvt, u64 address)
+{
+	struct rb_node *n = pvt->allocations.rb_node;
+
+	while (n) {
+		struct allocation *alloc = rb_entry(n, struct allocation, node);
+
+		if (address < alloc->dma_handle)
+			n = n->rb_left;
+		else if (address >= (u64)alloc->dma_handle + alloc->size)
+			n = n->rb_right;
+		else
+			return alloc;
+	}
+	return NULL;
+}
+
+/* Must be called with pvt->lock held. */
+static void
+khwtest_insert_allocation(struct khwtest_pvt *pvt, struct allocation *alloc)
+{
+	struct rb_node **link = &pvt->allocations.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*link) {
+		struct allocation *p = rb_entry(*link, struct allocation, node);
+
+		parent = *link;
+		if (alloc->dma_handle < p->dma_handle)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&alloc->node, parent, link);
+	rb_insert_color(&alloc->node, &pvt->allocations);
+}
+
+static struct allocation *khwtest_new_allocation(size_t size, unsigned int dma_bits)
+{
+	struct allocation *alloc;
+
+	if (!(alloc = kzalloc(sizeof(*alloc), GFP_KERNEL)))
+		return NULL;
+	alloc->dma_bits = dma_bits;
+	alloc->dev = khwtest_dma_device(dma_bits);
+	alloc->size = size;
+	alloc->memory = dma_alloc_coherent(alloc->dev, alloc->size,
+					   &alloc->dma_handle, GFP_KERNEL);
+	if (!alloc->memory) {
+		printk(KERN_ERR "%s: Failed to allocate consistent memory.\n", THIS_MODULE->name);
+		kfree(alloc);
+		return NULL;
+	}
+	return alloc;
+}
+
+static void khwtest_release_allocation(struct allocation *alloc)
+{
+	if (debug) {
+		printk(KERN_DEBUG "%s: Freeing memory at 0x%08llx.\n", 
+		       THIS_MODULE->name, (unsigned long long)alloc->dma_handle);
+	}
+	dma_free_coherent(alloc->dev, alloc->size, alloc->memory, alloc->dma_handle);
+	kfree(alloc);
+}
+
+/* Returns the pool size class for an allocation, or -1 if it is too big. */
+static int khwtest_pool_order(size_t size)
+{
+	int order = get_order(size);
+
+	return (order < KHWTEST_POOL_ORDERS) ? order : -1;
+}
+
+/*
+ * Takes a buffer from the pool, or returns NULL on a miss.  Must be called
+ * with pvt->lock held.
+ */
+static struct allocation *
+khwtest_pool_get(struct khwtest_pvt *pvt, unsigned int dma_bits, int order)
+{
+	struct khwtest_pool *pool = khwtest_pool(pvt, dma_bits);
+	struct allocation *alloc;
+
+	if (order < 0 || list_empty(&pool->free[order])) {
+		++pvt->stats.misses;
+		return NULL;
+	}
+	alloc = list_first_entry(&pool->free[order], struct allocation, pool_node);
+	list_del(&alloc->pool_node);
+	--pool->cached[order];
+	--pvt->stats.cached;
+	pvt->stats.cached_bytes -= alloc->size;
+	++pvt->stats.hits;
+	return alloc;
+}
+
+/*
+ * Returns a buffer to the pool.  Returns false if the pool for its size
+ * class is full and the caller has to release it.  Must be called with
+ * pvt->lock held.
+ */
+static bool khwtest_pool_put(struct khwtest_pvt *pvt, struct allocation *alloc)
+{
+	struct khwtest_pool *pool = khwtest_pool(pvt, alloc->dma_bits);
+	int order = khwtest_pool_order(alloc->size);
+
+	if (order < 0 || pool->cached[order] >= pool_max) {
+		++pvt->stats.released;
+		return false;
+	}
+	list_add(&alloc->pool_node, &pool->free[order]);
+	++pool->cached[order];
+	++pvt->stats.cached;
+	pvt->stats.cached_bytes += alloc->size;
+	++pvt->stats.recycled;
+	return true;
+}
+
+/*
+ * Fills the pool for a size class with up to count newly allocated
+ * buffers, no more than the pool_max it would keep anyway.
+ */
+static int
+khwtest_pool_reserve(struct khwtest_pvt *pvt, size_t size,
+		     unsigned int dma_bits, unsigned int count)
+{
+	struct khwtest_pool *pool = khwtest_pool(pvt, dma_bits);
+	struct allocation *alloc;
+	int order = khwtest_pool_order(PAGE_ALIGN(size));
+	unsigned int room;
+
+	if (order < 0 || !size || !khwtest_dma_device(dma_bits))
+		return -EINVAL;
+
+	spin_lock(&pvt->lock);
+	room = 0;
+	if (pool_max > 0 && pool->cached[order] < (unsigned int)pool_max)
+		room = pool_max - pool->cached[order];
+	spin_unlock(&pvt->lock);
+	count = min(count, room);
+
+	while (count--) {
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		alloc = khwtest_new_allocation(PAGE_SIZE << order, dma_bits);
+		if (!alloc)
+			return -ENOMEM;
+		spin_lock(&pvt->lock);
+		list_add(&alloc->pool_node, &pool->free[order]);
+		++pool->cached[order];
+		++pvt->stats.cached;
+		pvt->stats.cached_bytes += alloc->size;
+		spin_unlock(&pvt->lock);
+	}
+	return 0;
+}
+
+/*
+ * Allocates size bytes of coherent memory for a device limited to dma_bits
+ * of address and adds it to the file.  The DMA API aligns allocations to
+ * the page order of their size, so asking for at least align bytes gives
+ * the requested alignment.
+ */
+static struct allocation *
+khwtest_alloc_dma(struct khwtest_pvt *pvt, size_t size, size_t align,
+		  unsigned int dma_bits)
+{
+	struct allocation *alloc;
+	u64 start_ns = ktime_get_ns();
+	int order;
+	int handle;
+
+	if (align & (align - 1))
+		return ERR_PTR(-EINVAL);
+	if (!size || !khwtest_dma_device(dma_bits))
+		return ERR_PTR(-EINVAL);
+
+	size = PAGE_ALIGN(max(size, align));
+	order = khwtest_pool_order(size);
+	if (order >= 0)
+		size = PAGE_SIZE << order;
+
+	spin_lock(&pvt->lock);
+	alloc = khwtest_pool_get(pvt, dma_bits, order);
+	spin_unlock(&pvt->lock);
+	if (!alloc) {
+		alloc = khwtest_new_allocation(size, dma_bits);
+		if (!alloc)
+			return ERR_PTR(-ENOMEM);
+	}
+
+	idr_preload(GFP_KERNEL);
+	spin_lock(&pvt->lock);
+	handle = idr_alloc(&pvt->handles, alloc, 1, 0, GFP_NOWAIT);
+	if (handle > 0) {
+		alloc->handle = handle;
+		khwtest_insert_allocation(pvt, alloc);
+		++pvt->stats.live;
+		pvt->stats.live_bytes += alloc->size;
+		pvt->stats.live_high_water = max(pvt->stats.live_high_water,
+						 pvt->stats.live);
+		pvt->stats.live_bytes_high_water =
+			max(pvt->stats.live_bytes_high_water,
+			    pvt->stats.live_bytes);
+		/* Before the handle can be freed by another thread. */
+		khwtest_count_dma(true, alloc->size);
+	} else if (!khwtest_pool_put(pvt, alloc)) {
+		spin_unlock(&pvt->lock);
+		idr_preload_end();
+		khwtest_release_allocation(alloc);
+		return ERR_PTR(handle);
+	}
+	spin_unlock(&pvt->lock);
+	idr_preload_end();
+
+	if (handle < 0)
+		return ERR_PTR(handle);
+
+	khwtest_count_latency(&khwtest_alloc_latency, start_ns);
+	if (debug) {
+		printk(KERN_DEBUG "%s: Allocating %zu bytes at 0x%08llx\n",
+		       THIS_MODULE->name, alloc->size,
+		       (unsigned long long)alloc->dma_handle);
+	}
+	return alloc;
+}
+
+static int khwtest_free_dma(struct khwtest_pvt *pvt, int handle)
+{
+	struct allocation *alloc;
+	size_t size;
+	bool pooled;
+
+	spin_lock(&pvt->lock);
+	alloc = idr_find(&pvt->handles, handle);
+	if (!alloc) {
+		spin_unlock(&pvt->lock);
+		return -ENOENT;
+	}
+	if (alloc->map_count) {
+		/* Userspace still has it mapped. */
+		spin_unlock(&pvt->lock);
+		return -EBUSY;
+	}
+	idr_remove(&pvt->handles, handle);
+	rb_erase(&alloc->node, &pvt->allocations);
+	--pvt->stats.live;
+	pvt->stats.live_bytes -= alloc->size;
+	size = alloc->size;
+	pooled = khwtest_pool_put(pvt, alloc);
+	spin_unlock(&pvt->lock);
+
+	khwtest_count_dma(false, size);
+	if (!pooled)
+		khwtest_release_allocation(alloc);
+	return 0;
+}
+
 #ifndef ARCH_HAS_VALID_PHYS_ADDR_RANGE
 static inline int valid_phys_addr_range(unsigned long addr, size_t count)
 {
@@ -69,6 +507,521 @@ static inline int valid_mmap_phys_addr_range(unsigned long pfn, size_t size)
 }
 #endif
 
+/*
+ * Batches of register operations.  Operations are copied in from userspace
+ * in chunks and run back to back without returning to userspace.  System
+ * RAM is accessed through the kernel mapping, everything else through an
+ * ioremap of the page that is kept until the batch touches another page.
+ */
+#define KHWTEST_BATCH_CHUNK 128
+
+struct khwtest_batch_ctx {
+	u64 page;
+	void __iomem *io;
+};
+
+static bool khwtest_is_ram(u64 address)
+{
+	unsigned long pfn = address >> PAGE_SHIFT;
+
+	return pfn_valid(pfn) && !PageReserved(pfn_to_page(pfn));
+}
+
+static void khwtest_batch_unmap(struct khwtest_batch_ctx *ctx)
+{
+	if (ctx->io) {
+		iounmap(ctx->io);
+		ctx->io = NULL;
+	}
+}
+
+static void __iomem *
+khwtest_batch_ioremap(struct khwtest_batch_ctx *ctx, u64 address)
+{
+	u64 page = address & ~((u64)PAGE_SIZE - 1);
+
+	if (!ctx->io || ctx->page != page) {
+		khwtest_batch_unmap(ctx);
+		ctx->io = ioremap(page, PAGE_SIZE);
+		if (!ctx->io)
+			return NULL;
+		ctx->page = page;
+	}
+	return ctx->io + (address - page);
+}
+
+static int
+khwtest_op_read(struct khwtest_batch_ctx *ctx, const struct khwtest_op *op,
+		u64 *value)
+{
+	void __iomem *io;
+	void *ptr;
+
+	if (khwtest_is_ram(op->address)) {
+		ptr = __va(op->address);
+		switch (op->width) {
+		case 1: *value = *(volatile u8 *)ptr; break;
+		case 2: *value = *(volatile u16 *)ptr; break;
+		case 4: *value = *(volatile u32 *)ptr; break;
+		case 8: *value = *(volatile u64 *)ptr; break;
+		}
+		return 0;
+	}
+
+	io = khwtest_batch_ioremap(ctx, op->address);
+	if (!io)
+		return -ENOMEM;
+	switch (op->width) {
+	case 1: *value = readb(io); break;
+	case 2: *value = readw(io); break;
+	case 4: *value = readl(io); break;
+#ifdef readq
+	case 8: *value = readq(io); break;
+#endif
+	default: return -EINVAL;
+	}
+	return 0;
+}
+
+static int
+khwtest_op_write(struct khwtest_batch_ctx *ctx, const struct khwtest_op *op,
+		 u64 value)
+{
+	void __iomem *io;
+	void *ptr;
+
+	if (khwtest_is_ram(op->address)) {
+		ptr = __va(op->address);
+		switch (op->width) {
+		case 1: *(volatile u8 *)ptr = value; break;
+		case 2: *(volatile u16 *)ptr = value; break;
+		case 4: *(volatile u32 *)ptr = value; break;
+		case 8: *(volatile u64 *)ptr = value; break;
+		}
+		return 0;
+	}
+
+	io = khwtest_batch_ioremap(ctx, op->address);
+	if (!io)
+		return -ENOMEM;
+	switch (op->width) {
+	case 1: writeb(value, io); break;
+	case 2: writew(value, io); break;
+	case 4: writel(value, io); break;
+#ifdef writeq
+	case 8: writeq(value, io); break;
+#endif
+	default: return -EINVAL;
+	}
+	return 0;
+}
+
+static void khwtest_delay_ns(u64 ns)
+{
+	/* Short delays spin so that the spacing between accesses is exact. */
+	if (ns < 20000)
+		ndelay(ns);
+	else
+		usleep_range(div_u64(ns, 1000), div_u64(ns, 1000) + 1);
+}
+
+static int khwtest_op_poll(struct khwtest_batch_ctx *ctx, struct khwtest_op *op)
+{
+	s64 deadline = ktime_to_ns(ktime_get()) + op->timeout_ns;
+	unsigned int loops = 0;
+	u64 value;
+	int res;
+
+	for (;;) {
+		res = khwtest_op_read(ctx, op, &value);
+		if (res)
+			return res;
+		if ((value & op->mask) == (op->value & op->mask))
+			break;
+		if (ktime_to_ns(ktime_get()) >= deadline) {
+			op->value = value;
+			return -ETIMEDOUT;
+		}
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		if (!(++loops % 1024))
+			cond_resched();
+		cpu_relax();
+	}
+	op->value = value;
+	return 0;
+}
+
+static int khwtest_run_op(struct khwtest_batch_ctx *ctx, struct khwtest_op *op)
+{
+	u64 value;
+	int res;
+
+	if (op->op != KHWTEST_OP_DELAY) {
+		if (op->width != 1 && op->width != 2 &&
+		    op->width != 4 && op->width != 8)
+			return -EINVAL;
+		if (op->address & (op->width - 1))
+			return -EINVAL;
+	}
+
+	switch (op->op) {
+	case KHWTEST_OP_READ:
+		res = khwtest_op_read(ctx, op, &value);
+		if (!res)
+			op->value = value;
+		return res;
+	case KHWTEST_OP_WRITE:
+		return khwtest_op_write(ctx, op, op->value);
+	case KHWTEST_OP_RMW:
+		res = khwtest_op_read(ctx, op, &value);
+		if (res)
+			return res;
+		res = khwtest_op_write(ctx, op, (value & ~op->mask) |
+					       (op->value & op->mask));
+		if (!res)
+			op->value = value;
+		return res;
+	case KHWTEST_OP_DELAY:
+		khwtest_delay_ns(op->value);
+		return 0;
+	case KHWTEST_OP_POLL:
+		return khwtest_op_poll(ctx, op);
+	default:
+		return -EINVAL;
+	}
+}
+
+static long khwtest_execute_batch(struct khwtest_batch __user *ubatch)
+{
+	struct khwtest_batch batch;
+	struct khwtest_batch_ctx ctx = { 0 };
+	struct khwtest_op __user *uops;
+	struct khwtest_op *ops;
+	u32 done = 0;
+	int res = 0;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	uops = (struct khwtest_op __user *)(unsigned long)batch.ops;
+
+	ops = kmalloc(KHWTEST_BATCH_CHUNK * sizeof(*ops), GFP_KERNEL);
+	if (!ops)
+		return -ENOMEM;
+
+	while (done < batch.count && !res) {
+		u32 count = min_t(u32, batch.count - done, KHWTEST_BATCH_CHUNK);
+		u32 i;
+
+		if (copy_from_user(ops, uops + done, count * sizeof(*ops))) {
+			res = -EFAULT;
+			break;
+		}
+		for (i = 0; i < count; ++i) {
+			res = khwtest_run_op(&ctx, &ops[i]);
+			if (res)
+				break;
+		}
+		/* The failing operation is copied back too, for polls that
+		 * timed out it holds the last value read. */
+		if (copy_to_user(uops + done, ops, min(i + 1, count) * sizeof(*ops)))
+			res = -EFAULT;
+		done += i;
+	}
+
+	khwtest_batch_unmap(&ctx);
+	kfree(ops);
+	if (put_user(done, &ubatch->completed))
+		return -EFAULT;
+	return res;
+}
+
+/*
+ * Interrupts are delivered to userspace through a file per request, which
+ * can be passed to poll/select/epoll instead of polling a status register.
+ */
+struct khwtest_irq {
+	struct pci_dev *pdev;
+	u32 type;
+	int irq;
+	atomic64_t count;
+	atomic64_t unhandled;
+	u64 timestamp_ns;
+	u64 seen;		/* Count returned by the last read. */
+	wait_queue_head_t wait;
+	struct eventfd_ctx *eventfd;
+	bool vectors;		/* MSI vectors were allocated for this request. */
+	bool master;		/* Bus mastering was enabled for MSI writes. */
+};
+
+static void khwtest_irq_fire(struct khwtest_irq *kirq)
+{
+	WRITE_ONCE(kirq->timestamp_ns, ktime_get_ns());
+	smp_wmb();
+	atomic64_inc(&kirq->count);
+	wake_up_interruptible(&kirq->wait);
+	if (kirq->eventfd) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+		eventfd_signal(kirq->eventfd);
+#else
+		eventfd_signal(kirq->eventfd, 1);
+#endif
+	}
+}
+
+static irqreturn_t khwtest_irq_handler(int irq, void *data)
+{
+	struct khwtest_irq *kirq = data;
+
+	/* The line may be shared, and the INTx disable bit is the only
+	 * generic way to tell whether it was this device and to silence it
+	 * until the test acknowledged it. */
+	if (kirq->type == KHWTEST_IRQ_LEGACY &&
+	    !pci_check_and_mask_intx(kirq->pdev)) {
+		atomic64_inc(&kirq->unhandled);
+		return IRQ_NONE;
+	}
+	khwtest_irq_fire(kirq);
+	return IRQ_HANDLED;
+}
+
+static void khwtest_irq_free(struct khwtest_irq *kirq)
+{
+	if (kirq->irq) {
+		free_irq(kirq->irq, kirq);
+		/* Do not leave the device with INTx masked by the handler. */
+		if (kirq->type == KHWTEST_IRQ_LEGACY)
+			pci_intx(kirq->pdev, 1);
+	}
+	if (kirq->pdev) {
+		if (kirq->vectors)
+			pci_free_irq_vectors(kirq->pdev);
+		if (kirq->master)
+			pci_clear_master(kirq->pdev);
+		pci_disable_device(kirq->pdev);
+		pci_dev_put(kirq->pdev);
+	}
+	if (kirq->eventfd)
+		eventfd_ctx_put(kirq->eventfd);
+	kfree(kirq);
+}
+
+static u64 khwtest_irq_count(struct khwtest_irq *kirq)
+{
+	u64 count = atomic64_read(&kirq->count);
+
+	smp_rmb();
+	return count;
+}
+
+static ssize_t khwtest_irq_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct khwtest_irq *kirq = file->private_data;
+	struct khwtest_irq_event event;
+	int res;
+
+	if (count < sizeof(event))
+		return -EINVAL;
+	if (file->f_flags & O_NONBLOCK) {
+		if (khwtest_irq_count(kirq) == kirq->seen)
+			return -EAGAIN;
+	} else {
+		res = wait_event_interruptible(kirq->wait,
+				khwtest_irq_count(kirq) != kirq->seen);
+		if (res)
+			return res;
+	}
+	event.count = khwtest_irq_count(kirq);
+	event.timestamp_ns = READ_ONCE(kirq->timestamp_ns);
+	kirq->seen = event.count;
+	if (copy_to_user(buf, &event, sizeof(event)))
+		return -EFAULT;
+	return sizeof(event);
+}
+
+static unsigned int khwtest_irq_poll(struct file *file, poll_table *wait)
+{
+	struct khwtest_irq *kirq = file->private_data;
+
+	poll_wait(file, &kirq->wait, wait);
+	if (khwtest_irq_count(kirq) != kirq->seen)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static long
+khwtest_irq_ioctl(struct file *file, unsigned int cmd, unsigned long data)
+{
+	struct khwtest_irq *kirq = file->private_data;
+	struct khwtest_irq_info info;
+
+	switch (cmd) {
+	case KHWTEST_IRQ_TRIGGER:
+		khwtest_irq_fire(kirq);
+		return 0;
+	case KHWTEST_IRQ_UNMASK:
+		if (kirq->type == KHWTEST_IRQ_LEGACY)
+			pci_check_and_unmask_intx(kirq->pdev);
+		return 0;
+	case KHWTEST_IRQ_INFO:
+		info.count = khwtest_irq_count(kirq);
+		info.timestamp_ns = READ_ONCE(kirq->timestamp_ns);
+		info.unhandled = atomic64_read(&kirq->unhandled);
+		info.irq = kirq->irq;
+		info.type = kirq->type;
+		if (copy_to_user((void __user *)data, &info, sizeof(info)))
+			return -EFAULT;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int khwtest_irq_release(struct inode *inode, struct file *file)
+{
+	khwtest_irq_free(file->private_data);
+	return 0;
+}
+
+static const struct file_operations khwtest_irq_fops = {
+	.owner = THIS_MODULE,
+	.release = khwtest_irq_release,
+	.read = khwtest_irq_read,
+	.poll = khwtest_irq_poll,
+	.unlocked_ioctl = khwtest_irq_ioctl,
+	.llseek = noop_llseek,
+};
+
+static int khwtest_irq_setup(struct khwtest_irq *kirq,
+			     struct khwtest_irq_request *req)
+{
+	unsigned long flags = 0;
+	int nvec;
+	int irq;
+	int res;
+
+	kirq->pdev = pci_get_domain_bus_and_slot(req->domain, req->bus,
+						 req->devfn);
+	if (!kirq->pdev)
+		return -ENODEV;
+	/* The interrupt and the MSI setup belong to a bound driver. */
+	if (kirq->pdev->dev.driver) {
+		pci_dev_put(kirq->pdev);
+		kirq->pdev = NULL;
+		return -EBUSY;
+	}
+	res = pci_enable_device(kirq->pdev);
+	if (res) {
+		pci_dev_put(kirq->pdev);
+		kirq->pdev = NULL;
+		return res;
+	}
+
+	if (req->type == KHWTEST_IRQ_MSI) {
+		/* The vectors of a device are allocated all at once, so only
+		 * one request can own them. */
+		if (kirq->pdev->msi_enabled || kirq->pdev->msix_enabled)
+			return -EBUSY;
+		/* Either kind may be allocated, so the vector has to fit the
+		 * larger of the two.  This also keeps vector + 1 from
+		 * wrapping. */
+		nvec = max(pci_msix_vec_count(kirq->pdev),
+			   pci_msi_vec_count(kirq->pdev));
+		if (nvec <= 0)
+			return -EOPNOTSUPP;
+		if (req->vector >= (unsigned int)nvec)
+			return -EINVAL;
+		res = pci_alloc_irq_vectors(kirq->pdev, req->vector + 1,
+					    req->vector + 1,
+					    PCI_IRQ_MSI | PCI_IRQ_MSIX);
+		if (res < 0)
+			return res;
+		kirq->vectors = true;
+		irq = pci_irq_vector(kirq->pdev, req->vector);
+		if (irq < 0)
+			return irq;
+		/* MSIs are memory writes by the device. */
+		pci_set_master(kirq->pdev);
+		kirq->master = true;
+	} else {
+		if (!kirq->pdev->irq)
+			return -ENODEV;
+		if (!pci_intx_mask_supported(kirq->pdev))
+			return -EOPNOTSUPP;
+		irq = kirq->pdev->irq;
+		flags = IRQF_SHARED;
+	}
+
+	res = request_irq(irq, khwtest_irq_handler, flags, "khwtest", kirq);
+	if (res)
+		return res;
+	kirq->irq = irq;
+	return 0;
+}
+
+static long khwtest_irq_request(struct khwtest_irq_request __user *ureq)
+{
+	struct khwtest_irq_request req;
+	struct khwtest_irq *kirq;
+	struct file *file;
+	int res;
+	int fd;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+	if (req.type > KHWTEST_IRQ_SOFTWARE || req.devfn > 0xff)
+		return -EINVAL;
+
+	kirq = kzalloc(sizeof(*kirq), GFP_KERNEL);
+	if (!kirq)
+		return -ENOMEM;
+	kirq->type = req.type;
+	init_waitqueue_head(&kirq->wait);
+
+	if (req.eventfd >= 0) {
+		kirq->eventfd = eventfd_ctx_fdget(req.eventfd);
+		if (IS_ERR(kirq->eventfd)) {
+			res = PTR_ERR(kirq->eventfd);
+			kirq->eventfd = NULL;
+			goto err;
+		}
+	}
+	if (req.type != KHWTEST_IRQ_SOFTWARE) {
+		res = khwtest_irq_setup(kirq, &req);
+		if (res)
+			goto err;
+	}
+
+	req.irq = kirq->irq;
+	req.fd = fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		res = fd;
+		goto err;
+	}
+	if (copy_to_user(ureq, &req, sizeof(req))) {
+		put_unused_fd(fd);
+		res = -EFAULT;
+		goto err;
+	}
+	file = anon_inode_getfile("[khwtest-irq]", &khwtest_irq_fops, kirq,
+				  O_RDWR);
+	if (IS_ERR(file)) {
+		put_unused_fd(fd);
+		res = PTR_ERR(file);
+		goto err;
+	}
+	/* From here on the file owns the interrupt. */
+	fd_install(fd, file);
+	if (debug)
+		printk(KERN_DEBUG "%s: irq %d type %u on fd %d\n",
+		       THIS_MODULE->name, kirq->irq, kirq->type, fd);
+	return 0;
+err:
+	khwtest_irq_free(kirq);
+	return res;
+}
+
 static int 
 khwtest_open(struct inode *inode, struct file *file)
 {
@@ -78,6 +1031,16 @@ khwtest_open(struct inode *inode, struct file *file)
 	}
 	khwtest_init_pvt(pvt);
 	file->private_data = pvt;
+	mutex_lock(&khwtest_files_lock);
+	list_add_tail(&pvt->node, &khwtest_files);
+	mutex_unlock(&khwtest_files_lock);
+	if (pool_reserve > 0) {
+		int res = khwtest_pool_reserve(pvt, PAGE_SIZE, 32, pool_reserve);
+
+		if (res)
+			printk(KERN_WARNING "%s: Failed to reserve %d pool pages: %d.\n",
+			       THIS_MODULE->name, pool_reserve, res);
+	}
 	return 0;
 }
 
@@ -85,24 +1048,30 @@ static int
 khwtest_release(struct inode *inode, struct file *file)
 {
 	struct khwtest_pvt *pvt = file->private_data;
-	struct allocation *p, *tmp;
-	LIST_HEAD(local_list);
+	struct allocation *alloc, *tmp;
+	int handle;
+	int i, order;
 
 	if (!pvt) return 0;
 
-	spin_lock(&pvt->lock);
-	list_splice_init(&pvt->allocations, &local_list);
-	spin_unlock(&pvt->lock);
+	mutex_lock(&khwtest_files_lock);
+	list_del(&pvt->node);
+	mutex_unlock(&khwtest_files_lock);
 
-	list_for_each_entry_safe(p, tmp, &local_list, node) {
-		if (debug) {
-			printk(KERN_DEBUG "%s: Freeing memory at 0x%08lx.\n", 
-			       THIS_MODULE->name, (unsigned long)p->dma_handle);
+	/* Nothing can be mapped anymore since each mapping holds the file. */
+	idr_for_each_entry(&pvt->handles, alloc, handle) {
+		khwtest_count_dma(false, alloc->size);
+		khwtest_release_allocation(alloc);
+	}
+	idr_destroy(&pvt->handles);
+	for (i = 0; i < ARRAY_SIZE(pvt->pools); ++i) {
+		for (order = 0; order < KHWTEST_POOL_ORDERS; ++order) {
+			list_for_each_entry_safe(alloc, tmp,
+					&pvt->pools[i].free[order], pool_node)
+				khwtest_release_allocation(alloc);
 		}
-		list_del(&p->node);
-		pci_free_consistent(NULL, p->size, p->memory, p->dma_handle);
-		kfree(p);
 	}
+	kfree(pvt);
 	return 0;
 }
 
@@ -111,32 +1080,60 @@ khwtest_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long data)
 {
 	struct khwtest_pvt *pvt = file->private_data;
 	struct allocation *alloc;
+	struct khwtest_dma_alloc request;
+	struct khwtest_pool_reserve reserve;
+	struct khwtest_pool_stats stats;
 	__u32 physical_memory;
+	__u32 handle;
 
+	khwtest_count_ioctl(pvt, cmd);
 	switch(cmd) {
 	case KHWTEST_ALLOC_DMA_PAGE32:
-		if (!(alloc = kmalloc(sizeof(*alloc), GFP_KERNEL))) {
-			return -ENOMEM;
-		}
-		memset(alloc, 0, sizeof(*alloc));
-		alloc->memory = pci_alloc_consistent(NULL, PAGE_SIZE, &alloc->dma_handle); 
-		if (!alloc->memory) {
-			printk(KERN_ERR "%s: Failed to allocate consistent memory.\n", THIS_MODULE->name);
-			kfree(alloc);
-			return -ENOMEM;
-		}
-		alloc->size = PAGE_SIZE;
-		spin_lock(&pvt->lock);
-		list_add_tail(&alloc->node, &pvt->allocations);
-		spin_unlock(&pvt->lock);
-		if (debug) {
-			printk(KERN_DEBUG "%s: Allocating memory at 0x%08lx\n",
-			       THIS_MODULE->name, (unsigned long)alloc->dma_handle);
-		}
+		alloc = khwtest_alloc_dma(pvt, PAGE_SIZE, 0, 32);
+		if (IS_ERR(alloc))
+			return PTR_ERR(alloc);
 		*((unsigned long *)alloc->memory) = (unsigned long)alloc->dma_handle;
 		physical_memory = alloc->dma_handle;
-		return put_user(physical_memory, (unsigned long __user *)data);
+		return put_user(physical_memory, (__u32 __user *)data);
 		break;
+	case KHWTEST_ALLOC_DMA:
+		if (copy_from_user(&request, (void __user *)data, sizeof(request)))
+			return -EFAULT;
+		if (request.size > SIZE_MAX || request.align > SIZE_MAX)
+			return -EINVAL;
+		alloc = khwtest_alloc_dma(pvt, request.size, request.align,
+					  request.dma_bits);
+		if (IS_ERR(alloc))
+			return PTR_ERR(alloc);
+		request.handle = alloc->handle;
+		request.bus_address = alloc->dma_handle;
+		if (copy_to_user((void __user *)data, &request, sizeof(request))) {
+			khwtest_free_dma(pvt, alloc->handle);
+			return -EFAULT;
+		}
+		return 0;
+	case KHWTEST_FREE_DMA:
+		if (get_user(handle, (__u32 __user *)data))
+			return -EFAULT;
+		return khwtest_free_dma(pvt, handle);
+	case KHWTEST_POOL_RESERVE:
+		if (copy_from_user(&reserve, (void __user *)data, sizeof(reserve)))
+			return -EFAULT;
+		if (reserve.size > SIZE_MAX)
+			return -EINVAL;
+		return khwtest_pool_reserve(pvt, reserve.size, reserve.dma_bits,
+					    reserve.count);
+	case KHWTEST_POOL_STATS:
+		spin_lock(&pvt->lock);
+		stats = pvt->stats;
+		spin_unlock(&pvt->lock);
+		if (copy_to_user((void __user *)data, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	case KHWTEST_EXECUTE_BATCH:
+		return khwtest_execute_batch((struct khwtest_batch __user *)data);
+	case KHWTEST_IRQ_REQUEST:
+		return khwtest_irq_request((struct khwtest_irq_request __user *)data);
 	default:
 		return -ENOTTY;
 	};
@@ -158,10 +1155,14 @@ khwtest_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned
 static ssize_t khwtest_read(struct file * file, char __user * buf,
                         size_t count, loff_t *ppos)
 {
+        struct khwtest_pvt *pvt = file->private_data;
         unsigned long p = *ppos;
+        u64 start_ns = ktime_get_ns();
+        bool large = count >= stats_large;
         ssize_t read, sz;
         char *ptr;
 
+        khwtest_count(pvt, reads, 1);
         if (!valid_phys_addr_range(p, count))
                 return -EFAULT;
         read = 0;
@@ -212,6 +1213,9 @@ static ssize_t khwtest_read(struct file * file, char __user * buf,
         }
 
         *ppos += read;
+        khwtest_count(pvt, read_bytes, read);
+        if (large)
+                khwtest_count_latency(&khwtest_rw_latency, start_ns);
         return read;
 }
 
@@ -221,11 +1225,15 @@ static ssize_t khwtest_read(struct file * file, char __user * buf,
 static ssize_t khwtest_write(struct file * file, const char __user * buf, 
 			 size_t count, loff_t *ppos)
 {
+	struct khwtest_pvt *pvt = file->private_data;
 	unsigned long p = *ppos;
+	u64 start_ns = ktime_get_ns();
+	bool large = count >= stats_large;
 	ssize_t written, sz;
 	unsigned long copied;
 	void *ptr;
 
+	khwtest_count(pvt, writes, 1);
 	if (!valid_phys_addr_range(p, count))
 		return -EFAULT;
 
@@ -263,9 +1271,83 @@ static ssize_t khwtest_write(struct file * file, const char __user * buf,
 	}
 
 	*ppos += written;
+	khwtest_count(pvt, write_bytes, written);
+	if (large)
+		khwtest_count_latency(&khwtest_rw_latency, start_ns);
 	return written;
 }
 
+/*
+ * Maps a DMA allocation into the caller.  The file offset is the dma handle
+ * returned when the memory was allocated, which lets userspace access the
+ * buffer directly instead of with a read / write per access.
+ * dma_mmap_coherent picks the caching attributes that match the kernel's
+ * view of the memory.  An allocation cannot be freed while it is mapped.
+ */
+static void khwtest_vma_open(struct vm_area_struct *vma)
+{
+	struct khwtest_pvt *pvt = vma->vm_file->private_data;
+	struct allocation *alloc = vma->vm_private_data;
+
+	spin_lock(&pvt->lock);
+	++alloc->map_count;
+	spin_unlock(&pvt->lock);
+}
+
+static void khwtest_vma_close(struct vm_area_struct *vma)
+{
+	struct khwtest_pvt *pvt = vma->vm_file->private_data;
+	struct allocation *alloc = vma->vm_private_data;
+
+	spin_lock(&pvt->lock);
+	--alloc->map_count;
+	spin_unlock(&pvt->lock);
+}
+
+static const struct vm_operations_struct khwtest_vm_ops = {
+	.open = khwtest_vma_open,
+	.close = khwtest_vma_close,
+};
+
+static int khwtest_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct khwtest_pvt *pvt = file->private_data;
+	struct allocation *alloc;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	u64 address = (u64)vma->vm_pgoff << PAGE_SHIFT;
+	int res;
+
+	spin_lock(&pvt->lock);
+	alloc = khwtest_find_allocation(pvt, address);
+	if (alloc && address + size <= (u64)alloc->dma_handle + alloc->size)
+		++alloc->map_count;
+	else
+		alloc = NULL;
+	spin_unlock(&pvt->lock);
+
+	if (!alloc)
+		return -EINVAL;
+
+	if (debug) {
+		printk(KERN_DEBUG "%s: Mapping memory at 0x%08llx.\n",
+		       THIS_MODULE->name, (unsigned long long)alloc->dma_handle);
+	}
+
+	/* dma_mmap_coherent treats the offset as relative to the buffer. */
+	vma->vm_pgoff = (address - alloc->dma_handle) >> PAGE_SHIFT;
+	res = dma_mmap_coherent(alloc->dev, vma, alloc->memory,
+				alloc->dma_handle, alloc->size);
+	if (res) {
+		spin_lock(&pvt->lock);
+		--alloc->map_count;
+		spin_unlock(&pvt->lock);
+		return res;
+	}
+	vma->vm_private_data = alloc;
+	vma->vm_ops = &khwtest_vm_ops;
+	return 0;
+}
+
 static loff_t khwtest_lseek(struct file * file, loff_t offset, int orig)
 {
 	switch (orig) {
@@ -293,8 +1375,165 @@ struct file_operations khwtest_fops = {
 	write: khwtest_write,
 	llseek: khwtest_lseek,
 	read: khwtest_read,
+	mmap: khwtest_mmap,
+};
+
+static const char *const khwtest_ioctl_names[KHWTEST_IOCTL_NR] = {
+	[0] = "unknown",
+	[_IOC_NR(KHWTEST_ALLOC_DMA_PAGE32)] = "alloc_dma_page32",
+	[_IOC_NR(KHWTEST_EXECUTE_BATCH)] = "execute_batch",
+	[_IOC_NR(KHWTEST_ALLOC_DMA)] = "alloc_dma",
+	[_IOC_NR(KHWTEST_FREE_DMA)] = "free_dma",
+	[_IOC_NR(KHWTEST_POOL_RESERVE)] = "pool_reserve",
+	[_IOC_NR(KHWTEST_POOL_STATS)] = "pool_stats",
+	[_IOC_NR(KHWTEST_IRQ_REQUEST)] = "irq_request",
 };
 
+static void khwtest_read_counters(struct khwtest_counts *counts,
+				  struct khwtest_counters *counters)
+{
+	int nr;
+
+	counts->reads = atomic64_read(&counters->reads);
+	counts->read_bytes = atomic64_read(&counters->read_bytes);
+	counts->writes = atomic64_read(&counters->writes);
+	counts->write_bytes = atomic64_read(&counters->write_bytes);
+	for (nr = 0; nr < KHWTEST_IOCTL_NR; ++nr)
+		counts->ioctls[nr] = atomic64_read(&counters->ioctls[nr]);
+}
+
+static void khwtest_sum_counts(struct khwtest_counts *counts)
+{
+	struct khwtest_counts *cpu_counts;
+	int cpu, nr;
+
+	memset(counts, 0, sizeof(*counts));
+	for_each_possible_cpu(cpu) {
+		cpu_counts = per_cpu_ptr(&khwtest_counts, cpu);
+		counts->reads += READ_ONCE(cpu_counts->reads);
+		counts->read_bytes += READ_ONCE(cpu_counts->read_bytes);
+		counts->writes += READ_ONCE(cpu_counts->writes);
+		counts->write_bytes += READ_ONCE(cpu_counts->write_bytes);
+		for (nr = 0; nr < KHWTEST_IOCTL_NR; ++nr)
+			counts->ioctls[nr] += READ_ONCE(cpu_counts->ioctls[nr]);
+	}
+}
+
+static void
+khwtest_show_counts(struct seq_file *m, struct khwtest_counts *counts)
+{
+	int nr;
+
+	seq_printf(m, "reads %llu read_bytes %llu writes %llu write_bytes %llu\n",
+		   counts->reads, counts->read_bytes, counts->writes,
+		   counts->write_bytes);
+	seq_puts(m, "ioctls");
+	for (nr = 0; nr < KHWTEST_IOCTL_NR; ++nr) {
+		if (khwtest_ioctl_names[nr])
+			seq_printf(m, " %s %llu", khwtest_ioctl_names[nr],
+				   counts->ioctls[nr]);
+	}
+	seq_puts(m, "\n");
+}
+
+static int khwtest_stats_show(struct seq_file *m, void *unused)
+{
+	u64 live, live_bytes, live_high_water, live_bytes_high_water;
+	struct khwtest_counts counts;
+
+	spin_lock(&khwtest_dma_lock);
+	live = khwtest_dma.live;
+	live_bytes = khwtest_dma.live_bytes;
+	live_high_water = khwtest_dma.live_high_water;
+	live_bytes_high_water = khwtest_dma.live_bytes_high_water;
+	spin_unlock(&khwtest_dma_lock);
+
+	khwtest_sum_counts(&counts);
+	khwtest_show_counts(m, &counts);
+	seq_printf(m, "dma_live %llu dma_live_bytes %llu dma_high_water %llu dma_bytes_high_water %llu\n",
+		   live, live_bytes, live_high_water, live_bytes_high_water);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(khwtest_stats);
+
+/* One block per open file, headed by the process that opened it. */
+static int khwtest_files_show(struct seq_file *m, void *unused)
+{
+	struct khwtest_pvt *pvt;
+	struct khwtest_pool_stats stats;
+	struct khwtest_counts counts;
+
+	mutex_lock(&khwtest_files_lock);
+	list_for_each_entry(pvt, &khwtest_files, node) {
+		spin_lock(&pvt->lock);
+		stats = pvt->stats;
+		spin_unlock(&pvt->lock);
+
+		seq_printf(m, "pid %d comm %s\n", pvt->pid, pvt->comm);
+		khwtest_read_counters(&counts, &pvt->counters);
+		khwtest_show_counts(m, &counts);
+		seq_printf(m, "dma_live %llu dma_live_bytes %llu dma_high_water %llu dma_bytes_high_water %llu\n",
+			   stats.live, stats.live_bytes, stats.live_high_water,
+			   stats.live_bytes_high_water);
+		seq_printf(m, "pool_hits %llu pool_misses %llu pool_cached %llu pool_cached_bytes %llu\n\n",
+			   stats.hits, stats.misses, stats.cached,
+			   stats.cached_bytes);
+	}
+	mutex_unlock(&khwtest_files_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(khwtest_files);
+
+/* Lists the non-empty buckets as: upper bound in ns, count. */
+static void khwtest_show_histogram(struct seq_file *m,
+				   struct khwtest_histogram *hist)
+{
+	int n;
+	s64 count;
+
+	seq_puts(m, "ns_below count\n");
+	for (n = 0; n < KHWTEST_HIST_BUCKETS; ++n) {
+		count = atomic64_read(&hist->buckets[n]);
+		if (!count)
+			continue;
+		if (n == KHWTEST_HIST_BUCKETS - 1)
+			seq_printf(m, "inf %lld\n", count);
+		else
+			seq_printf(m, "%llu %lld\n", 1ULL << n, count);
+	}
+}
+
+static int khwtest_alloc_latency_show(struct seq_file *m, void *unused)
+{
+	khwtest_show_histogram(m, &khwtest_alloc_latency);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(khwtest_alloc_latency);
+
+static int khwtest_rw_latency_show(struct seq_file *m, void *unused)
+{
+	khwtest_show_histogram(m, &khwtest_rw_latency);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(khwtest_rw_latency);
+
+/*
+ * debugfs is only for looking at, so a failure here is not worth failing
+ * the load for; the debugfs calls accept the error values of earlier ones.
+ */
+static void khwtest_debugfs_init(void)
+{
+	khwtest_debugfs = debugfs_create_dir("khwtest", NULL);
+	debugfs_create_file("stats", 0444, khwtest_debugfs, NULL,
+			    &khwtest_stats_fops);
+	debugfs_create_file("files", 0444, khwtest_debugfs, NULL,
+			    &khwtest_files_fops);
+	debugfs_create_file("alloc_latency", 0444, khwtest_debugfs, NULL,
+			    &khwtest_alloc_latency_fops);
+	debugfs_create_file("rw_latency", 0444, khwtest_debugfs, NULL,
+			    &khwtest_rw_latency_fops);
+}
+
 static struct miscdevice khwtest_dev = {
 	MISC_DYNAMIC_MINOR,
 	"khwtest",
@@ -305,12 +1544,38 @@ static int __init
 khwtest_init(void)
 {
 	int res = 0;
+	struct platform_device_info dma32_info = {
+		.name = "khwtest",
+		.id = 32,
+		.dma_mask = DMA_BIT_MASK(32),
+	};
+
+	struct platform_device_info dma64_info = {
+		.name = "khwtest",
+		.id = 64,
+		.dma_mask = DMA_BIT_MASK(64),
+	};
+
+	khwtest_dma32 = platform_device_register_full(&dma32_info);
+	if (IS_ERR(khwtest_dma32)) {
+		printk(KERN_ERR "%s: Failed to register DMA device.\n", THIS_MODULE->name);
+		return PTR_ERR(khwtest_dma32);
+	}
+	khwtest_dma64 = platform_device_register_full(&dma64_info);
+	if (IS_ERR(khwtest_dma64)) {
+		printk(KERN_ERR "%s: Failed to register DMA device.\n", THIS_MODULE->name);
+		platform_device_unregister(khwtest_dma32);
+		return PTR_ERR(khwtest_dma64);
+	}
 
 	res = misc_register(&khwtest_dev);
 	if (res) {
 		printk(KERN_ERR "%s: Failed call to misc_register.\n", THIS_MODULE->name);
+		platform_device_unregister(khwtest_dma64);
+		platform_device_unregister(khwtest_dma32);
 		return -EFAULT;
 	}
+	khwtest_debugfs_init();
 	printk(KERN_WARNING "%s: This module is completely unsafe and " \
 	       "should only be used for hardware testing and bring up.\n",
 	       THIS_MODULE->name);
@@ -320,10 +1585,19 @@ khwtest_init(void)
 static void __exit
 khwtest_exit(void)
 {
+	debugfs_remove_recursive(khwtest_debugfs);
 	misc_deregister(&khwtest_dev);
+	platform_device_unregister(khwtest_dma64);
+	platform_device_unregister(khwtest_dma32);
 }
 
 module_param(debug, int, 0644);
+module_param(pool_reserve, int, 0644);
+MODULE_PARM_DESC(pool_reserve, "Pages reserved in the DMA pool of each open file.");
+module_param(pool_max, int, 0644);
+MODULE_PARM_DESC(pool_max, "Maximum freed buffers kept per DMA pool size class.");
+module_param(stats_large, uint, 0644);
+MODULE_PARM_DESC(stats_large, "Reads and writes of at least this many bytes are timed in debugfs.");
 module_init(khwtest_init);
 module_exit(khwtest_exit);
 MODULE_LICENSE("GPL");
@@ -29,5 +29,130 @@
  *
  * NOTE:  There is no corresponding free.  All the pages allocated via a
  * particular open device file are closed when that file handle is closed.
+ *
+ * The page can be mapped into the caller by calling mmap on the same file
+ * with the returned address as the offset.
  */
 #define KHWTEST_ALLOC_DMA_PAGE32 _IOR(KHWTEST_CODE, 1, __u32)
+
+/* Operations for KHWTEST_EXECUTE_BATCH. */
+#define KHWTEST_OP_READ		0	/* value = *address */
+#define KHWTEST_OP_WRITE	1	/* *address = value */
+#define KHWTEST_OP_RMW		2	/* *address = (*address & ~mask) | (value & mask) */
+#define KHWTEST_OP_DELAY	3	/* wait value nanoseconds */
+#define KHWTEST_OP_POLL		4	/* wait until (*address & mask) == (value & mask) */
+
+struct khwtest_op {
+	__u32 op;
+	__u32 width;		/* Access width in bytes: 1, 2, 4 or 8. */
+	__u64 address;
+	__u64 value;		/* Replaced by the value read, if any. */
+	__u64 mask;
+	__u64 timeout_ns;	/* Only used by KHWTEST_OP_POLL. */
+};
+
+struct khwtest_batch {
+	__u64 ops;		/* Userspace pointer to struct khwtest_op[count]. */
+	__u32 count;
+	__u32 completed;	/* Set to the number of operations that ran. */
+};
+
+/* Runs a list of register accesses in one call.  Addresses in system RAM are
+ * accessed directly and everything else through ioremap.  Processing stops
+ * at the first failing operation (for example -ETIMEDOUT from a poll), and
+ * completed tells how far it got.
+ */
+#define KHWTEST_EXECUTE_BATCH _IOWR(KHWTEST_CODE, 2, struct khwtest_batch)
+
+struct khwtest_dma_alloc {
+	__u64 size;		/* In: bytes to allocate. */
+	__u64 align;		/* In: required alignment, a power of two, or 0. */
+	__u32 dma_bits;		/* In: DMA mask of the device, 32 or 64. */
+	__u32 handle;		/* Out: handle to pass to KHWTEST_FREE_DMA. */
+	__u64 bus_address;	/* Out: address to give to the device. */
+};
+
+/* Allocates a physically contiguous, coherent DMA buffer of any size.  Like
+ * the pages from KHWTEST_ALLOC_DMA_PAGE32 it can be mapped with mmap using
+ * the bus address as the offset.
+ */
+#define KHWTEST_ALLOC_DMA _IOWR(KHWTEST_CODE, 3, struct khwtest_dma_alloc)
+
+/* Frees one allocation by handle.  Fails with EBUSY while it is mapped. */
+#define KHWTEST_FREE_DMA _IOW(KHWTEST_CODE, 4, __u32)
+
+struct khwtest_pool_reserve {
+	__u64 size;		/* Buffer size, rounded up to its size class. */
+	__u32 dma_bits;		/* DMA mask of the device, 32 or 64. */
+	__u32 count;		/* Number of buffers to add to the pool. */
+};
+
+/* Pre-allocates buffers into the pool of freed buffers of the file, so that
+ * later allocations of that size are served without calling the DMA API.
+ * The pool is only filled up to the pool_max module parameter.
+ */
+#define KHWTEST_POOL_RESERVE _IOW(KHWTEST_CODE, 5, struct khwtest_pool_reserve)
+
+struct khwtest_pool_stats {
+	__u64 hits;		/* Allocations served from the pool. */
+	__u64 misses;		/* Allocations that went to the DMA API. */
+	__u64 recycled;		/* Frees that returned a buffer to the pool. */
+	__u64 released;		/* Frees that returned a buffer to the DMA API. */
+	__u64 live;
+	__u64 live_bytes;
+	__u64 live_high_water;
+	__u64 live_bytes_high_water;
+	__u64 cached;		/* Buffers currently waiting in the pool. */
+	__u64 cached_bytes;
+};
+
+#define KHWTEST_POOL_STATS _IOR(KHWTEST_CODE, 6, struct khwtest_pool_stats)
+
+/* Sources for KHWTEST_IRQ_REQUEST. */
+#define KHWTEST_IRQ_LEGACY	0	/* INTx line of a PCI device, may be shared. */
+#define KHWTEST_IRQ_MSI		1	/* MSI or MSI-X vector of a PCI device. */
+#define KHWTEST_IRQ_SOFTWARE	2	/* No device, only KHWTEST_IRQ_TRIGGER. */
+
+struct khwtest_irq_request {
+	__u32 type;		/* In: one of KHWTEST_IRQ_*. */
+	__u32 domain;		/* In: PCI device, unused for software. */
+	__u32 bus;
+	__u32 devfn;
+	__u32 vector;		/* In: MSI vector index. */
+	__s32 eventfd;		/* In: eventfd to signal as well, or -1. */
+	__s32 fd;		/* Out: file to wait on. */
+	__u32 irq;		/* Out: Linux interrupt number, 0 for software. */
+};
+
+/* Installs a handler for an interrupt and returns a new file for it.  The
+ * handler timestamps the interrupt, bumps a counter and wakes up the file,
+ * which can be waited on with poll and read.  A read blocks until at least
+ * one interrupt arrived since the last read and returns a struct
+ * khwtest_irq_event.  Closing the file frees the interrupt.
+ *
+ * The device must not be bound to another driver (EBUSY), and only one
+ * MSI request can be open per device.  Legacy interrupts are masked with
+ * the INTx disable bit by the handler until KHWTEST_IRQ_UNMASK, after the
+ * test has acknowledged them in the device.
+ */
+#define KHWTEST_IRQ_REQUEST _IOWR(KHWTEST_CODE, 7, struct khwtest_irq_request)
+
+struct khwtest_irq_event {
+	__u64 count;		/* Interrupts since the request. */
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC time of the last one. */
+};
+
+struct khwtest_irq_info {
+	__u64 count;
+	__u64 timestamp_ns;
+	__u64 unhandled;	/* Shared interrupts that were not ours. */
+	__u32 irq;
+	__u32 type;
+};
+
+/* ioctls on the file from KHWTEST_IRQ_REQUEST.  TRIGGER runs the same path
+ * as the handler, for testing the consumer or measuring wake up latency.
+ */
+#define KHWTEST_IRQ_TRIGGER _IO(KHWTEST_CODE, 8)
+#define KHWTEST_IRQ_UNMASK _IO(KHWTEST_CODE, 9)
+#define KHWTEST_IRQ_INFO _IOR(KHWTEST_CODE, 10, struct khwtest_irq_info)
@@ -1,8 +1,19 @@
 #!/usr/bin/env python
 # vim: ai ts=4 sts=4 et sw=4
-from distutils.core import setup, Extension
+import sys
+try:
+    from setuptools import setup, Extension
+except ImportError:
+    # distutils is gone from Python 3.12, but old Python 2 installs may
+    # not have setuptools.
+    if sys.version_info[0] >= 3:
+        raise
+    from distutils.core import setup, Extension
+py_modules = ['hwtest',]
+if sys.version_info[0] >= 3:
+    py_modules.append('hwtest_async')
 setup(name='hwtest', 
       version="0.1", 
-      py_modules=['hwtest',],
+      py_modules=py_modules,
       ext_modules=[Extension('chwtest', ['chwtest.c'])],
       )